@@ -0,0 +1,1039 @@
+/*
+ * Benchmarks of the ctrie library. Run without arguments to get the list of
+ * available benchmarks. All benchmarks use the words in `WORDS_FILE` as keys.
+ */
+
+#include "ctrie.h"
+#include "ctrie_io.h"
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <malloc.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define WORDS_FILE    "words.txt"
+#define MB            (1024 * 1024)
+#define SCAN_DEF_MB   64
+#define SCAN_NAIVE_MB 1
+#define CURSOR_NLOG   1000000
+#define COUNT_DEF_N   4000000
+#define PREFIX_NT     100
+#define PREFIX_NK     10000
+#define PREFIX_NDROP  10
+#define FREE_DEF_N    10000000
+#define WAL_NCOMMIT   1000
+#define WAL_CHURN     10
+#define URLS_DEF_N    1000000
+#define ZIPF_DEF_S    1.1
+#define ZIPF_DEF_SIZE 16384
+#define ZIPF_N        4000000
+#define ZIPF_WRITES   1000
+
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+/*
+ * Words read from `WORDS_FILE`.
+ */
+struct words
+{
+	char **w;       /* the words */
+	size_t n;       /* number of words */
+	size_t max_len; /* length of the longest word */
+};
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void read_words(struct words *words)
+{
+	FILE *f = fopen(WORDS_FILE, "r");
+	if (!f) {
+		perror(WORDS_FILE);
+		exit(EXIT_FAILURE);
+	}
+	char *line = NULL;
+	size_t line_size = 0, size = 0;
+	ssize_t len;
+	words->w = NULL;
+	words->n = words->max_len = 0;
+	while ((errno = 0, len = getline(&line, &line_size, f)) > 0) {
+		line[len - 1] = '\0';
+		if (words->n >= size) {
+			size = size ? 2 * size : 1024;
+			words->w = realloc(words->w, size * sizeof(*words->w));
+			assert(words->w);
+		}
+		words->w[words->n++] = strdup(line);
+		if ((size_t)len - 1 > words->max_len)
+			words->max_len = len - 1;
+	}
+	if (errno) {
+		perror("getline");
+		exit(EXIT_FAILURE);
+	}
+	free(line);
+	fclose(f);
+}
+
+static void free_words(struct words *words)
+{
+	for (size_t i = 0; i < words->n; i++)
+		free(words->w[i]);
+	free(words->w);
+}
+
+/*
+ * Return the resident set size of the process in bytes.
+ */
+static size_t rss(void)
+{
+	size_t size, resident = 0;
+	FILE *f = fopen("/proc/self/statm", "r");
+	if (f) {
+		if (fscanf(f, "%zu %zu", &size, &resident) != 2)
+			resident = 0;
+		fclose(f);
+	}
+	return resident * sysconf(_SC_PAGESIZE);
+}
+
+static void count_cb(size_t end, size_t len, void *data, void *arg)
+{
+	(*(size_t *)arg)++;
+}
+
+/*
+ * Aho-Corasick scanning of a text made of random words from the dictionary,
+ * compared to a lookup of every substring of (a prefix of) the text.
+ */
+static void bench_scan(int argc, char **argv)
+{
+	size_t text_len = (argc > 0 ? atol(argv[0]) : SCAN_DEF_MB) * (size_t)MB;
+	struct words words;
+	struct ctrie t;
+	struct ctrie_ac ac;
+
+	read_words(&words);
+	ctrie_init(&t, 0);
+	for (size_t i = 0; i < words.n; i++)
+		ctrie_insert(&t, words.w[i], false);
+
+	char *text = malloc(text_len);
+	assert(text);
+	for (size_t i = 0; i < text_len; ) {
+		const char *w = words.w[rand() % words.n];
+		for (; *w && i < text_len; w++)
+			text[i++] = *w;
+		if (i < text_len)
+			text[i++] = ' ';
+	}
+
+	double start = now();
+	ctrie_ac_init(&t, &ac);
+	printf("automaton: %zu states, built in %.3f s\n",
+		ac.nstates, now() - start);
+
+	size_t nmatches = 0;
+	start = now();
+	ctrie_scan(&ac, text, text_len, count_cb, &nmatches);
+	double secs = now() - start;
+	printf("ctrie_scan: %zu MB in %.3f s (%.1f MB/s), %zu matches\n",
+		text_len / MB, secs, text_len / secs / MB, nmatches);
+
+	size_t naive_len = text_len < SCAN_NAIVE_MB * MB
+		? text_len : SCAN_NAIVE_MB * MB;
+	char *key = malloc(words.max_len + 1);
+	assert(key);
+	nmatches = 0;
+	start = now();
+	for (size_t i = 0; i < naive_len; i++) {
+		for (size_t len = 1; len <= words.max_len; len++) {
+			if (i + len > naive_len)
+				break;
+			memcpy(key, text + i, len);
+			key[len] = '\0';
+			nmatches += ctrie_contains(&t, key);
+		}
+	}
+	secs = now() - start;
+	printf("ctrie_contains per offset: %zu MB in %.3f s (%.1f MB/s), "
+		"%zu matches\n", naive_len / MB, secs, naive_len / secs / MB,
+		nmatches);
+
+	free(key);
+	free(text);
+	ctrie_ac_free(&ac);
+	ctrie_free(&t);
+	free_words(&words);
+}
+
+static int cmp_words(const void *a, const void *b)
+{
+	return strcmp(*(char **)a, *(char **)b);
+}
+
+/*
+ * Time insertion and lookup of (sorted) `keys`, with and without a cursor.
+ */
+static void bench_cursor_keys(char **keys, size_t n)
+{
+	struct ctrie t;
+	struct ctrie_cursor c;
+
+	double start = now();
+	ctrie_init(&t, sizeof(size_t));
+	for (size_t i = 0; i < n; i++)
+		*(size_t *)ctrie_insert(&t, keys[i], false) = i;
+	printf("\tctrie_insert: %.3f s\n", now() - start);
+	start = now();
+	for (size_t i = 0; i < n; i++)
+		if (*(size_t *)ctrie_find(&t, keys[i]) != i)
+			abort();
+	printf("\tctrie_find: %.3f s\n", now() - start);
+	ctrie_free(&t);
+
+	start = now();
+	ctrie_init(&t, sizeof(size_t));
+	ctrie_cursor_init(&t, &c);
+	for (size_t i = 0; i < n; i++)
+		*(size_t *)ctrie_cursor_insert(&c, keys[i], false) = i;
+	printf("\tctrie_cursor_insert: %.3f s\n", now() - start);
+	start = now();
+	for (size_t i = 0; i < n; i++)
+		if (*(size_t *)ctrie_cursor_find(&c, keys[i]) != i)
+			abort();
+	printf("\tctrie_cursor_find: %.3f s\n", now() - start);
+	ctrie_cursor_free(&c);
+	ctrie_free(&t);
+}
+
+/*
+ * Insertion and lookup of sorted keys, with and without a cursor. Both the
+ * dictionary words and synthetic log-like keys with long shared prefixes
+ * are used.
+ */
+static void bench_cursor(int argc, char **argv)
+{
+	struct words words;
+	read_words(&words);
+	qsort(words.w, words.n, sizeof(*words.w), cmp_words);
+	printf("%zu sorted words:\n", words.n);
+	bench_cursor_keys(words.w, words.n);
+	free_words(&words);
+
+	size_t n = CURSOR_NLOG;
+	char **keys = malloc(n * sizeof(*keys));
+	assert(keys);
+	for (size_t i = 0; i < n; i++) {
+		char buf[128];
+		snprintf(buf, sizeof(buf),
+			"service:frontend:host:%04zu:2026-10-17T%02zu:%02zu:%02zu:req:%zu",
+			i / 100000, i / 3600 % 24, i / 60 % 60, i % 60, i);
+		keys[i] = strdup(buf);
+	}
+	qsort(keys, n, sizeof(*keys), cmp_words);
+	printf("%zu sorted log keys:\n", n);
+	bench_cursor_keys(keys, n);
+	for (size_t i = 0; i < n; i++)
+		free(keys[i]);
+	free(keys);
+}
+
+/*
+ * Memory consumption and lookup speed of a trie holding the dictionary.
+ */
+static void bench_mem(int argc, char **argv)
+{
+	size_t data_size = argc > 0 ? atol(argv[0]) : 0;
+	struct words words;
+	struct ctrie t;
+
+	read_words(&words);
+	size_t before = rss();
+	double start = now();
+	ctrie_init(&t, data_size);
+	for (size_t i = 0; i < words.n; i++)
+		ctrie_insert(&t, words.w[i], false);
+	double secs = now() - start;
+	size_t bytes = rss() - before;
+	printf("%zu keys, data_size %zu: %.1f MB (%.1f B/key), "
+		"inserted in %.3f s\n", words.n, data_size, bytes / (double)MB,
+		bytes / (double)words.n, secs);
+
+	start = now();
+	for (size_t i = 0; i < words.n; i++)
+		if (!ctrie_contains(&t, words.w[i]))
+			abort();
+	printf("ctrie_contains: %.1f ns/key\n",
+		(now() - start) / words.n * 1e9);
+
+	ctrie_free(&t);
+	free_words(&words);
+}
+
+/*
+ * Count the occurrences of the `n` words of `stream`, first by a lookup
+ * followed by an insert of missing words, then by a single `ctrie_upsert`.
+ */
+static void bench_count_stream(char **stream, size_t n)
+{
+	struct ctrie t;
+	bool inserted;
+	size_t *d;
+
+	double start = now();
+	ctrie_init(&t, sizeof(size_t));
+	for (size_t i = 0; i < n; i++) {
+		if (!(d = ctrie_find(&t, stream[i])))
+			d = ctrie_insert(&t, stream[i], false);
+		++*d;
+	}
+	printf("\tctrie_find + ctrie_insert: %.3f s\n", now() - start);
+	ctrie_free(&t);
+
+	start = now();
+	ctrie_init(&t, sizeof(size_t));
+	size_t distinct = 0;
+	for (size_t i = 0; i < n; i++) {
+		d = ctrie_upsert(&t, stream[i], &inserted);
+		++*d;
+		distinct += inserted;
+	}
+	printf("\tctrie_upsert: %.3f s (%zu distinct)\n",
+		now() - start, distinct);
+	ctrie_free(&t);
+}
+
+/*
+ * Word frequency counting of a stream of dictionary words skewed towards the
+ * beginning of the dictionary, and deduplication of the shuffled dictionary.
+ */
+static void bench_count(int argc, char **argv)
+{
+	size_t n = argc > 0 ? atol(argv[0]) : COUNT_DEF_N;
+	struct words words;
+
+	read_words(&words);
+	char **stream = malloc(MAX(n, words.n) * sizeof(*stream));
+	assert(stream);
+	for (size_t i = 0; i < n; i++) {
+		double r = rand() / (RAND_MAX + 1.0);
+		stream[i] = words.w[(size_t)(r * r * r * words.n)];
+	}
+	printf("%zu skewed words:\n", n);
+	bench_count_stream(stream, n);
+
+	for (size_t i = 0; i < words.n; i++) {
+		size_t j = rand() % (i + 1);
+		stream[i] = stream[j];
+		stream[j] = words.w[i];
+	}
+	printf("%zu shuffled words:\n", words.n);
+	bench_count_stream(stream, words.n);
+
+	free(stream);
+	free_words(&words);
+}
+
+/*
+ * Eviction of every key of the dictionary in random order, reading its data
+ * first. Compares `ctrie_find` followed by `ctrie_remove` with `ctrie_take`.
+ */
+static void bench_evict(int argc, char **argv)
+{
+	struct words words;
+	struct ctrie t;
+	size_t sum = 0, v;
+
+	read_words(&words);
+	for (size_t i = 0; i < words.n; i++) {
+		size_t j = rand() % (i + 1);
+		char *w = words.w[i];
+		words.w[i] = words.w[j];
+		words.w[j] = w;
+	}
+
+	for (int take = 0; take < 2; take++) {
+		ctrie_init(&t, sizeof(size_t));
+		for (size_t i = 0; i < words.n; i++)
+			*(size_t *)ctrie_insert(&t, words.w[i], false) = i;
+		double start = now();
+		for (size_t i = words.n; i--; ) {
+			if (take) {
+				if (!ctrie_take(&t, words.w[i], &v))
+					abort();
+			} else {
+				size_t *d = ctrie_find(&t, words.w[i]);
+				if (!d)
+					abort();
+				v = *d;
+				ctrie_remove(&t, words.w[i]);
+			}
+			sum += v;
+		}
+		printf("%zu keys, %s: %.3f s\n", words.n,
+			take ? "ctrie_take" : "ctrie_find + ctrie_remove",
+			now() - start);
+		ctrie_free(&t);
+	}
+	assert(sum == words.n * (words.n - 1));
+
+	free_words(&words);
+}
+
+/*
+ * Fill `t` with `PREFIX_NK` keys of each of `PREFIX_NT` tenants.
+ */
+static void fill_tenants(struct ctrie *t)
+{
+	char key[64];
+	ctrie_init(t, sizeof(size_t));
+	for (size_t i = 0; i < PREFIX_NT; i++) {
+		for (size_t j = 0; j < PREFIX_NK; j++) {
+			snprintf(key, sizeof(key), "tenant:%zu:obj:%zu", i, j * 7919);
+			ctrie_insert(t, key, false);
+		}
+	}
+}
+
+/*
+ * Dropping all keys of some tenants, by removing the keys one by one and by
+ * `ctrie_remove_prefix`. Collecting the keys to remove is not timed.
+ */
+static void bench_prefix(int argc, char **argv)
+{
+	struct ctrie t;
+	struct ctrie_iter it;
+	char prefix[64];
+	char *key = NULL;
+	size_t key_size = 0, count = 0;
+
+	fill_tenants(&t);
+	char **keys = malloc(PREFIX_NK * sizeof(*keys));
+	assert(keys);
+	double secs = 0;
+	for (size_t i = 0; i < PREFIX_NDROP; i++) {
+		snprintf(prefix, sizeof(prefix), "tenant:%zu:", i * 7);
+		size_t plen = strlen(prefix), n = 0;
+		ctrie_iter_init(&t, &it);
+		while (ctrie_iter_next(&it, &key, &key_size))
+			if (!strncmp(key, prefix, plen))
+				keys[n++] = strdup(key);
+		ctrie_iter_free(&it);
+		double start = now();
+		for (size_t j = 0; j < n; j++)
+			ctrie_remove(&t, keys[j]);
+		secs += now() - start;
+		for (size_t j = 0; j < n; j++)
+			free(keys[j]);
+		count += n;
+	}
+	printf("%zu keys of %d tenants, ctrie_remove: %.3f s\n",
+		count, PREFIX_NDROP, secs);
+	ctrie_free(&t);
+	free(keys);
+	free(key);
+
+	fill_tenants(&t);
+	count = 0;
+	double start = now();
+	for (size_t i = 0; i < PREFIX_NDROP; i++) {
+		snprintf(prefix, sizeof(prefix), "tenant:%zu:", i * 7);
+		count += ctrie_remove_prefix(&t, prefix);
+	}
+	printf("%zu keys of %d tenants, ctrie_remove_prefix: %.3f s\n",
+		count, PREFIX_NDROP, now() - start);
+	ctrie_free(&t);
+}
+
+static void bench_free(int argc, char **argv)
+{
+	size_t n = argc > 0 ? atol(argv[0]) : FREE_DEF_N;
+	struct ctrie t;
+	char key[64];
+
+	ctrie_init(&t, sizeof(size_t));
+	for (size_t i = 0; i < n; i++) {
+		snprintf(key, sizeof(key), "user:%zx:session:%zu", i * 2654435761u, i);
+		*(size_t *)ctrie_insert(&t, key, false) = i;
+	}
+	double start = now();
+	ctrie_free(&t);
+	printf("%zu keys, ctrie_free: %.3f s\n", n, now() - start);
+}
+
+static void wal_unlink(const char *dir)
+{
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/log", dir);
+	unlink(path);
+	snprintf(path, sizeof(path), "%s/checkpoint", dir);
+	unlink(path);
+}
+
+/*
+ * Build a trie through the log, checkpoint it and change `WAL_CHURN` percent
+ * of the keys, then recover it.
+ */
+static void bench_wal(int argc, char **argv)
+{
+	char tmp[] = "/tmp/ctrie-bench-XXXXXX";
+	const char *dir = argc > 0 ? argv[0] : mkdtemp(tmp);
+	struct words words;
+	struct ctrie t;
+	struct ctrie_wal w;
+
+	if (!dir) {
+		perror("mkdtemp");
+		exit(EXIT_FAILURE);
+	}
+	read_words(&words);
+	wal_unlink(dir);
+
+	ctrie_init(&t, sizeof(size_t));
+	double start = now();
+	for (size_t i = 0; i < words.n; i++)
+		*(size_t *)ctrie_insert(&t, words.w[i], false) = i;
+	printf("%zu keys, ctrie_insert: %.3f s\n", words.n, now() - start);
+	ctrie_free(&t);
+
+	ctrie_init(&t, sizeof(size_t));
+	if (ctrie_wal_open(&w, &t, dir)) {
+		perror(dir);
+		exit(EXIT_FAILURE);
+	}
+	start = now();
+	for (size_t i = 0; i < words.n; i++) {
+		if (!ctrie_wal_insert(&w, words.w[i], false, &i)
+		    || (i % WAL_NCOMMIT == 0 && ctrie_wal_commit(&w))) {
+			perror("ctrie_wal");
+			exit(EXIT_FAILURE);
+		}
+	}
+	printf("%zu keys, ctrie_wal_insert, commit every %d: %.3f s\n",
+		words.n, WAL_NCOMMIT, now() - start);
+	start = now();
+	if (ctrie_wal_checkpoint(&w)) {
+		perror("ctrie_wal_checkpoint");
+		exit(EXIT_FAILURE);
+	}
+	printf("ctrie_wal_checkpoint: %.3f s\n", now() - start);
+	for (size_t i = 0; i < words.n * WAL_CHURN / 100; i++) {
+		size_t j = rand() % words.n;
+		if (rand() % 2)
+			ctrie_wal_remove(&w, words.w[j]);
+		else
+			ctrie_wal_insert(&w, words.w[j], false, &i);
+	}
+	if (ctrie_wal_close(&w)) {
+		perror("ctrie_wal_close");
+		exit(EXIT_FAILURE);
+	}
+	ctrie_free(&t);
+
+	ctrie_init(&t, sizeof(size_t));
+	start = now();
+	if (ctrie_wal_open(&w, &t, dir)) {
+		perror(dir);
+		exit(EXIT_FAILURE);
+	}
+	printf("%d%% churn, ctrie_wal_open: %.3f s\n", WAL_CHURN, now() - start);
+	ctrie_wal_close(&w);
+	ctrie_free(&t);
+
+	wal_unlink(dir);
+	if (dir == tmp)
+		rmdir(dir);
+	free_words(&words);
+}
+
+/*
+ * Save a trie of the words and load it back, compared to rebuilding it by
+ * inserting the keys in the order of the iteration.
+ */
+static void bench_save(int argc, char **argv)
+{
+	struct words words;
+	struct ctrie t, u;
+	struct ctrie_iter it;
+	struct ctnode *n;
+	char *buf, *key = NULL;
+	size_t len, key_size = 0;
+
+	read_words(&words);
+	ctrie_init(&t, sizeof(size_t));
+	for (size_t i = 0; i < words.n; i++)
+		*(size_t *)ctrie_insert(&t, words.w[i], false) = i;
+
+	FILE *f = open_memstream(&buf, &len);
+	double start = now();
+	if (!f || ctrie_save(&t, f) || fflush(f)) {
+		perror("ctrie_save");
+		exit(EXIT_FAILURE);
+	}
+	printf("%zu keys, ctrie_save: %.3f s, %zu bytes\n",
+		words.n, now() - start, len);
+
+	start = now();
+	ctrie_init(&u, sizeof(size_t));
+	ctrie_iter_init(&t, &it);
+	while ((n = ctrie_iter_next(&it, &key, &key_size)))
+		*(size_t *)ctrie_insert(&u, key, false) = *(size_t *)ctrie_node_data(&t, n);
+	ctrie_iter_free(&it);
+	double insert = now() - start;
+	printf("%zu keys, ctrie_insert in order: %.3f s\n", words.n, insert);
+	ctrie_free(&u);
+
+	FILE *g = fmemopen(buf, len, "r");
+	start = now();
+	if (!g || ctrie_load(&u, g)) {
+		perror("ctrie_load");
+		exit(EXIT_FAILURE);
+	}
+	double load = now() - start;
+	printf("%zu keys, ctrie_load: %.3f s (%.1fx)\n", words.n, load, insert / load);
+	fclose(g);
+	ctrie_free(&u);
+
+	fclose(f);
+	free(buf);
+	free(key);
+	ctrie_free(&t);
+	free_words(&words);
+}
+
+/*
+ * Time lookups of all the `n` `keys` of `t`, in a random order.
+ */
+static double find_all(struct ctrie *t, char **keys, size_t n)
+{
+	size_t found = 0;
+	double start = now();
+	for (size_t i = 0; i < n; i++)
+		found += !!ctrie_find(t, keys[i * 7919 % n]);
+	double time = now() - start;
+	if (found != n) {
+		fprintf(stderr, "lost %zu keys\n", n - found);
+		exit(EXIT_FAILURE);
+	}
+	return time;
+}
+
+static void bench_urls(int argc, char **argv)
+{
+	size_t n = argc > 0 ? atol(argv[0]) : URLS_DEF_N;
+	char **keys = malloc(n * sizeof(*keys));
+	size_t total = 0;
+	struct ctrie t;
+	assert(keys);
+
+	if (n % 7919 == 0)
+		n--; /* keep the lookup order a permutation */
+	ctrie_init(&t, sizeof(size_t));
+	for (size_t i = 0; i < n; i++) {
+		size_t h = i * 2654435761u;
+		keys[i] = malloc(128);
+		assert(keys[i]);
+		total += snprintf(keys[i], 128,
+			"https://www.site%zu.example.com/catalog/category-%zu/item-%zu/details?ref=%zx",
+			h % 97, h % 1009, i, h);
+		*(size_t *)ctrie_insert(&t, keys[i], false) = i;
+	}
+	printf("%zu keys, %.1f bytes on average\n", n, (double)total / n);
+
+	double plain = find_all(&t, keys, n);
+	printf("ctrie_find: %.3f s\n", plain);
+	size_t before = rss();
+	double start = now();
+	ctrie_index_init(&t);
+	printf("ctrie_index_init: %.3f s, %zu MiB\n", now() - start,
+		(rss() - before) / MB);
+	double indexed = find_all(&t, keys, n);
+	printf("ctrie_find, indexed: %.3f s (%.2fx)\n", indexed, plain / indexed);
+
+	for (size_t i = 0; i < n; i++)
+		free(keys[i]);
+	free(keys);
+	ctrie_free(&t);
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+/*
+ * Time each lookup of the `n` words of `stream` in `t` and print the median
+ * and the 99th percentile. If `writes` is not zero, insert and remove a key
+ * every `writes` lookups.
+ */
+static void zipf_run(struct ctrie *t,
+                     char **stream,
+                     size_t n,
+                     size_t writes,
+                     const char *what)
+{
+	double *lat = malloc(n * sizeof(*lat));
+	size_t found = 0;
+	assert(lat);
+	double start = now();
+	for (size_t i = 0; i < n; i++) {
+		if (writes && i % writes == 0) {
+			ctrie_insert(t, "zipf:write", false);
+			ctrie_remove(t, "zipf:write");
+		}
+		double op = now();
+		found += ctrie_find(t, stream[i]) != NULL;
+		lat[i] = now() - op;
+	}
+	double total = now() - start;
+	assert(found == n);
+	qsort(lat, n, sizeof(*lat), cmp_double);
+	printf("%s: %.3f s, p50 %.0f ns, p99 %.0f ns\n", what, total,
+		lat[n / 2] * 1e9, lat[n / 100 * 99] * 1e9);
+	free(lat);
+}
+
+/*
+ * Lookups of dictionary words drawn from a Zipf distribution of exponent `s`
+ * over a random ranking of the words, without and with a lookup cache of
+ * `size` entries. The latencies include the cost of reading the clock.
+ */
+static void bench_zipf(int argc, char **argv)
+{
+	double s = argc > 0 ? atof(argv[0]) : ZIPF_DEF_S;
+	size_t size = argc > 1 ? atol(argv[1]) : ZIPF_DEF_SIZE;
+	size_t hits, misses;
+	struct words words;
+	struct ctrie t;
+
+	read_words(&words);
+	ctrie_init(&t, sizeof(size_t));
+	for (size_t i = 0; i < words.n; i++)
+		*(size_t *)ctrie_insert(&t, words.w[i], false) = i;
+
+	/* cumulative distribution of the ranks, the ranks shuffled over the words */
+	double *cdf = malloc(words.n * sizeof(*cdf)), sum = 0;
+	char **rank = malloc(words.n * sizeof(*rank));
+	char **stream = malloc(ZIPF_N * sizeof(*stream));
+	assert(cdf && rank && stream);
+	for (size_t i = 0; i < words.n; i++) {
+		cdf[i] = sum += pow(i + 1, -s);
+		size_t j = rand() % (i + 1);
+		rank[i] = rank[j];
+		rank[j] = words.w[i];
+	}
+	size_t top = 0;
+	for (size_t i = 0; i < ZIPF_N; i++) {
+		double r = rand() / (RAND_MAX + 1.0) * sum;
+		size_t lo = 0, hi = words.n - 1;
+		while (lo < hi) {
+			size_t mid = (lo + hi) / 2;
+			if (cdf[mid] < r)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		stream[i] = rank[lo];
+		top += lo < words.n / 100;
+	}
+	printf("%d lookups of %zu words, Zipf s = %.2f, %.0f%% to the top 1%%\n",
+		ZIPF_N, words.n, s, 100.0 * top / ZIPF_N);
+
+	zipf_run(&t, stream, ZIPF_N, 0, "ctrie_find");
+	zipf_run(&t, stream, ZIPF_N, ZIPF_WRITES, "ctrie_find, with writes");
+	ctrie_cache_init(&t, size);
+	zipf_run(&t, stream, ZIPF_N, 0, "ctrie_find, cached");
+	ctrie_cache_stats(&t, &hits, &misses);
+	printf("\t%zu entries, hit rate %.1f%%\n", size,
+		100.0 * hits / (hits + misses));
+	ctrie_cache_free(&t);
+	ctrie_cache_init(&t, size);
+	zipf_run(&t, stream, ZIPF_N, ZIPF_WRITES, "ctrie_find, cached, with writes");
+	ctrie_cache_stats(&t, &hits, &misses);
+	printf("\tone write per %d lookups, hit rate %.1f%%\n", ZIPF_WRITES,
+		100.0 * hits / (hits + misses));
+
+	free(cdf);
+	free(rank);
+	free(stream);
+	ctrie_free(&t);
+	free_words(&words);
+}
+
+/*
+ * Time loading the lines of `path` into an empty trie by `getline(3)` and
+ * `ctrie_insert_n`, and by `ctrie_load_lines`.
+ */
+static void lines_run(const char *path, const char *what)
+{
+	struct ctrie t;
+	char *line = NULL;
+	size_t line_size = 0;
+	ssize_t len;
+
+	ctrie_init(&t, 0);
+	double start = now();
+	FILE *f = fopen(path, "r");
+	assert(f);
+	while ((len = getline(&line, &line_size, f)) > 0) {
+		if (line[len - 1] == '\n')
+			len--;
+		if (len)
+			ctrie_insert_n(&t, line, len, false);
+	}
+	fclose(f);
+	double insert = now() - start;
+	printf("%s, getline and ctrie_insert: %.3f s\n", what, insert);
+	ctrie_free(&t);
+	free(line);
+
+	ctrie_init(&t, 0);
+	start = now();
+	if (ctrie_load_lines(&t, path, 0)) {
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+	double load = now() - start;
+	printf("%s, ctrie_load_lines: %.3f s (%.1fx)\n", what, load, insert / load);
+	ctrie_free(&t);
+}
+
+/*
+ * Load the words from files holding them sorted and shuffled.
+ */
+static void bench_lines(int argc, char **argv)
+{
+	char path[] = "/tmp/ctrie-bench-XXXXXX";
+	struct words words;
+	int fd;
+	FILE *f;
+
+	read_words(&words);
+	qsort(words.w, words.n, sizeof(*words.w), cmp_words);
+	for (int sorted = 1; sorted >= 0; sorted--) {
+		if (!sorted) {
+			for (size_t i = words.n - 1; i > 0; i--) {
+				size_t j = rand() % (i + 1);
+				char *w = words.w[i];
+				words.w[i] = words.w[j];
+				words.w[j] = w;
+			}
+		}
+		strcpy(path, "/tmp/ctrie-bench-XXXXXX");
+		if ((fd = mkstemp(path)) < 0 || !(f = fdopen(fd, "w"))) {
+			perror(path);
+			exit(EXIT_FAILURE);
+		}
+		for (size_t i = 0; i < words.n; i++)
+			fprintf(f, "%s\n", words.w[i]);
+		fclose(f);
+		lines_run(path, sorted ? "sorted" : "shuffled");
+		unlink(path);
+	}
+	free_words(&words);
+}
+
+/*
+ * Build a trie of `n` shuffled URLs by `ctrie_insert` and by
+ * `ctrie_build_parallel` with 1, 2, 4, ... up to `threads` threads.
+ */
+static void bench_parallel(int argc, char **argv)
+{
+	size_t n = argc > 0 ? atol(argv[0]) : URLS_DEF_N;
+	int threads = argc > 1 ? atoi(argv[1]) : sysconf(_SC_NPROCESSORS_ONLN);
+	char **keys = malloc(n * sizeof(*keys));
+	struct ctrie t;
+	assert(keys);
+
+	for (size_t i = 0; i < n; i++) {
+		size_t h = i * 2654435761u;
+		keys[i] = malloc(128);
+		assert(keys[i]);
+		snprintf(keys[i], 128, "https://www.site%zu.example.com/item-%zx",
+			h % 97, h);
+	}
+	for (size_t i = n - 1; i > 0; i--) {
+		size_t j = rand() % (i + 1);
+		char *k = keys[i];
+		keys[i] = keys[j];
+		keys[j] = k;
+	}
+
+	ctrie_init(&t, 0);
+	double start = now();
+	for (size_t i = 0; i < n; i++)
+		ctrie_insert(&t, keys[i], false);
+	double insert = now() - start;
+	printf("%zu keys, ctrie_insert: %.3f s\n", n, insert);
+	ctrie_free(&t);
+
+	for (int k = 1; k <= MAX(1, threads); k *= 2) {
+		ctrie_init(&t, 0);
+		start = now();
+		ctrie_build_parallel(&t, (const char **)keys, n, k);
+		double build = now() - start;
+		printf("%zu keys, ctrie_build_parallel, %d threads: %.3f s (%.1fx)\n",
+			n, k, build, insert / build);
+		ctrie_free(&t);
+	}
+
+	for (size_t i = 0; i < n; i++)
+		free(keys[i]);
+	free(keys);
+}
+
+/*
+ * Return the number of bytes allocated by malloc(3) and not freed.
+ */
+static size_t heap_used(void)
+{
+	struct mallinfo2 mi = mallinfo2();
+	return mi.uordblks + mi.hblkhd;
+}
+
+/*
+ * Time lookups of all the words in `t`, in the order of `words`.
+ */
+static double contains_all(struct ctrie *t, struct words *words)
+{
+	size_t found = 0;
+	double start = now();
+	for (size_t i = 0; i < words->n; i++)
+		found += ctrie_contains(t, words->w[i]);
+	assert(found == words->n);
+	return now() - start;
+}
+
+/*
+ * Minimize a trie of the words and compare its heap usage and lookup time
+ * with the trie as built. In `bench-ref32`, the nodes freed stay in the arena,
+ * so the heap doesn't shrink.
+ */
+static void bench_dawg(int argc, char **argv)
+{
+	struct words words;
+	struct ctrie t;
+
+	read_words(&words);
+	size_t base = heap_used();
+	ctrie_init(&t, 0);
+	for (size_t i = 0; i < words.n; i++)
+		ctrie_insert(&t, words.w[i], false);
+	size_t built = heap_used() - base;
+	double plain = contains_all(&t, &words);
+	printf("%zu words, trie: %.1f MiB, ctrie_contains: %.3f s\n",
+		words.n, (double)built / MB, plain);
+
+	double start = now();
+	ctrie_minimize(&t);
+	double took = now() - start;
+	size_t minimized = heap_used() - base;
+	double dawg = contains_all(&t, &words);
+	printf("ctrie_minimize: %.3f s, %.1f MiB (%.1fx smaller), "
+		"ctrie_contains: %.3f s\n", took, (double)minimized / MB,
+		(double)built / minimized, dawg);
+	ctrie_free(&t);
+	free_words(&words);
+}
+
+/*
+ * Compare the words mapped to their indices by a trie with the indices as
+ * data with the words numbered by `ctrie_number`.
+ */
+static void bench_ids(int argc, char **argv)
+{
+	struct words words;
+	struct ctrie t;
+	size_t sum = 0, n;
+
+	read_words(&words);
+	size_t base = heap_used();
+	ctrie_init(&t, sizeof(size_t));
+	for (size_t i = 0; i < words.n; i++)
+		*(size_t *)ctrie_insert(&t, words.w[i], false) = i;
+	size_t data = heap_used() - base;
+	double start = now();
+	for (size_t i = 0; i < words.n; i++)
+		sum += *(size_t *)ctrie_find(&t, words.w[i]);
+	printf("%zu words, data: %.1f MiB, ctrie_find: %.3f s\n",
+		words.n, (double)data / MB, now() - start);
+	ctrie_free(&t);
+
+	base = heap_used();
+	ctrie_init(&t, 0);
+	for (size_t i = 0; i < words.n; i++)
+		ctrie_insert(&t, words.w[i], false);
+	start = now();
+	ctrie_number(&t, &n);
+	double took = now() - start;
+	size_t numbered = heap_used() - base;
+	start = now();
+	for (size_t i = 0; i < words.n; i++) {
+		size_t id;
+		ctrie_word_id(&t, words.w[i], &id);
+		sum += id;
+	}
+	double lookup = now() - start;
+	char *key = NULL;
+	size_t key_size = 0;
+	start = now();
+	for (size_t i = 0; i < n; i++)
+		ctrie_id_to_key(&t, i, &key, &key_size);
+	printf("ctrie_number: %.3f s, %.1f MiB (%.1fx smaller), "
+		"ctrie_word_id: %.3f s, ctrie_id_to_key: %.3f s\n", took,
+		(double)numbered / MB, (double)data / numbered, lookup,
+		now() - start);
+	free(key);
+	ctrie_free(&t);
+	free_words(&words);
+	if (sum == 42)
+		printf("\n"); /* keep the lookups */
+}
+
+static const struct bench
+{
+	const char *name;
+	void (*run)(int argc, char **argv);
+	const char *usage;
+} benches[] = {
+	{ "scan", bench_scan, "[text-size-in-MB]" },
+	{ "cursor", bench_cursor, "" },
+	{ "mem", bench_mem, "[data-size]" },
+	{ "count", bench_count, "[number-of-words]" },
+	{ "evict", bench_evict, "" },
+	{ "prefix", bench_prefix, "" },
+	{ "free", bench_free, "[number-of-keys]" },
+	{ "wal", bench_wal, "[directory]" },
+	{ "save", bench_save, "" },
+	{ "urls", bench_urls, "[n]" },
+	{ "zipf", bench_zipf, "[s] [cache entries]" },
+	{ "lines", bench_lines, "" },
+	{ "parallel", bench_parallel, "[n] [threads]" },
+	{ "dawg", bench_dawg, "" },
+	{ "ids", bench_ids, "" },
+};
+
+int main(int argc, char **argv)
+{
+	for (size_t i = 0; argc > 1 && i < sizeof(benches) / sizeof(*benches); i++) {
+		if (!strcmp(argv[1], benches[i].name)) {
+			benches[i].run(argc - 2, argv + 2);
+			return EXIT_SUCCESS;
+		}
+	}
+	fprintf(stderr, "usage: %s <benchmark> [args...]\n", argv[0]);
+	for (size_t i = 0; i < sizeof(benches) / sizeof(*benches); i++)
+		fprintf(stderr, "\t%s %s\n", benches[i].name, benches[i].usage);
+	return EXIT_FAILURE;
+}
@@ -1,18 +1,33 @@
 #include "ctrie.h"
 
 #include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef CTRIE_HIST
+#include <inttypes.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#endif
 
 #define MAX(a, b)      ((a) >= (b) ? (a) : (b))
 #define MIN(a, b)      ((a) <= (b) ? (a) : (b))
+#define ALIGN(x, a)    (((x) + (a) - 1) & ~((size_t)(a) - 1))
 
 #define FLAGS_MASK     0x03
 #define NODE_INIT_SIZE 0
 #define NODE_MAX_SIZE  255
 #define LABEL_BUF_SIZE 128
+#define CACHE_LINE     64
 
 _Static_assert(NODE_INIT_SIZE <= NODE_MAX_SIZE,
 	"initial node size may not exceed maximum node size");
@@ -44,30 +59,195 @@ static void *xcalloc(size_t nmemb, size_t size)
 	return ptr;
 }
 
-static char *xstrdup(char *s)
+/*
+ * Array growing helper. Ensure that the array `a` of `sizeof(*a)`-sized items
+ * with current capacity `cap` can hold `size + 1` items (i.e., is not full).
+ * If `size` has reached `a`'s capacity limit, use `realloc(3)` to resize the
+ * array to at least twice current capacity.
+ */
+#define AGROW(a, size, cap) do { \
+	if ((size) >= (cap)) { \
+		(cap) = MAX(size, MAX(1, 2 * (cap))); \
+		(a) = xrealloc((a), (cap) * sizeof(*(a))); \
+	} \
+} while (0)
+
+/*
+ * Instrumentation, see `struct ctrie_stats`. Without `CTRIE_STATS`, the
+ * macros expand to nothing, and whatever is computed only to be passed to
+ * them is optimized out.
+ */
+#ifdef CTRIE_STATS
+
+static uint64_t stats_clock(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void stats_event(struct ctrie *t, enum ctrie_event ev, size_t arg)
+{
+	if (t->stats->hook)
+		t->stats->hook(t, ev, arg, t->stats->hook_arg);
+}
+
+static void stats_alloc(struct ctrie *t, uint64_t start)
+{
+	uint64_t ns = stats_clock() - start;
+	t->stats->allocs++;
+	t->stats->alloc_ns += ns;
+	stats_event(t, CTRIE_EVENT_ALLOC, ns);
+}
+
+#define STAT(t, field, n)   ((t)->stats->field += (n))
+#define EVENT(t, ev, arg)   stats_event(t, ev, arg)
+#define ALLOC_START(t)      uint64_t alloc_start = stats_clock()
+#define ALLOC_END(t)        stats_alloc(t, alloc_start)
+
+#else
+
+#define STAT(t, field, n)   ((void)0)
+#define EVENT(t, ev, arg)   ((void)0)
+#define ALLOC_START(t)      ((void)0)
+#define ALLOC_END(t)        ((void)0)
+
+#endif
+
+/*
+ * Latency histograms, see `struct ctrie_hist`. Every thread records into
+ * histograms of its own, which are linked into a list when the thread first
+ * records, so that recording is a few instructions and takes no locks. When
+ * the thread exits, its counts are added to `hist_retired` and its block is
+ * zeroed and put on a free list, to be taken by the next thread which starts
+ * recording. Blocks are never unlinked nor freed, so that the list can be
+ * walked without locks.
+ *
+ * The counters are only ever written by their thread. They are atomic just
+ * so that they may be read and reset from other threads; the relaxed load
+ * and store compile to a plain increment.
+ */
+#ifdef CTRIE_HIST
+
+struct hist_thread
+{
+	_Atomic uint64_t count[CTRIE_OP_COUNT][CTRIE_HIST_BUCKETS]; /* counters */
+	struct hist_thread *next;                                    /* next thread */
+	struct hist_thread *next_free;                               /* next free block */
+};
+
+static _Atomic(struct hist_thread *) hist_threads;
+static _Thread_local struct hist_thread *hist_self;
+static struct hist_thread hist_retired; /* counts of the threads which exited */
+static struct hist_thread *hist_free;   /* blocks of the threads which exited */
+static pthread_mutex_t hist_lock = PTHREAD_MUTEX_INITIALIZER; /* of `hist_free` */
+static pthread_key_t hist_key;
+static pthread_once_t hist_once = PTHREAD_ONCE_INIT;
+
+static inline uint64_t hist_ticks(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+/*
+ * Return the bucket of `v`: values below `CTRIE_HIST_SUB` have buckets of
+ * their own, larger ones share `CTRIE_HIST_SUB` buckets per power of two.
+ */
+static size_t hist_bucket(uint64_t v)
+{
+	if (v < CTRIE_HIST_SUB)
+		return v;
+	int e = 63 - __builtin_clzll(v);
+	int shift = e - CTRIE_HIST_SUB_BITS;
+	return (shift + 1) * CTRIE_HIST_SUB + ((v >> shift) & (CTRIE_HIST_SUB - 1));
+}
+
+/*
+ * Called when a thread which recorded exits: retire its block `arg`.
+ */
+static void hist_exit(void *arg)
+{
+	struct hist_thread *h = arg;
+	for (size_t op = 0; op < CTRIE_OP_COUNT; op++) {
+		for (size_t b = 0; b < CTRIE_HIST_BUCKETS; b++) {
+			uint64_t n = atomic_exchange_explicit(&h->count[op][b], 0,
+				memory_order_relaxed);
+			if (n)
+				atomic_fetch_add_explicit(&hist_retired.count[op][b], n,
+					memory_order_relaxed);
+		}
+	}
+	hist_self = NULL;
+	pthread_mutex_lock(&hist_lock);
+	h->next_free = hist_free;
+	hist_free = h;
+	pthread_mutex_unlock(&hist_lock);
+}
+
+static void hist_init(void)
 {
-	// To not introduce unnecessary POSIX dependency, we copied the
-	// implementation of strdup(3p) from musl. Please refer to:
-	// http://git.musl-libc.org/cgit/musl/tree/src/string/strdup.c
-	size_t l = strlen(s);
-	char *d = malloc(l+1);
-	if (!d) {
-		perror("strdup");
+	if (pthread_key_create(&hist_key, hist_exit))
 		abort();
+}
+
+static struct hist_thread *hist_register(void)
+{
+	pthread_once(&hist_once, hist_init);
+	pthread_mutex_lock(&hist_lock);
+	struct hist_thread *h = hist_free;
+	if (h)
+		hist_free = h->next_free;
+	pthread_mutex_unlock(&hist_lock);
+	if (!h) {
+		h = xcalloc(1, sizeof(*h));
+		h->next = atomic_load(&hist_threads);
+		while (!atomic_compare_exchange_weak(&hist_threads, &h->next, h));
 	}
-	return memcpy(d, s, l+1);
+	if (pthread_setspecific(hist_key, h))
+		abort();
+	return hist_self = h;
+}
+
+static void hist_record(enum ctrie_op op, uint64_t ticks)
+{
+	struct hist_thread *h = hist_self ? hist_self : hist_register();
+	_Atomic uint64_t *c = &h->count[op][hist_bucket(ticks)];
+	atomic_store_explicit(c, atomic_load_explicit(c, memory_order_relaxed) + 1,
+		memory_order_relaxed);
 }
 
+#define HIST_START()  uint64_t hist_start = hist_ticks()
+#define HIST_END(op)  hist_record(op, hist_ticks() - hist_start)
+
+#else
+
+#define HIST_START()  ((void)0)
+#define HIST_END(op)  ((void)0)
+
+#endif
+
 /*
  * Size of the `label` field in `struct ctnode`. This must be enough to hold a
  * `char *`. If the label is shorter than this value, it will be embedded in
  * the field directly, thus saving the overhead of having to create a heap copy
  * of the string.
  *
- * LABEL_SIZE is set to 13 since that will result in in plausible alignment
- * on 64-bit platforms: sizeof(struct ctnode) == 16 and no padding is required.
+ * The header is padded to a multiple of `sizeof(char *)`, so on 64-bit
+ * platforms the sizes which don't waste any padding are `8k + 5`. The default
+ * of 13 gives sizeof(struct ctnode) == 16. Build with `-DCTRIE_LABEL_SIZE=n`
+ * to pick another size; `labelsize` recommends one for a sample of keys.
  */
+#ifdef CTRIE_LABEL_SIZE
+#define LABEL_SIZE CTRIE_LABEL_SIZE
+#else
 #define LABEL_SIZE 13
+#endif
 
 _Static_assert(sizeof(char *) <= LABEL_SIZE,
 	"LABEL_SIZE too small to hold a char *, please increase");
@@ -82,13 +262,36 @@ enum
 	F_WILD = 1 << 2, /* it's a prefix wild-card */
 	F_SEPL = 1 << 3, /* label allocated separately, use `lptr` */
 	F_SEPD = 1 << 4, /* data allocated separately */
+	F_MARK = 1 << 5, /* visited, while freeing a frozen trie */
 };
 
 /*
- * A trie node, or more precisely its header. In memory, two arrays (possibly
- * of size 0) always follow: an array of child pointers and a sorted array of
- * characters. The latter array is used to find child index for given input
- * character.
+ * Child references. By default, these are plain pointers. When compiled with
+ * CTRIE_REF32, nodes are allocated from a trie-owned arena and children are
+ * referred to by 32-bit arena offsets, which halves the size of the child
+ * arrays. See `struct ctrie_arena` below.
+ *
+ * The lowest bit of a reference to a node is always clear. References with
+ * the lowest bit set hold inline leaves, see below.
+ */
+#ifdef CTRIE_REF32
+typedef uint32_t ctref_t;
+#else
+typedef uintptr_t ctref_t;
+#endif
+
+/*
+ * A trie node, or more precisely its header. In memory, the header is followed
+ * by a sorted array of characters, which is used to find child index for given
+ * input character, an array of child references and the data. Both arrays may
+ * be of size 0. The arrays are padded to keep the child references and the
+ * data aligned at `sizeof(void *)`.
+ *
+ * The character array is placed right after the header so that a search step
+ * in a node of up to `CACHE_LINE - sizeof(struct ctnode)` children reads the
+ * label and the characters from a single cache line. Nodes whose allocation
+ * spans more than a single cache line are allocated at cache line boundary,
+ * so the child reference is the only other line touched.
  *
  * The node itself is capable of storing `size` children at any given moment.
  * It is resized to fulfil storage requirements as they change. This ensures
@@ -98,18 +301,72 @@ enum
  * the NUL byte ('\0') cannot appear inside of a string, so we cannot have
  * a branching node which would intersect paths at 256 different bytes.
  *
- * FIXME Enforce proper alignment for cases when people chose poor LABEL_SIZE.
- *       (Must be safe to reinterpret label as a char *.)
+ * The `label` is aligned so that it's safe to reinterpret it as a `char *`,
+ * which also pads the header to a multiple of `sizeof(char *)`.
  */
 struct ctnode
 {
+	_Alignas(char *)
 	char label[LABEL_SIZE];  /* short-enough label or pointer to a label */
 	byte_t flags;            /* various flags */
 	byte_t size;             /* capacity of the `child` array */
 	byte_t nchild;           /* number of children */
-	struct ctnode *child[];  /* child pointers start here */
 };
 
+_Static_assert(sizeof(struct ctnode) % sizeof(void *) == 0,
+	"struct ctnode must keep the arrays which follow it aligned");
+
+/*
+ * Inline leaves. In tries which store no data (`data_size == 0`), a leaf whose
+ * label is at most `INLINE_MAX` characters long is not allocated at all.
+ * Instead, the leaf is stored right in the child reference of its parent: the
+ * least significant byte of the reference is a tag byte holding the flags of
+ * the leaf and having the lowest bit set, the other bytes hold the label.
+ *
+ * An inline leaf is referred to by the address of the child reference which
+ * holds it, with the lowest bit set. This "node pointer" must only be used
+ * with `get_label`, `node_flags`, `node_nchild` and `data`, which understand
+ * inline leaves. The data pointer of an inline leaf is the address of its
+ * child reference.
+ */
+#define INLINE_MAX (sizeof(ctref_t) - 2)
+
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define INLINE_TAG   (sizeof(ctref_t) - 1)
+#define INLINE_LABEL 0
+#else
+#define INLINE_TAG   0
+#define INLINE_LABEL 1
+#endif
+
+static inline bool is_inline(struct ctnode *n)
+{
+	return (uintptr_t)n & 1;
+}
+
+/*
+ * Return the child reference holding the inline leaf `n`.
+ */
+static inline ctref_t *inline_ref(struct ctnode *n)
+{
+	return (ctref_t *)((uintptr_t)n & ~(uintptr_t)1);
+}
+
+static inline byte_t *inline_tag(struct ctnode *n)
+{
+	return (byte_t *)inline_ref(n) + INLINE_TAG;
+}
+
+static inline byte_t node_flags(struct ctnode *n)
+{
+	return is_inline(n) ? *inline_tag(n) >> 1 : n->flags;
+}
+
+static inline size_t node_nchild(struct ctnode *n)
+{
+	return is_inline(n) ? 0 : n->nchild;
+}
+
 /*
  * Return pointer to the label of node `n`. This is either pointer to the
  * `label` content if the label was embedded in the `ctnode` directly, or the
@@ -117,461 +374,3996 @@ struct ctnode
  */
 static char *get_label(struct ctnode *n)
 {
+	if (is_inline(n))
+		return (char *)inline_ref(n) + INLINE_LABEL;
 	return (n->flags & F_SEPL) ? *(char **)&n->label : n->label;
 }
 
+
+#ifdef CTRIE_REF32
+
 /*
- * Set label of `n` to `label`. If the label is short enough, `label` will be
- * copied into the `label` field of the node. If it's longer, create a copy of
- * the string given using `strdup`.
+ * Node arena. Nodes are carved from chunks of `ARENA_CHUNK_SIZE` bytes which
+ * are aligned at their size, so that the chunk of a node can be found by
+ * masking its address. The first unit of every chunk holds the index of the
+ * chunk in the chunk table.
+ *
+ * A reference is the index of the chunk in its upper `31 - ARENA_OFF_BITS`
+ * bits and the offset of the node in the chunk, in units of `ARENA_UNIT`
+ * bytes, in the next `ARENA_OFF_BITS` bits. The lowest bit is left clear to
+ * tell nodes from inline leaves. This limits the arena to 16 GiB.
+ *
+ * Freed nodes are kept on free lists by their size in units and reused.
  */
-static void set_label(struct ctnode *n, char *label)
+#define ARENA_UNIT       8
+#define ARENA_OFF_BITS   17
+#define ARENA_CHUNK_SIZE ((size_t)ARENA_UNIT << ARENA_OFF_BITS)
+#define ARENA_MAX_CHUNKS ((size_t)1 << (31 - ARENA_OFF_BITS))
+
+struct ctrie_arena
 {
-	char *old_label = get_label(n);
-	bool need_free = (n->flags & F_SEPL);
-	size_t len = strlen(label);
-	if (len < sizeof(n->label)) {
-		n->flags &= ~F_SEPL;
-		/* memmove: label may be equal to n->label if old label short */
-		memmove(n->label, label, len);
-		n->label[len] = '\0';
-	} else {
-		n->flags |= F_SEPL;
-		*(char **)&n->label = xstrdup(label);
-	}
-	if (need_free)
-		free(old_label);
-}
+	byte_t **chunks;    /* chunk table */
+	size_t nchunks;     /* number of chunks */
+	size_t chunks_size; /* capacity of `chunks` */
+	size_t used;        /* number of units used in the last chunk */
+	void **free;        /* free lists indexed by node size in units */
+	size_t nfree;       /* number of free lists */
+	struct arena_big *big; /* list of labels too big for the arena */
+};
 
 /*
- * Return the number of bytes needed to allocate a node with size `size`.
+ * Label longer than `ARENA_LABEL_MAX` bytes, allocated by malloc(3) and
+ * linked into the list of its arena so that it can be freed with the arena.
  */
-static size_t alloc_size(struct ctrie *t, size_t size)
+struct arena_big
+{
+	struct arena_big *next; /* next big label of the arena */
+	struct arena_big *prev; /* previous big label of the arena */
+	char label[];           /* the label */
+};
+
+#define ARENA_LABEL_MAX (ARENA_CHUNK_SIZE / 16)
+
+static struct ctrie_arena *arena_new(void)
 {
-	size_t ptrs = size * sizeof(struct ctnode *);
-	size_t chars = size;
-	return sizeof(struct ctnode) + ptrs + t->data_size + chars;
+	struct ctrie_arena *a = xcalloc(1, sizeof(*a));
+	a->used = ARENA_CHUNK_SIZE / ARENA_UNIT; /* force new chunk */
+	return a;
 }
 
-/*
- * Return a pointer to the character array of the node `n`.
- */
-static char *char_array(struct ctrie *t, struct ctnode *n)
+static void arena_free(struct ctrie_arena *a)
 {
-	return (char *)((byte_t *)n + alloc_size(t, n->size) - n->size);
+	while (a->big) {
+		struct arena_big *b = a->big;
+		a->big = b->next;
+		free(b);
+	}
+	for (size_t i = 0; i < a->nchunks; i++)
+		free(a->chunks[i]);
+	free(a->chunks);
+	free(a->free);
+	free(a);
 }
 
+static void arena_release(struct ctrie_arena *a, void *ptr, size_t size);
+
 /*
- * Return a pointer to the data memory of the node `n`.
+ * Allocate `size` bytes from the arena `a`. Allocations larger than a cache
+ * line are aligned at cache line boundary. No node is larger than a chunk,
+ * since `ctrie_init` rejects data sizes above `DATA_SIZE_MAX`.
  */
-static void *data(struct ctrie *t, struct ctnode *n)
+static void *arena_alloc(struct ctrie_arena *a, size_t size)
 {
-	return (void *)(char_array(t, n) - t->data_size);
+	size_t units = (size + ARENA_UNIT - 1) / ARENA_UNIT;
+	size_t line = CACHE_LINE / ARENA_UNIT;
+	assert(units < ARENA_CHUNK_SIZE / ARENA_UNIT - line);
+	if (units < a->nfree && a->free[units]) {
+		void *ptr = a->free[units];
+		a->free[units] = *(void **)ptr;
+		return ptr;
+	}
+	if (units > line && a->used % line) {
+		/* keep the padding for smaller nodes */
+		size_t pad = line - a->used % line;
+		if (a->used + pad <= ARENA_CHUNK_SIZE / ARENA_UNIT) {
+			byte_t *gap = a->chunks[a->nchunks - 1] + a->used * ARENA_UNIT;
+			a->used += pad;
+			arena_release(a, gap, pad * ARENA_UNIT);
+		}
+	}
+	if (a->used + units > ARENA_CHUNK_SIZE / ARENA_UNIT) {
+		if (a->nchunks >= ARENA_MAX_CHUNKS) {
+			fputs("ctrie: arena full\n", stderr);
+			abort();
+		}
+		byte_t *chunk = aligned_alloc(ARENA_CHUNK_SIZE, ARENA_CHUNK_SIZE);
+		if (!chunk) {
+			perror("aligned_alloc");
+			abort();
+		}
+		if (a->nchunks >= a->chunks_size) {
+			a->chunks_size = MAX(1, 2 * a->chunks_size);
+			a->chunks = xrealloc(a->chunks,
+				a->chunks_size * sizeof(*a->chunks));
+		}
+		*(uint32_t *)chunk = a->nchunks;
+		a->chunks[a->nchunks++] = chunk;
+		a->used = units > line ? line : 1;
+	}
+	void *ptr = a->chunks[a->nchunks - 1] + a->used * ARENA_UNIT;
+	a->used += units;
+	return ptr;
 }
 
 /*
- * Resize `n` to `new_size`.
+ * Return `ptr` of `size` bytes to the arena `a`.
  */
-static struct ctnode *resize(struct ctrie *t, struct ctnode *n, size_t new_size)
+static void arena_release(struct ctrie_arena *a, void *ptr, size_t size)
 {
-	assert(new_size <= NODE_MAX_SIZE);
-	assert(n->size <= new_size);
-	n = xrealloc(n, alloc_size(t, new_size));
-	size_t old_size = n->size;
-	void *old = data(t, n);
-	n->size = new_size;
-	/* copy both data and the char array to the new node */
-	memmove(data(t, n), old, t->data_size + old_size);
-	return n;
+	size_t units = (size + ARENA_UNIT - 1) / ARENA_UNIT;
+	if (units >= a->nfree) {
+		a->free = xrealloc(a->free, (units + 1) * sizeof(*a->free));
+		memset(a->free + a->nfree, 0,
+			(units + 1 - a->nfree) * sizeof(*a->free));
+		a->nfree = units + 1;
+	}
+	*(void **)ptr = a->free[units];
+	a->free[units] = ptr;
 }
 
 /*
- * Allocate a new node, making sure that its initial size will be
- * at least `min_size`, i.e. that `min_size` children can subsequently
- * be inserted without the need to reallocate the node.
+ * Move all the chunks, free nodes and big labels of arena `b` to arena `a`
+ * and dispose `b`. The chunks of `b` are appended to the chunk table of `a`,
+ * so references into `b` must be rebased by the returned number of chunks.
+ * Allocation continues in the last chunk of `b`.
  */
-static struct ctnode *new_node(struct ctrie *t, size_t min_size)
+static size_t arena_merge(struct ctrie_arena *a, struct ctrie_arena *b)
 {
-	assert(min_size <= NODE_MAX_SIZE);
-	size_t size = MAX(min_size, NODE_INIT_SIZE);
-	struct ctnode *n = xcalloc(1, alloc_size(t, size));
-	n->size = size;
-	return n;
+	size_t base = a->nchunks;
+	if (b->nchunks) {
+		if (a->nchunks + b->nchunks > ARENA_MAX_CHUNKS) {
+			fputs("ctrie: arena full\n", stderr);
+			abort();
+		}
+		size_t left = ARENA_CHUNK_SIZE / ARENA_UNIT - a->used;
+		if (a->nchunks && left)
+			arena_release(a, a->chunks[a->nchunks - 1] + a->used * ARENA_UNIT,
+				left * ARENA_UNIT);
+		if (a->nchunks + b->nchunks > a->chunks_size) {
+			a->chunks_size = MAX(2 * a->chunks_size, a->nchunks + b->nchunks);
+			a->chunks = xrealloc(a->chunks,
+				a->chunks_size * sizeof(*a->chunks));
+		}
+		for (size_t i = 0; i < b->nchunks; i++) {
+			*(uint32_t *)b->chunks[i] = a->nchunks;
+			a->chunks[a->nchunks++] = b->chunks[i];
+		}
+		a->used = b->used;
+	}
+	for (size_t units = 0; units < b->nfree; units++) {
+		void **last = &b->free[units];
+		if (!*last)
+			continue;
+		while (*last)
+			last = *last;
+		if (units >= a->nfree) {
+			a->free = xrealloc(a->free, (units + 1) * sizeof(*a->free));
+			memset(a->free + a->nfree, 0,
+				(units + 1 - a->nfree) * sizeof(*a->free));
+			a->nfree = units + 1;
+		}
+		*last = a->free[units];
+		a->free[units] = b->free[units];
+	}
+	if (b->big) {
+		struct arena_big *last = b->big;
+		while (last->next)
+			last = last->next;
+		last->next = a->big;
+		if (a->big)
+			a->big->prev = last;
+		a->big = b->big;
+	}
+	free(b->chunks);
+	free(b->free);
+	free(b);
+	return base;
 }
 
-static size_t find_child_idx(struct ctrie *t, struct ctnode *n, char k)
+static struct ctnode *deref(struct ctrie *t, ctref_t r)
 {
-	char *a = char_array(t, n);
-	size_t l = 0, r = n->nchild;
-	while (l < r) { /* won't run if no child */
-		size_t m = (l + r) / 2;
-		if (k <= a[m])
-			r = m;
-		else
-			l = m + 1;
-	}
-	return l; /* 0 if no child */
+	r >>= 1;
+	byte_t *chunk = t->arena->chunks[r >> ARENA_OFF_BITS];
+	size_t off = r & (((uint32_t)1 << ARENA_OFF_BITS) - 1);
+	return (struct ctnode *)(chunk + off * ARENA_UNIT);
 }
 
-#define ARRAY_SHIFT(a, j, i, size) \
-	memmove((a) + (j), (a) + (i), ((size) - (i)) * sizeof(*(a)))
+static ctref_t ref(struct ctrie *t, struct ctnode *n)
+{
+	uintptr_t chunk = (uintptr_t)n & ~(uintptr_t)(ARENA_CHUNK_SIZE - 1);
+	uint32_t idx = *(uint32_t *)chunk;
+	return (idx << ARENA_OFF_BITS | ((uintptr_t)n - chunk) / ARENA_UNIT) << 1;
+}
 
-static struct ctnode *insert_child(struct ctrie *t,
-                                   struct ctnode *n,
-                                   char k,
-                                   struct ctnode *child)
+static void *node_alloc(struct ctrie *t, size_t size)
 {
-	if (n->size == n->nchild)
-		n = resize(t, n, MAX(1, MIN(2 * n->size, NODE_MAX_SIZE)));
-	size_t idx = find_child_idx(t, n, k);
-	assert(idx < n->size);
-	char *a = char_array(t, n);
-	ARRAY_SHIFT(a, idx + 1, idx, n->nchild);
-	ARRAY_SHIFT(n->child, idx + 1, idx, n->nchild);
-	a[idx] = k;
-	n->child[idx] = child;
-	n->nchild++;
-	return n;
+	return arena_alloc(t->arena, size);
 }
 
-void ctrie_init(struct ctrie *t, size_t data_size)
+static void node_release(struct ctrie *t, struct ctnode *n, size_t size)
 {
-	t->data_size = data_size;
-	// FIXME Alloc check
-	t->fake_root = insert_child(t, new_node(t, 1), '\0', new_node(t, 0));
-	//t->fake_root->child[0]->flags |= F_WORD;
+	arena_release(t->arena, n, size);
 }
 
-static void delete_node(struct ctnode *n)
+static struct ctnode *node_realloc(struct ctrie *t,
+                                   struct ctnode *n,
+                                   size_t old_size,
+                                   size_t new_size)
 {
-	for (size_t i = 0; i < n->nchild; i++)
-		delete_node(n->child[i]);
-	if (n->flags & F_SEPL)
-		free(get_label(n));
-	free(n);
+	struct ctnode *new = arena_alloc(t->arena, new_size);
+	memcpy(new, n, MIN(old_size, new_size));
+	arena_release(t->arena, n, old_size);
+	return new;
 }
 
-void ctrie_free(struct ctrie *t)
+/*
+ * Labels which are not embedded in their nodes are allocated from the arena
+ * too, so that `ctrie_free` can release the whole trie at once.
+ */
+static char *label_alloc(struct ctrie *t, size_t len)
 {
-	delete_node(t->fake_root);
+	struct ctrie_arena *a = t->arena;
+	if (len + 1 <= ARENA_LABEL_MAX)
+		return arena_alloc(a, len + 1);
+	struct arena_big *b = xmalloc(sizeof(*b) + len + 1);
+	b->prev = NULL;
+	b->next = a->big;
+	if (a->big)
+		a->big->prev = b;
+	a->big = b;
+	return b->label;
 }
 
 /*
- * Find a node with key `key` in trie `t` and its two immediate predecessors.
- *
- * If node with the given key is found, it's returned and `*p` points to the
- * returned node's parent, `*pi` is the returned node's index in the child
- * array of `*p`, `*pp` is the parent of `*p` and `*ppi` is the index of `*p`
- * in the child array of `*pp`.
- *
- * If there's no node with the given key if `t`, but a wild-card node is
- * encountered during the search descent, last such node will be returned and
- * `*p`, `*pi`, `*pp` and `*ppi` will be set accordingly.
- *
- * If the node is not found, `NULL` is returned and the value of `*p`, `*pi`,
- * `*pp` and `*ppi` is undefined.
- *
- * The reason we need this method (with two immediate predecessors returned
- * alongside the node) is that we don't keep parent pointers in the nodes of
- * the trie to conserve space. Since all operations on `t` require at most the
- * grand-parent of modified node, this seems reasonable.
+ * The size of `label` is worked out from its length, so it must still hold the
+ * string it was allocated for.
  */
-static inline struct ctnode *find3(struct ctrie *t,
-                                   char *key,
-                                   struct ctnode **pp,
-                                   size_t *ppi,
-                                   struct ctnode **p,
-                                   size_t *pi)
+static void label_free(struct ctrie *t, char *label)
 {
-	*ppi = *pi = 0;
-	*pp = NULL;
-	*p = t->fake_root;
-	struct ctnode *w = NULL, *wp = *p, *wpp = *pp;
-	size_t wpi = 0, wppi = 0;
-	struct ctnode *n = t->fake_root->child[0];
-	while (n) {
-		char *l;
-		for (l = get_label(n); *key && *key == *l; l++, key++);
-		if (*l) /* label mismatch */
-			break;
-		if (!*key) { /* key matched current node */
-			if (n->flags & F_WORD)
-				return n;
-			break;
-		}
-		if (n->flags & F_WILD) {
-			/* save the wild node and current search state */
-			w = n;
-			wpp = *pp;
-			wppi = *ppi;
-			wp = *p;
-			wpi = *pi;
-		}
-		*pp = *p;
-		*ppi = *pi;
-		*p = n;
-		char k = *key++;
-		*pi = find_child_idx(t, n, k);
-		if (*pi >= n->nchild || char_array(t, n)[*pi] != k)
-			break;
-		n = (*p)->child[*pi];
-		assert((*pp)->child[*ppi] == *p);
-		assert((*p)->child[*pi] == n);
+	struct ctrie_arena *a = t->arena;
+	size_t size = strlen(label) + 1;
+	if (size <= ARENA_LABEL_MAX) {
+		arena_release(a, label, size);
+		return;
 	}
-	/* return last wild-card node encountered during the search (if any) */
-	*pp = wpp;
-	*ppi = wppi;
-	*p = wp;
-	*pi = wpi;
-	return w;
+	struct arena_big *b = (struct arena_big *)(label - offsetof(struct arena_big, label));
+	if (b->prev)
+		b->prev->next = b->next;
+	else
+		a->big = b->next;
+	if (b->next)
+		b->next->prev = b->prev;
+	free(b);
 }
 
-static struct ctnode *find(struct ctrie *t, char *key)
+#else
+
+static struct ctnode *deref(struct ctrie *t, ctref_t r)
 {
-	struct ctnode *p, *pp;
-	size_t pi, ppi;
-	return find3(t, key, &pp, &ppi, &p, &pi);
+	return (struct ctnode *)r;
 }
 
-void *ctrie_find(struct ctrie *t, char *key)
+static ctref_t ref(struct ctrie *t, struct ctnode *n)
 {
-	struct ctnode *n = find(t, key);
-	return n ? data(t, n) : NULL;
+	return (uintptr_t)n;
 }
 
-bool ctrie_contains(struct ctrie *t, char *key)
+static void *node_alloc(struct ctrie *t, size_t size)
 {
-	return find(t, key) != NULL;
+	if (size <= CACHE_LINE)
+		return xmalloc(size);
+	void *ptr = aligned_alloc(CACHE_LINE, ALIGN(size, CACHE_LINE));
+	if (!ptr) {
+		perror("aligned_alloc");
+		abort();
+	}
+	return ptr;
 }
 
-static void ctrie_print_node(struct ctrie *t, struct ctnode *n, size_t level)
+static void node_release(struct ctrie *t, struct ctnode *n, size_t size)
 {
-	char *a = char_array(t, n);
-	for (size_t i = 0; i < n->nchild; i++) {
-		struct ctnode *c = n->child[i];
-		for (size_t j = 0; j < 4 * level; j++)
-			putchar(' ');
-		printf("[%c]->'%s' size=%i alloc=%zuB <",
-			a[i],
-			get_label(c),
-			c->size,
-			alloc_size(t, c->size));
-		if (c->flags & F_WORD)
+	free(n);
+}
+
+static char *label_alloc(struct ctrie *t, size_t len)
+{
+	return xmalloc(len + 1);
+}
+
+static void label_free(struct ctrie *t, char *label)
+{
+	free(label);
+}
+
+static struct ctnode *node_realloc(struct ctrie *t,
+                                   struct ctnode *n,
+                                   size_t old_size,
+                                   size_t new_size)
+{
+	if (old_size <= CACHE_LINE && new_size <= CACHE_LINE)
+		return xrealloc(n, new_size);
+	/* realloc(3) does not preserve alignment */
+	struct ctnode *new = node_alloc(t, new_size);
+	memcpy(new, n, MIN(old_size, new_size));
+	free(n);
+	return new;
+}
+
+#endif
+
+/*
+ * Set label of `n` to the `len` bytes at `label`, which need not be
+ * NUL-terminated. If the label is short enough, it will be copied into the
+ * `label` field of the node. If it's longer, create a separate copy of it.
+ */
+static void set_label_n(struct ctrie *t,
+                        struct ctnode *n,
+                        const char *label,
+                        size_t len)
+{
+	char *old_label = get_label(n);
+	bool need_free = (n->flags & F_SEPL);
+	if (len < sizeof(n->label)) {
+		n->flags &= ~F_SEPL;
+		/* memmove: label may be equal to n->label if old label short */
+		memmove(n->label, label, len);
+		n->label[len] = '\0';
+		STAT(t, labels_embedded, 1);
+		EVENT(t, CTRIE_EVENT_LABEL_EMBEDDED, len);
+	} else {
+		ALLOC_START(t);
+		char *copy = label_alloc(t, len);
+		ALLOC_END(t);
+		memcpy(copy, label, len);
+		copy[len] = '\0';
+		n->flags |= F_SEPL;
+		*(char **)&n->label = copy;
+		STAT(t, labels_heap, 1);
+		EVENT(t, CTRIE_EVENT_LABEL_HEAP, len);
+	}
+	if (need_free) {
+		ALLOC_START(t);
+		label_free(t, old_label);
+		ALLOC_END(t);
+	}
+}
+
+static void set_label(struct ctrie *t, struct ctnode *n, const char *label)
+{
+	set_label_n(t, n, label, strlen(label));
+}
+
+/*
+ * Return a pointer to the character array of the node `n`.
+ */
+static inline char *char_array(struct ctrie *t, struct ctnode *n)
+{
+	return (char *)(n + 1);
+}
+
+/*
+ * Return a pointer to the child reference array of a node `n`.
+ */
+static inline ctref_t *children(struct ctnode *n)
+{
+	return (ctref_t *)((byte_t *)(n + 1) + ALIGN(n->size, sizeof(void *)));
+}
+
+/*
+ * Return a pointer to the data memory of the node `n`.
+ */
+static inline void *data(struct ctrie *t, struct ctnode *n)
+{
+	if (is_inline(n))
+		return inline_ref(n);
+	size_t refs = ALIGN(n->size * sizeof(ctref_t), sizeof(void *));
+	return (byte_t *)children(n) + refs;
+}
+
+/*
+ * Return the rank array of the node `n`, which has children, of a trie
+ * numbered by `ctrie_number`. The array takes the place of the data. Entry
+ * `i` is the number of words below `n`, `n` itself included, which precede
+ * the subtree of its `i`-th child, and entry `nchild` is the number of all
+ * words below `n`.
+ */
+static inline uint32_t *ranks(struct ctrie *t, struct ctnode *n)
+{
+	assert(!t->data_size && !is_inline(n));
+	return data(t, n);
+}
+
+/*
+ * Return the `i`-th child of `n`.
+ */
+static inline struct ctnode *get_child(struct ctrie *t, struct ctnode *n, size_t i)
+{
+	ctref_t *r = &children(n)[i];
+	if (*r & 1)
+		return (struct ctnode *)((uintptr_t)r | 1);
+	return deref(t, *r);
+}
+
+/*
+ * Make `c` the `i`-th child of `n`.
+ */
+static inline void set_child(struct ctrie *t, struct ctnode *n, size_t i, struct ctnode *c)
+{
+	children(n)[i] = is_inline(c) ? *inline_ref(c) : ref(t, c);
+}
+
+/*
+ * Return the root node of `t`.
+ */
+static inline struct ctnode *root(struct ctrie *t)
+{
+	return get_child(t, t->fake_root, 0);
+}
+
+/*
+ * Return the number of bytes of the rank array of a node with size `size`.
+ * Leaves have none, they hold a single word.
+ */
+static inline size_t ranks_size(size_t size)
+{
+	return size ? (size + 1) * sizeof(uint32_t) : 0;
+}
+
+/*
+ * Return the number of bytes needed to allocate a node with size `size`.
+ */
+static size_t alloc_size(struct ctrie *t, size_t size)
+{
+	size_t chars = ALIGN(size, sizeof(void *));
+	size_t refs = ALIGN(size * sizeof(ctref_t), sizeof(void *));
+	size_t extra = t->numbered ? ranks_size(size) : 0;
+	return sizeof(struct ctnode) + chars + refs + t->data_size + extra;
+}
+
+/*
+ * The largest data size, such that a node of `NODE_MAX_SIZE` children with
+ * ranks still fits in an arena chunk in `CTRIE_REF32` builds, or its size
+ * doesn't overflow otherwise.
+ */
+#define NODE_BYTES_MAX (sizeof(struct ctnode) \
+	+ ALIGN(NODE_MAX_SIZE, sizeof(void *)) \
+	+ ALIGN(NODE_MAX_SIZE * sizeof(ctref_t), sizeof(void *)) \
+	+ (NODE_MAX_SIZE + 1) * sizeof(uint32_t))
+#ifdef CTRIE_REF32
+#define DATA_SIZE_MAX (ARENA_CHUNK_SIZE - CACHE_LINE - ARENA_UNIT - NODE_BYTES_MAX)
+#else
+#define DATA_SIZE_MAX (PTRDIFF_MAX - NODE_BYTES_MAX)
+#endif
+
+/*
+ * Prefix hash index. Maps the prefixes of the keys whose length is a multiple
+ * of `INDEX_STRIDE` to the nodes in whose labels they end, so that a lookup of
+ * a long key can jump deep into the trie instead of descending through all the
+ * nodes on the path. See `ctrie_index_init`.
+ *
+ * The prefix of length `len` ending at offset `off` of the label of `n` is
+ * indexed by an entry in two hash tables, one by the prefix, which is used by
+ * the lookups, and one by `n`, which is used to keep the entries of `n` up to
+ * date as `n` is reallocated, split, merged or freed.
+ *
+ * The prefixes are kept back to back in a single pool rather than allocated
+ * one by one. Room freed by dropped entries is reused by later prefixes of the
+ * same length, of which there are only `INDEX_MAX_LEVELS`.
+ *
+ * The indexed prefix lengths of every key form a contiguous range starting at
+ * `INDEX_STRIDE`: an insertion indexes all prefixes of its key, and entries
+ * only go away with the nodes at the ends of paths. The lookup relies on this
+ * to binary search the prefix lengths.
+ */
+#define INDEX_STRIDE     16
+#define INDEX_MAX_LEVELS 64
+#define INDEX_NONE       UINT32_MAX
+
+struct index_ent
+{
+	uint64_t hash;      /* hash of the prefix */
+	size_t prefix;      /* offset of the prefix in the pool */
+	struct ctnode *n;   /* node whose label the prefix ends in */
+	uint32_t len;       /* length of the prefix, 0 for free entries */
+	uint32_t off;       /* offset of the end of the prefix in the label */
+	uint32_t next_key;  /* next entry in the bucket by prefix, or free list */
+	uint32_t next_node; /* next entry in the bucket by node */
+};
+
+struct ctrie_index
+{
+	struct index_ent *ents; /* entries */
+	size_t nents;           /* number of used items of `ents` */
+	size_t ents_size;       /* capacity of `ents` */
+	uint32_t free;          /* list of free entries */
+	size_t count;           /* number of live entries */
+	uint32_t *by_key;       /* buckets by prefix hash */
+	uint32_t *by_node;      /* buckets by node address */
+	size_t mask;            /* number of buckets minus one */
+	bool wild;              /* the trie may hold wild-card keys */
+	char *pool;             /* the prefixes of the entries */
+	size_t pool_len;        /* number of used bytes of `pool` */
+	size_t pool_size;       /* capacity of `pool` */
+	size_t pool_free[INDEX_MAX_LEVELS + 1]; /* free room by prefix length */
+};
+
+/*
+ * Return the offset of room for a prefix of `len` bytes in the pool of `x`.
+ * The free room of each length is a list linked through the room itself.
+ */
+static size_t pool_alloc(struct ctrie_index *x, size_t len)
+{
+	assert(len % INDEX_STRIDE == 0 && len / INDEX_STRIDE <= INDEX_MAX_LEVELS);
+	size_t *f = &x->pool_free[len / INDEX_STRIDE], off = *f;
+	if (off != SIZE_MAX) {
+		memcpy(f, x->pool + off, sizeof(*f));
+		return off;
+	}
+	AGROW(x->pool, x->pool_len + len, x->pool_size);
+	off = x->pool_len;
+	x->pool_len += len;
+	return off;
+}
+
+static void pool_release(struct ctrie_index *x, size_t off, size_t len)
+{
+	size_t *f = &x->pool_free[len / INDEX_STRIDE];
+	memcpy(x->pool + off, f, sizeof(*f));
+	*f = off;
+}
+
+/*
+ * Hash the next `INDEX_STRIDE` bytes at `p` of a prefix whose hash so far is
+ * `h`.
+ */
+static inline uint64_t index_hash(uint64_t h, const char *p)
+{
+	uint64_t a, b;
+	memcpy(&a, p, sizeof(a));
+	memcpy(&b, p + sizeof(a), sizeof(b));
+	h = (h ^ a) * 0x9e3779b97f4a7c15;
+	h = (h ^ (h >> 32) ^ b) * 0xff51afd7ed558ccd;
+	return h ^ (h >> 29);
+}
+
+static inline size_t node_bucket(struct ctrie_index *x, struct ctnode *n)
+{
+	return ((uintptr_t)n * 0x9e3779b97f4a7c15) >> 32 & x->mask;
+}
+
+static void index_link(struct ctrie_index *x, uint32_t i)
+{
+	struct index_ent *e = &x->ents[i];
+	size_t b = e->hash & x->mask;
+	e->next_key = x->by_key[b];
+	x->by_key[b] = i;
+	b = node_bucket(x, e->n);
+	e->next_node = x->by_node[b];
+	x->by_node[b] = i;
+}
+
+static void index_rehash(struct ctrie_index *x, size_t nbuckets)
+{
+	free(x->by_key);
+	free(x->by_node);
+	x->mask = nbuckets - 1;
+	x->by_key = xmalloc(nbuckets * sizeof(*x->by_key));
+	x->by_node = xmalloc(nbuckets * sizeof(*x->by_node));
+	memset(x->by_key, 0xff, nbuckets * sizeof(*x->by_key));
+	memset(x->by_node, 0xff, nbuckets * sizeof(*x->by_node));
+	for (uint32_t i = 0; i < x->nents; i++)
+		if (x->ents[i].len)
+			index_link(x, i);
+}
+
+static void index_add(struct ctrie_index *x,
+                      const char *prefix,
+                      size_t len,
+                      uint64_t hash,
+                      struct ctnode *n,
+                      size_t off)
+{
+	uint32_t i = x->free;
+	if (i != INDEX_NONE) {
+		x->free = x->ents[i].next_key;
+	} else {
+		AGROW(x->ents, x->nents, x->ents_size);
+		i = x->nents++;
+	}
+	struct index_ent *e = &x->ents[i];
+	e->hash = hash;
+	e->prefix = pool_alloc(x, len);
+	memcpy(x->pool + e->prefix, prefix, len);
+	e->len = len;
+	e->n = n;
+	e->off = off;
+	x->count++;
+	if (x->count > x->mask + 1)
+		index_rehash(x, 2 * (x->mask + 1));
+	else
+		index_link(x, i);
+}
+
+/*
+ * Drop the entries of node `n`, which is about to be freed.
+ */
+static void index_drop(struct ctrie_index *x, struct ctnode *n)
+{
+	uint32_t *r = &x->by_node[node_bucket(x, n)];
+	while (*r != INDEX_NONE) {
+		struct index_ent *e = &x->ents[*r];
+		if (e->n != n) {
+			r = &e->next_node;
+			continue;
+		}
+		uint32_t i = *r;
+		*r = e->next_node;
+		uint32_t *k = &x->by_key[e->hash & x->mask];
+		while (*k != i)
+			k = &x->ents[*k].next_key;
+		*k = e->next_key;
+		pool_release(x, e->prefix, e->len);
+		e->len = 0;
+		e->next_key = x->free;
+		x->free = i;
+		x->count--;
+	}
+}
+
+/*
+ * Move the entries of node `n` whose offset is at least `from` to node `to`,
+ * adding `shift` to their offsets.
+ */
+static void index_move(struct ctrie_index *x,
+                       struct ctnode *n,
+                       size_t from,
+                       struct ctnode *to,
+                       ptrdiff_t shift)
+{
+	uint32_t moved = INDEX_NONE;
+	uint32_t *r = &x->by_node[node_bucket(x, n)];
+	while (*r != INDEX_NONE) {
+		struct index_ent *e = &x->ents[*r];
+		if (e->n != n || e->off < from) {
+			r = &e->next_node;
+			continue;
+		}
+		uint32_t i = *r;
+		*r = e->next_node;
+		e->n = to;
+		e->off += shift;
+		e->next_node = moved;
+		moved = i;
+	}
+	while (moved != INDEX_NONE) {
+		struct index_ent *e = &x->ents[moved];
+		uint32_t next = e->next_node;
+		size_t b = node_bucket(x, to);
+		e->next_node = x->by_node[b];
+		x->by_node[b] = moved;
+		moved = next;
+	}
+}
+
+/*
+ * Resize `n` to `new_size`.
+ */
+static struct ctnode *resize(struct ctrie *t, struct ctnode *n, size_t new_size)
+{
+	assert(new_size <= NODE_MAX_SIZE);
+	assert(n->size <= new_size);
+	struct ctnode *old = n;
+	ALLOC_START(t);
+	n = node_realloc(t, n, alloc_size(t, n->size), alloc_size(t, new_size));
+	ALLOC_END(t);
+	if (t->index && n != old)
+		index_move(t->index, old, 0, n, 0);
+	size_t old_size = n->size;
+	ctref_t *old_children = children(n);
+	void *old_data = data(t, n);
+	n->size = new_size;
+	/* both data and child array move towards the end, data go first */
+	memmove(data(t, n), old_data, t->data_size);
+	memmove(children(n), old_children, old_size * sizeof(ctref_t));
+	size_t moved = t->data_size + old_size * sizeof(ctref_t);
+	if (n != old)
+		moved += alloc_size(t, old_size);
+	STAT(t, resizes, 1);
+	STAT(t, resize_bytes, moved);
+	EVENT(t, CTRIE_EVENT_RESIZE, moved);
+	return n;
+}
+
+/*
+ * Allocate a new node, making sure that its initial size will be
+ * at least `min_size`, i.e. that `min_size` children can subsequently
+ * be inserted without the need to reallocate the node.
+ */
+static struct ctnode *new_node(struct ctrie *t, size_t min_size)
+{
+	assert(min_size <= NODE_MAX_SIZE);
+	size_t size = MAX(min_size, NODE_INIT_SIZE);
+	ALLOC_START(t);
+	struct ctnode *n = node_alloc(t, alloc_size(t, size));
+	ALLOC_END(t);
+	memset(n, 0, alloc_size(t, size));
+	n->size = size;
+	return n;
+}
+
+static size_t find_child_idx(struct ctrie *t, struct ctnode *n, char k)
+{
+	char *a = char_array(t, n);
+	size_t l = 0, r = node_nchild(n);
+	while (l < r) { /* won't run if no child */
+		size_t m = (l + r) / 2;
+		if (k <= a[m])
+			r = m;
+		else
+			l = m + 1;
+	}
+	return l; /* 0 if no child */
+}
+
+#define ARRAY_SHIFT(a, j, i, size) \
+	memmove((a) + (j), (a) + (i), ((size) - (i)) * sizeof(*(a)))
+
+static struct ctnode *insert_ref(struct ctrie *t,
+                                 struct ctnode *n,
+                                 char k,
+                                 ctref_t r)
+{
+	if (n->size == n->nchild)
+		n = resize(t, n, MAX(1, MIN(2 * n->size, NODE_MAX_SIZE)));
+	size_t idx = find_child_idx(t, n, k);
+	assert(idx < n->size);
+	char *a = char_array(t, n);
+	ARRAY_SHIFT(a, idx + 1, idx, n->nchild);
+	ARRAY_SHIFT(children(n), idx + 1, idx, n->nchild);
+	a[idx] = k;
+	children(n)[idx] = r;
+	n->nchild++;
+	return n;
+}
+
+static struct ctnode *insert_child(struct ctrie *t,
+                                   struct ctnode *n,
+                                   char k,
+                                   struct ctnode *child)
+{
+	return insert_ref(t, n, k, ref(t, child));
+}
+
+/*
+ * Free node `n`, but not its children.
+ */
+static void free_node(struct ctrie *t, struct ctnode *n)
+{
+	if (t->index)
+		index_drop(t->index, n);
+	ALLOC_START(t);
+	if (n->flags & F_SEPL)
+		label_free(t, get_label(n));
+	node_release(t, n, alloc_size(t, n->size));
+	ALLOC_END(t);
+}
+
+/*
+ * Can a leaf with a label of `len` characters be stored inline in `t`?
+ */
+static bool can_inline(struct ctrie *t, size_t len)
+{
+	return !t->data_size && len <= INLINE_MAX;
+}
+
+/*
+ * Return a child reference holding an inline leaf with the `len` characters
+ * at `label` as its label and `flags`.
+ */
+static ctref_t make_inline(const char *label, size_t len, byte_t flags)
+{
+	ctref_t r = 0;
+	byte_t *b = (byte_t *)&r;
+	b[INLINE_TAG] = 1 | flags << 1;
+	memcpy(b + INLINE_LABEL, label, len);
+	return r;
+}
+
+/*
+ * Replace the inline leaf which is the `i`-th child of `p` with an ordinary
+ * node and return the node.
+ */
+static struct ctnode *expand_inline(struct ctrie *t, struct ctnode *p, size_t i)
+{
+	struct ctnode *c = get_child(t, p, i);
+	struct ctnode *n = new_node(t, 0);
+	n->flags = node_flags(c);
+	set_label(t, n, get_label(c));
+	set_child(t, p, i, n);
+	return n;
+}
+
+/*
+ * If the `i`-th child of `p` is an ordinary node which can be stored inline,
+ * store it inline.
+ */
+static void shrink_leaf(struct ctrie *t, struct ctnode *p, size_t i)
+{
+	struct ctnode *n = get_child(t, p, i);
+	if (is_inline(n) || n->nchild || !can_inline(t, strlen(get_label(n))))
+		return;
+	assert(n->flags & F_WORD);
+	char *l = get_label(n);
+	children(p)[i] = make_inline(l, strlen(l), n->flags & ~F_SEPL);
+	free_node(t, n);
+}
+
+int ctrie_init(struct ctrie *t, size_t data_size)
+{
+	if (data_size > DATA_SIZE_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+	t->data_size = data_size;
+	t->gen = 0;
+	t->frozen = false;
+	t->numbered = false;
+	t->index = NULL;
+	t->cache = NULL;
+#ifdef CTRIE_STATS
+	t->stats = xcalloc(1, sizeof(*t->stats));
+#else
+	t->stats = NULL;
+#endif
+#ifdef CTRIE_REF32
+	t->arena = arena_new();
+#else
+	t->arena = NULL;
+#endif
+	// FIXME Alloc check
+	t->fake_root = insert_child(t, new_node(t, 1), '\0', new_node(t, 0));
+	//root(t)->flags |= F_WORD;
+	return 0;
+}
+
+/*
+ * Free the subtree rooted at `n` and return the number of words it held.
+ *
+ * The subtree is walked with an explicit stack, since tries of long keys may
+ * be too deep to recurse.
+ */
+static size_t delete_node(struct ctrie *t, struct ctnode *n)
+{
+	if (is_inline(n))
+		return 1;
+	struct ctnode **stack = NULL;
+	size_t nstack = 0, stack_size = 0, count = 0;
+	AGROW(stack, nstack, stack_size);
+	stack[nstack++] = n;
+	while (nstack) {
+		n = stack[--nstack];
+		count += !!(n->flags & F_WORD);
+		/* push in reverse so that the nodes are freed in key order */
+		for (size_t i = n->nchild; i-- > 0;) {
+			struct ctnode *c = get_child(t, n, i);
+			if (is_inline(c)) {
+				count++;
+				continue;
+			}
+			AGROW(stack, nstack, stack_size);
+			stack[nstack++] = c;
+		}
+		free_node(t, n);
+	}
+	free(stack);
+	return count;
+}
+
+#ifndef CTRIE_REF32
+
+/*
+ * Free the nodes of the frozen trie `t`, which may be shared by several
+ * parents. Every node is marked when it's first reached, and the nodes are
+ * freed once all of them have been reached.
+ */
+static void delete_frozen(struct ctrie *t)
+{
+	struct ctnode **nodes = NULL;
+	size_t nnodes = 0, nodes_size = 0;
+	AGROW(nodes, nnodes, nodes_size);
+	nodes[nnodes++] = t->fake_root;
+	for (size_t i = 0; i < nnodes; i++) {
+		struct ctnode *n = nodes[i];
+		for (size_t j = 0; j < n->nchild; j++) {
+			struct ctnode *c = get_child(t, n, j);
+			if (is_inline(c) || (c->flags & F_MARK))
+				continue;
+			c->flags |= F_MARK;
+			AGROW(nodes, nnodes, nodes_size);
+			nodes[nnodes++] = c;
+		}
+	}
+	for (size_t i = 0; i < nnodes; i++)
+		free_node(t, nodes[i]);
+	free(nodes);
+}
+
+#endif
+
+void ctrie_free(struct ctrie *t)
+{
+	ctrie_index_free(t);
+	ctrie_cache_free(t);
+#ifdef CTRIE_REF32
+	/* all nodes and labels live in the arena */
+	arena_free(t->arena);
+#else
+	if (t->frozen)
+		delete_frozen(t);
+	else
+		delete_node(t, t->fake_root);
+#endif
+	free(t->stats);
+}
+
+/*
+ * Serialization. The stream starts with `SAVE_MAGIC` and the data size as
+ * a varint, followed by the nodes in DFS preorder. A node is stored as its
+ * number of children (a byte), the varint length of its label, the label,
+ * the flags (a byte), the characters of its children and, for words, its
+ * data. The children of a node follow it in the order of their characters.
+ */
+#define SAVE_MAGIC      "ctrie\0v1"
+#define SAVE_MAGIC_SIZE 8
+#define SAVE_FLAGS      (F_USER | F_WORD | F_WILD)
+
+/*
+ * Stack entry of `ctrie_save` and `ctrie_load`: node `n` and the index of its
+ * next child to walk, or, when loading, the number of its children.
+ */
+struct save_ent
+{
+	struct ctnode *n; /* the node */
+	size_t i;         /* next child to walk */
+};
+
+/*
+ * The streams are locked for the whole walk and accessed a byte at a time by
+ * the unlocked stdio macros, which is much cheaper than a call to `fread(3)`
+ * or `fwrite(3)` for every few bytes of a node.
+ */
+static void put_bytes(FILE *f, const void *p, size_t n)
+{
+	for (size_t i = 0; i < n; i++)
+		putc_unlocked(((const byte_t *)p)[i], f);
+}
+
+static bool get_bytes(FILE *f, void *p, size_t n)
+{
+	for (size_t i = 0; i < n; i++) {
+		int c = getc_unlocked(f);
+		if (c == EOF)
+			return false;
+		((byte_t *)p)[i] = c;
+	}
+	return true;
+}
+
+static void put_varint(FILE *f, size_t v)
+{
+	for (; v >= 0x80; v >>= 7)
+		putc_unlocked(v | 0x80, f);
+	putc_unlocked(v, f);
+}
+
+static bool get_varint(FILE *f, size_t *v)
+{
+	*v = 0;
+	for (size_t shift = 0; shift < 8 * sizeof(*v); shift += 7) {
+		int c = getc_unlocked(f);
+		if (c == EOF)
+			return false;
+		*v |= (size_t)(c & 0x7f) << shift;
+		if (!(c & 0x80))
+			return true;
+	}
+	return false;
+}
+
+static void save_node(struct ctrie *t, struct ctnode *n, FILE *f)
+{
+	char *l = get_label(n);
+	size_t len = strlen(l);
+	byte_t flags = node_flags(n);
+	putc_unlocked(node_nchild(n), f);
+	put_varint(f, len);
+	put_bytes(f, l, len);
+	putc_unlocked(flags & SAVE_FLAGS, f);
+	if (!is_inline(n))
+		put_bytes(f, char_array(t, n), n->nchild);
+	if (flags & F_WORD)
+		put_bytes(f, data(t, n), t->data_size);
+}
+
+int ctrie_save(struct ctrie *t, FILE *f)
+{
+	struct save_ent *stack = NULL;
+	size_t nstack = 0, stack_size = 0;
+	flockfile(f);
+	put_bytes(f, SAVE_MAGIC, SAVE_MAGIC_SIZE);
+	put_varint(f, t->data_size);
+	save_node(t, root(t), f);
+	AGROW(stack, nstack, stack_size);
+	stack[nstack++] = (struct save_ent) { root(t), 0 };
+	while (nstack) {
+		struct save_ent *e = &stack[nstack - 1];
+		if (e->i == e->n->nchild) {
+			nstack--;
+			continue;
+		}
+		struct ctnode *c = get_child(t, e->n, e->i++);
+		save_node(t, c, f);
+		if (node_nchild(c)) {
+			AGROW(stack, nstack, stack_size);
+			stack[nstack++] = (struct save_ent) { c, 0 };
+		}
+	}
+	free(stack);
+	funlockfile(f);
+	return ferror(f) ? -1 : 0;
+}
+
+/*
+ * Read `len` bytes from `f` into the buffer `*buf` of `*size` bytes, growing
+ * it as the bytes arrive, so that a corrupt length costs no more memory than
+ * the stream actually holds.
+ */
+static bool get_label_bytes(FILE *f, char **buf, size_t *size, size_t len)
+{
+	for (size_t i = 0; i < len; i++) {
+		int c = getc_unlocked(f);
+		if (c == EOF)
+			return false;
+		if (i == *size) {
+			*size *= 2;
+			*buf = xrealloc(*buf, *size);
+		}
+		(*buf)[i] = c;
+	}
+	return true;
+}
+
+/*
+ * Read a node from `f` and append it to the children of `p`. The node is
+ * allocated at its final size, with its character array filled, but with no
+ * children yet. Its label is read into `*buf` of `*size` bytes first, and
+ * nothing is allocated before the label proves to be in the stream. Set
+ * `*nchild` to the number of children it's going to have. Return false if the
+ * node is truncated or malformed.
+ */
+static bool load_node(struct ctrie *t,
+                      FILE *f,
+                      struct ctnode *p,
+                      size_t *nchild,
+                      char **buf,
+                      size_t *size)
+{
+	size_t len;
+	int flags, k = getc_unlocked(f);
+	if (k == EOF || !get_varint(f, &len)
+	    || !get_label_bytes(f, buf, size, len)
+	    || (flags = getc_unlocked(f)) == EOF
+	    || memchr(*buf, '\0', len))
+		return false;
+	*nchild = k;
+	if (!k && p != t->fake_root && can_inline(t, len)) {
+		children(p)[p->nchild++] = make_inline(*buf, len, flags & SAVE_FLAGS);
+		return flags & F_WORD; /* leaves are words */
+	}
+
+	struct ctnode *n = new_node(t, k);
+	char *l = n->label;
+	if (len >= sizeof(n->label)) {
+		ALLOC_START(t);
+		l = label_alloc(t, len);
+		ALLOC_END(t);
+		*(char **)&n->label = l;
+		n->flags = F_SEPL;
+	}
+	memcpy(l, *buf, len);
+	l[len] = '\0';
+	set_child(t, p, p->nchild++, n);
+	n->flags |= flags & SAVE_FLAGS;
+	if (!k && !(n->flags & F_WORD) && p != t->fake_root)
+		return false;
+	char *a = char_array(t, n);
+	if (!get_bytes(f, a, k))
+		return false;
+	for (int j = 0; j < k; j++)
+		if (!a[j] || (j && a[j - 1] >= a[j]))
+			return false;
+	if (n->flags & F_WORD)
+		return get_bytes(f, data(t, n), t->data_size);
+	return true;
+}
+
+/*
+ * Return the number of bytes left to read from `f`, or `SIZE_MAX` if `f` is
+ * not a regular file, e.g. a pipe from a decompressor.
+ */
+static size_t stream_left(FILE *f)
+{
+	struct stat st;
+	off_t pos = ftello(f);
+	if (pos < 0 || fstat(fileno(f), &st) || !S_ISREG(st.st_mode))
+		return SIZE_MAX;
+	return st.st_size > pos ? (size_t)(st.st_size - pos) : 0;
+}
+
+/*
+ * The nodes are attached to their parents as they are read, so that `t` is
+ * a valid trie which can be freed should the stream turn out to be malformed.
+ *
+ * Every node is allocated with room for the data, so a data size taken from
+ * a corrupt stream could make even the root too large to allocate. A word
+ * must be followed by its data, so a data size larger than the rest of the
+ * stream only fits a trie without words, which is written by `ctrie_save` as
+ * just its root. Such sizes are trusted up to `SAVE_EMPTY_DATA_MAX`.
+ */
+#define SAVE_EMPTY_DATA_MAX 4096
+
+int ctrie_load(struct ctrie *t, FILE *f)
+{
+	char magic[SAVE_MAGIC_SIZE];
+	size_t data_size, nchild;
+	struct save_ent *stack = NULL;
+	size_t nstack = 0, stack_size = 0;
+	size_t buf_size = LABEL_BUF_SIZE;
+	char *buf = xmalloc(buf_size);
+	flockfile(f);
+	if (!get_bytes(f, magic, sizeof(magic))
+	    || memcmp(magic, SAVE_MAGIC, sizeof(magic))
+	    || !get_varint(f, &data_size)
+	    || (data_size > stream_left(f) && data_size > SAVE_EMPTY_DATA_MAX)
+	    || ctrie_init(t, data_size))
+		goto err;
+	free_node(t, root(t));
+	t->fake_root->nchild = 0;
+	struct ctnode *p = t->fake_root;
+	while (1) {
+		if (!load_node(t, f, p, &nchild, &buf, &buf_size))
+			goto err_free;
+		if (nchild) {
+			AGROW(stack, nstack, stack_size);
+			stack[nstack++] = (struct save_ent) {
+				get_child(t, p, p->nchild - 1), nchild
+			};
+		}
+		while (nstack && stack[nstack - 1].n->nchild == stack[nstack - 1].i)
+			nstack--;
+		if (!nstack)
+			break;
+		p = stack[nstack - 1].n;
+	}
+	free(stack);
+	free(buf);
+	funlockfile(f);
+	return 0;
+err_free:
+	ctrie_free(t);
+err:
+	free(stack);
+	free(buf);
+	funlockfile(f);
+	if (!ferror(f))
+		errno = EINVAL;
+	return -1;
+}
+
+/*
+ * Find a node with key `key`, which ends at `end`, in trie `t` and its two
+ * immediate predecessors.
+ *
+ * If node with the given key is found, it's returned and `*p` points to the
+ * returned node's parent, `*pi` is the returned node's index in the child
+ * array of `*p`, `*pp` is the parent of `*p` and `*ppi` is the index of `*p`
+ * in the child array of `*pp`.
+ *
+ * If there's no node with the given key if `t`, but a wild-card node is
+ * encountered during the search descent, last such node will be returned and
+ * `*p`, `*pi`, `*pp` and `*ppi` will be set accordingly.
+ *
+ * If the node is not found, `NULL` is returned and the value of `*p`, `*pi`,
+ * `*pp` and `*ppi` is undefined.
+ *
+ * The reason we need this method (with two immediate predecessors returned
+ * alongside the node) is that we don't keep parent pointers in the nodes of
+ * the trie to conserve space. Since all operations on `t` require at most the
+ * grand-parent of modified node, this seems reasonable.
+ */
+static inline struct ctnode *find3(struct ctrie *t,
+                                   const char *key,
+                                   const char *end,
+                                   struct ctnode **pp,
+                                   size_t *ppi,
+                                   struct ctnode **p,
+                                   size_t *pi)
+{
+	*ppi = *pi = 0;
+	*pp = NULL;
+	*p = t->fake_root;
+	struct ctnode *w = NULL, *wp = *p, *wpp = *pp;
+	size_t wpi = 0, wppi = 0, visited = 0;
+	struct ctnode *n = root(t);
+	STAT(t, finds, 1);
+	while (n) {
+		char *l;
+		visited++;
+		for (l = get_label(n); key < end && *l && *key == *l; l++, key++);
+		STAT(t, label_bytes, l - get_label(n));
+		if (*l) /* label mismatch */
+			break;
+		if (key == end) { /* key matched current node */
+			if (node_flags(n) & F_WORD) {
+				STAT(t, nodes_visited, visited);
+				EVENT(t, CTRIE_EVENT_FIND, visited);
+				return n;
+			}
+			break;
+		}
+		if (node_flags(n) & F_WILD) {
+			/* save the wild node and current search state */
+			w = n;
+			wpp = *pp;
+			wppi = *ppi;
+			wp = *p;
+			wpi = *pi;
+		}
+		*pp = *p;
+		*ppi = *pi;
+		*p = n;
+		char k = *key++;
+		*pi = find_child_idx(t, n, k);
+		if (*pi >= node_nchild(n) || char_array(t, n)[*pi] != k)
+			break;
+		n = get_child(t, *p, *pi);
+		assert(get_child(t, *pp, *ppi) == *p);
+		assert(get_child(t, *p, *pi) == n);
+	}
+	STAT(t, nodes_visited, visited);
+	EVENT(t, CTRIE_EVENT_FIND, visited);
+	/* return last wild-card node encountered during the search (if any) */
+	*pp = wpp;
+	*ppi = wppi;
+	*p = wp;
+	*pi = wpi;
+	return w;
+}
+
+/*
+ * Compute the hashes of the indexed prefixes of the `len` bytes at `key` into
+ * `hs`, `hs[k]` being the hash of the prefix of `k * INDEX_STRIDE` bytes, and
+ * return the number of the prefixes.
+ */
+static size_t index_hashes(const char *key, size_t len, uint64_t *hs)
+{
+	size_t levels = MIN(len / INDEX_STRIDE, INDEX_MAX_LEVELS);
+	hs[0] = 0;
+	for (size_t k = 1; k <= levels; k++)
+		hs[k] = index_hash(hs[k - 1], key + (k - 1) * INDEX_STRIDE);
+	return levels;
+}
+
+static struct index_ent *index_get(struct ctrie_index *x,
+                                   const char *prefix,
+                                   size_t len,
+                                   uint64_t hash)
+{
+	uint32_t i;
+	for (i = x->by_key[hash & x->mask]; i != INDEX_NONE; i = x->ents[i].next_key) {
+		struct index_ent *e = &x->ents[i];
+		if (e->hash == hash && e->len == len
+		    && !memcmp(x->pool + e->prefix, prefix, len))
+			return e;
+	}
+	return NULL;
+}
+
+/*
+ * Binary search the `levels` prefixes of `key` whose hashes are `hs` for the
+ * longest indexed one and return its entry, or `NULL` if none is indexed.
+ *
+ * The longest prefix is probed first: it's indexed for most keys which are
+ * present, unless they end in short leaves, so this usually takes one probe.
+ */
+static struct index_ent *index_seek(struct ctrie_index *x,
+                                    const char *key,
+                                    const uint64_t *hs,
+                                    size_t levels)
+{
+	struct index_ent *best;
+	if (!levels)
+		return NULL;
+	if ((best = index_get(x, key, levels * INDEX_STRIDE, hs[levels])))
+		return best;
+	size_t lo = 1, hi = levels - 1;
+	while (lo <= hi) {
+		size_t mid = (lo + hi) / 2;
+		struct index_ent *e = index_get(x, key, mid * INDEX_STRIDE, hs[mid]);
+		if (e) {
+			best = e;
+			lo = mid + 1;
+		} else {
+			hi = mid - 1;
+		}
+	}
+	return best;
+}
+
+/*
+ * Like `find`, but start at the node of the longest indexed prefix of `key`.
+ */
+static struct ctnode *index_find(struct ctrie *t, const char *key, size_t len)
+{
+	uint64_t hs[INDEX_MAX_LEVELS + 1];
+	const char *end = key + len;
+	struct ctnode *n = root(t);
+	char *l = get_label(n);
+	size_t levels = index_hashes(key, len, hs);
+	struct index_ent *e = index_seek(t->index, key, hs, levels);
+	if (e) {
+		n = e->n;
+		l = get_label(n) + e->off;
+		key += e->len;
+	}
+	while (1) {
+		for (; key < end && *l && *key == *l; l++, key++);
+		if (*l) /* label mismatch */
+			return NULL;
+		if (key == end)
+			return (node_flags(n) & F_WORD) ? n : NULL;
+		char k = *key++;
+		size_t i = find_child_idx(t, n, k);
+		if (i >= node_nchild(n) || char_array(t, n)[i] != k)
+			return NULL;
+		n = get_child(t, n, i);
+		l = get_label(n);
+	}
+}
+
+/*
+ * Index the prefixes of `key`, which is in `t`, which are not indexed yet.
+ * They follow the longest indexed one.
+ */
+static void index_key(struct ctrie *t, const char *key, size_t len)
+{
+	struct ctrie_index *x = t->index;
+	uint64_t hs[INDEX_MAX_LEVELS + 1];
+	size_t levels = index_hashes(key, len, hs);
+	struct index_ent *e = index_seek(x, key, hs, levels);
+	size_t k = e ? e->len / INDEX_STRIDE + 1 : 1;
+	struct ctnode *n = e ? e->n : root(t);
+	size_t s = e ? e->len - e->off : 0; /* depth of the label of `n` */
+	while (k <= levels && !is_inline(n)) {
+		size_t end = s + strlen(get_label(n));
+		for (; k <= levels && k * INDEX_STRIDE <= end; k++)
+			index_add(x, key, k * INDEX_STRIDE, hs[k], n, k * INDEX_STRIDE - s);
+		if (k > levels)
+			break;
+		n = get_child(t, n, find_child_idx(t, n, key[end]));
+		s = end + 1;
+	}
+}
+
+/*
+ * Stack entry of `ctrie_index_init`: node `n` whose label starts at depth `s`
+ * and whose children from `i` on remain to be walked.
+ */
+struct index_walk
+{
+	struct ctnode *n; /* the node */
+	size_t s;         /* depth of the label */
+	size_t i;         /* next child to walk */
+};
+
+void ctrie_index_init(struct ctrie *t)
+{
+	struct index_walk *stack = NULL;
+	size_t nstack = 0, stack_size = 0;
+	uint64_t hs[INDEX_MAX_LEVELS + 1] = { 0 };
+	char *path = NULL;
+	size_t path_size = 0;
+	if (t->index || t->frozen)
+		return;
+	struct ctrie_index *x = t->index = xcalloc(1, sizeof(*x));
+	x->free = INDEX_NONE;
+	memset(x->pool_free, 0xff, sizeof(x->pool_free));
+	index_rehash(x, 1024);
+
+	struct ctnode *n = root(t);
+	AGROW(stack, nstack, stack_size);
+	stack[nstack++] = (struct index_walk) { n, 0, 0 };
+	while (nstack) {
+		struct index_walk *w = &stack[nstack - 1];
+		n = w->n;
+		char *l = get_label(n);
+		size_t len = strlen(l);
+		if (!w->i) { /* entering `n` */
+			if (node_flags(n) & F_WILD)
+				x->wild = true;
+			AGROW(path, w->s + len + 1, path_size);
+			memcpy(path + w->s, l, len);
+			size_t k = (w->s + INDEX_STRIDE - 1) / INDEX_STRIDE;
+			for (k = MAX(k, 1); k <= INDEX_MAX_LEVELS && k * INDEX_STRIDE <= w->s + len; k++) {
+				hs[k] = index_hash(hs[k - 1], path + (k - 1) * INDEX_STRIDE);
+				if (!is_inline(n))
+					index_add(x, path, k * INDEX_STRIDE, hs[k], n,
+						k * INDEX_STRIDE - w->s);
+			}
+		}
+		if (w->i == node_nchild(n)) {
+			nstack--;
+			continue;
+		}
+		size_t s = w->s + len;
+		path[s] = char_array(t, n)[w->i];
+		struct ctnode *c = get_child(t, n, w->i++);
+		AGROW(stack, nstack, stack_size); /* invalidates `w` */
+		stack[nstack++] = (struct index_walk) { c, s + 1, 0 };
+	}
+	free(stack);
+	free(path);
+}
+
+void ctrie_index_free(struct ctrie *t)
+{
+	struct ctrie_index *x = t->index;
+	if (!x)
+		return;
+	free(x->pool);
+	free(x->ents);
+	free(x->by_key);
+	free(x->by_node);
+	free(x);
+	t->index = NULL;
+}
+
+/*
+ * Find the word node of `key` without the cache.
+ */
+static struct ctnode *lookup(struct ctrie *t, const char *key, size_t len)
+{
+	struct ctnode *p, *pp;
+	size_t pi, ppi;
+	if (t->index && !t->index->wild && len >= 2 * INDEX_STRIDE)
+		return index_find(t, key, len);
+	return find3(t, key, key + len, &pp, &ppi, &p, &pi);
+}
+
+/*
+ * Lookup cache. A set-associative cache of the results of `find`, including
+ * misses, for keys of up to `CACHE_KEY_MAX` bytes. An entry is only valid
+ * while `t->gen` is the generation it was filled at, so any modification of
+ * the trie, and with it any move of a node, invalidates all the entries at
+ * once without touching them. See `ctrie_cache_init`.
+ *
+ * The hashes and generations of the entries of a set share a cache line, so
+ * that a lookup which misses reads one line. Each entry, which holds a copy of
+ * its key, takes a line of its own, which is only read if its hash matches.
+ * Entries are replaced at random unless there are invalid ones.
+ */
+#define CACHE_WAYS    4
+#define CACHE_KEY_MAX (CACHE_LINE - 12)
+
+struct cache_set
+{
+	uint64_t hash[CACHE_WAYS]; /* hashes of the keys */
+	size_t gen[CACHE_WAYS];    /* `t->gen` the entries are valid for */
+};
+
+struct cache_ent
+{
+	struct ctnode *n;        /* the node of the key, or `NULL` */
+	uint32_t len;            /* length of the key */
+	char key[CACHE_KEY_MAX]; /* the key */
+};
+
+_Static_assert(sizeof(struct cache_set) <= CACHE_LINE
+               && sizeof(struct cache_ent) <= CACHE_LINE,
+	"cache sets and entries must not straddle cache lines");
+
+struct ctrie_cache
+{
+	struct cache_set *sets; /* the sets */
+	struct cache_ent *ents; /* `CACHE_WAYS` entries per set */
+	size_t mask;            /* number of sets minus one */
+	size_t hits;            /* number of lookups found in the cache */
+	size_t misses;          /* number of lookups not found */
+};
+
+static uint64_t cache_hash(const char *key, size_t len)
+{
+	uint64_t h = len * 0x9e3779b97f4a7c15, w;
+	for (; len >= sizeof(w); key += sizeof(w), len -= sizeof(w)) {
+		memcpy(&w, key, sizeof(w));
+		h = (h ^ w) * 0xff51afd7ed558ccd;
+		h ^= h >> 32;
+	}
+	w = 0;
+	memcpy(&w, key, len);
+	h = (h ^ w) * 0xff51afd7ed558ccd;
+	return h ^ (h >> 29);
+}
+
+/*
+ * Like `lookup`, but through the cache.
+ */
+static struct ctnode *cache_find(struct ctrie *t, const char *key, size_t len)
+{
+	struct ctrie_cache *c = t->cache;
+	uint64_t h = cache_hash(key, len);
+	size_t si = h & c->mask;
+	struct cache_set *set = &c->sets[si];
+	struct cache_ent *ents = &c->ents[si * CACHE_WAYS];
+	size_t victim = (h >> 32) % CACHE_WAYS;
+	for (size_t i = 0; i < CACHE_WAYS; i++) {
+		if (set->gen[i] != t->gen) {
+			victim = i;
+			continue;
+		}
+		if (set->hash[i] == h && ents[i].len == len
+		    && !memcmp(ents[i].key, key, len)) {
+			c->hits++;
+			return ents[i].n;
+		}
+	}
+	c->misses++;
+	struct cache_ent *e = &ents[victim];
+	set->hash[victim] = h;
+	set->gen[victim] = t->gen;
+	e->n = lookup(t, key, len);
+	e->len = len;
+	memcpy(e->key, key, len);
+	return e->n;
+}
+
+void ctrie_cache_init(struct ctrie *t, size_t size)
+{
+	size_t nsets = 1;
+	ctrie_cache_free(t);
+	while (nsets * CACHE_WAYS < size)
+		nsets *= 2;
+	struct ctrie_cache *c = t->cache = xcalloc(1, sizeof(*c));
+	c->sets = aligned_alloc(CACHE_LINE, nsets * CACHE_LINE);
+	c->ents = aligned_alloc(CACHE_LINE, nsets * CACHE_WAYS * CACHE_LINE);
+	if (!c->sets || !c->ents) {
+		perror("aligned_alloc");
+		abort();
+	}
+	for (size_t i = 0; i < nsets; i++)
+		for (size_t j = 0; j < CACHE_WAYS; j++)
+			c->sets[i].gen[j] = t->gen - 1; /* invalid */
+	c->mask = nsets - 1;
+}
+
+void ctrie_cache_free(struct ctrie *t)
+{
+	if (!t->cache)
+		return;
+	free(t->cache->sets);
+	free(t->cache->ents);
+	free(t->cache);
+	t->cache = NULL;
+}
+
+void ctrie_cache_stats(struct ctrie *t, size_t *hits, size_t *misses)
+{
+	*hits = t->cache ? t->cache->hits : 0;
+	*misses = t->cache ? t->cache->misses : 0;
+}
+
+static struct ctnode *find(struct ctrie *t, const char *key, size_t len)
+{
+	if (t->cache && len <= CACHE_KEY_MAX)
+		return cache_find(t, key, len);
+	return lookup(t, key, len);
+}
+
+void *ctrie_find_n(struct ctrie *t, const char *key, size_t len)
+{
+	HIST_START();
+	struct ctnode *n = find(t, key, len);
+	HIST_END(CTRIE_OP_FIND);
+	return n ? data(t, n) : NULL;
+}
+
+void *ctrie_find(struct ctrie *t, const char *key)
+{
+	return ctrie_find_n(t, key, strlen(key));
+}
+
+bool ctrie_contains_n(struct ctrie *t, const char *key, size_t len)
+{
+	HIST_START();
+	struct ctnode *n = find(t, key, len);
+	HIST_END(CTRIE_OP_FIND);
+	return n != NULL;
+}
+
+bool ctrie_contains(struct ctrie *t, const char *key)
+{
+	return ctrie_contains_n(t, key, strlen(key));
+}
+
+bool ctrie_empty(struct ctrie *t)
+{
+	struct ctnode *r = root(t);
+	return !r->nchild && !(r->flags & F_WORD);
+}
+
+static void ctrie_print_node(struct ctrie *t, struct ctnode *n, size_t level)
+{
+	char *a = char_array(t, n);
+	for (size_t i = 0; i < n->nchild; i++) {
+		struct ctnode *c = get_child(t, n, i);
+		for (size_t j = 0; j < 4 * level; j++)
+			putchar(' ');
+		if (is_inline(c)) {
+			printf("[%c]->'%s' inline <", a[i], get_label(c));
+		} else {
+			printf("[%c]->'%s' size=%i alloc=%zuB <",
+				a[i],
+				get_label(c),
+				c->size,
+				alloc_size(t, c->size));
+		}
+		if (node_flags(c) & F_WORD)
 			putchar('W');
-		if (!(c->flags & F_SEPL))
+		if (!(node_flags(c) & F_SEPL))
 			putchar('E');
-		if (c->flags & F_WILD)
+		if (node_flags(c) & F_WILD)
 			putchar('*');
 		printf(">:\n");
-		ctrie_print_node(t, c, level + 1);
+		if (!is_inline(c))
+			ctrie_print_node(t, c, level + 1);
+	}
+}
+
+void ctrie_dump(struct ctrie *t)
+{
+	ctrie_print_node(t, root(t), 0);
+}
+
+/*
+ * May `t` be modified? Tries minimized by `ctrie_minimize` share their
+ * subtrees, so they may not; fail with `EPERM` then.
+ */
+static inline bool writable(struct ctrie *t)
+{
+	if (t->frozen) {
+		errno = EPERM;
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Insert the rest of a key, `key`, into `t` at position `l` in the label of
+ * node `n`, which is the `idx`-th child of `parent`. The part of the key
+ * which precedes `l` must already be present in the trie. Return the word
+ * node of the key and, if `inserted` is not `NULL`, set `*inserted` to
+ * whether the key is new. The data of a new key are zeroed. Return `NULL`
+ * if the key would have to be added to a frozen trie.
+ */
+static struct ctnode *insert_at(struct ctrie *t,
+                                struct ctnode *parent,
+                                size_t idx,
+                                struct ctnode *n,
+                                char *l,
+                                const char *key,
+                                const char *end,
+                                bool wildcard,
+                                bool *inserted)
+{
+	byte_t flags = F_WORD | (wildcard ? F_WILD : 0);
+	if (*l || key < end || (node_flags(n) & flags) != flags) {
+		if (!writable(t))
+			return NULL;
+		t->gen++;
+	}
+	if (wildcard && t->index)
+		t->index->wild = true;
+	if (is_inline(n) && (*l || key < end)) { /* `n` gets a child */
+		size_t off = l - get_label(n);
+		n = expand_inline(t, parent, idx);
+		l = get_label(n) + off;
+	}
+	if (*l) { /* create new node between `parent` and `n`, split label */
+		struct ctnode *s = new_node(t, 1);
+		s = insert_child(t, s, *l, n); /* won't trigger resize */
+		size_t off = l - get_label(n);
+		/*
+		 * The label of `n` is not truncated in place: in CTRIE_REF32
+		 * builds, `label_free` works out the size of a label from its
+		 * length.
+		 */
+		set_label_n(t, s, get_label(n), off);
+		set_child(t, parent, idx, s);
+		set_label(t, n, l + 1);
+		if (t->index) {
+			index_move(t->index, n, 0, s, 0);
+			index_move(t->index, s, off + 1, n, -(off + 1));
+		}
+		shrink_leaf(t, s, 0);
+		n = s;
+	}
+	if (key < end) { /* `n` is a prefix for `key`, prolong the path */
+		char k = *key++;
+		size_t len = end - key;
+		if (can_inline(t, len)) {
+			n = insert_ref(t, n, k, make_inline(key, len, 0));
+			set_child(t, parent, idx, n);
+			n = get_child(t, n, find_child_idx(t, n, k));
+		} else {
+			struct ctnode *new = new_node(t, 0);
+			n = insert_child(t, n, k, new);
+			set_label_n(t, new, key, len); /* without the first char */
+			set_child(t, parent, idx, n);
+			n = new;
+		}
+	}
+	bool new_word = !(node_flags(n) & F_WORD);
+	if (new_word) /* non-word nodes may hold data of a removed key */
+		memset(data(t, n), 0, t->data_size);
+	if (inserted)
+		*inserted = new_word;
+	if (is_inline(n))
+		*inline_tag(n) |= flags << 1;
+	else
+		n->flags |= flags;
+	return n;
+}
+
+static struct ctnode *insert(struct ctrie *t,
+                             const char *key,
+                             size_t len,
+                             bool wildcard,
+                             bool *inserted)
+{
+	/* TODO assert key not empty */
+	struct ctnode *n = root(t), *parent = t->fake_root;
+	size_t idx = 0, gen = t->gen;
+	const char *start = key, *end = key + len;
+	char *l;
+	while (1) { /* find longest prefix of key in the trie */
+		for (l = get_label(n); key < end && *l && *key == *l; l++, key++);
+		if (*l || key == end) /* false for root label and non-empty key */
+			break;
+		size_t next_idx = find_child_idx(t, n, *key);
+		if (next_idx >= node_nchild(n) || char_array(t, n)[next_idx] != *key)
+			break;
+		key++;
+		parent = n;
+		n = get_child(t, n, next_idx);
+		idx = next_idx;
+	}
+	n = insert_at(t, parent, idx, n, l, key, end, wildcard, inserted);
+	if (t->index && t->gen != gen)
+		index_key(t, start, len);
+	return n;
+}
+
+/*
+ * Can the `len` bytes at `key` be inserted? Lookups of keys holding NUL bytes
+ * simply fail, as no label does, but insertions must reject them.
+ */
+static inline bool valid_key(const char *key, size_t len)
+{
+	if (memchr(key, '\0', len)) {
+		errno = EINVAL;
+		return false;
+	}
+	return true;
+}
+
+void *ctrie_insert_n(struct ctrie *t,
+                     const char *key,
+                     size_t len,
+                     bool wildcard)
+{
+	if (!valid_key(key, len))
+		return NULL;
+	HIST_START();
+	struct ctnode *n = insert(t, key, len, wildcard, NULL);
+	HIST_END(CTRIE_OP_INSERT);
+	return n ? data(t, n) : NULL;
+}
+
+void *ctrie_insert(struct ctrie *t, const char *key, bool wildcard)
+{
+	return ctrie_insert_n(t, key, strlen(key), wildcard);
+}
+
+void *ctrie_upsert_n(struct ctrie *t,
+                     const char *key,
+                     size_t len,
+                     bool *inserted)
+{
+	if (!valid_key(key, len))
+		return NULL;
+	HIST_START();
+	struct ctnode *n = insert(t, key, len, false, inserted);
+	HIST_END(CTRIE_OP_INSERT);
+	return n ? data(t, n) : NULL;
+}
+
+void *ctrie_upsert(struct ctrie *t, const char *key, bool *inserted)
+{
+	return ctrie_upsert_n(t, key, strlen(key), inserted);
+}
+
+void *ctrie_emplace_n(struct ctrie *t,
+                      const char *key,
+                      size_t len,
+                      ctrie_init_cb_t *init,
+                      void *arg)
+{
+	bool inserted;
+	if (!valid_key(key, len))
+		return NULL;
+	HIST_START();
+	struct ctnode *n = insert(t, key, len, false, &inserted);
+	HIST_END(CTRIE_OP_INSERT); /* without `init` */
+	if (!n)
+		return NULL;
+	void *d = data(t, n);
+	if (inserted)
+		init(d, arg);
+	return d;
+}
+
+void *ctrie_emplace(struct ctrie *t,
+                    const char *key,
+                    ctrie_init_cb_t *init,
+                    void *arg)
+{
+	return ctrie_emplace_n(t, key, strlen(key), init, arg);
+}
+
+/*
+ * Cut `n` from `t`, where `p` is the parent of `n`. This assumes that `n` has
+ * only a single child and `n` is not a word node, i.e. it can be merged with
+ * its only child.
+ */
+static void cut(struct ctrie *t,
+                       struct ctnode *n,
+                       struct ctnode *p,
+                       size_t pi)
+{
+	assert(p->nchild >= 1);
+	assert(get_child(t, p, pi) == n);
+	assert(n->nchild == 1);
+	assert(!(n->flags & F_WORD));
+
+	char label_buf[LABEL_BUF_SIZE];
+
+	struct ctnode *c = get_child(t, n, 0);
+	char *label_n = get_label(n);
+	char *label_c = get_label(c);
+	size_t label_n_len = strlen(label_n);
+	size_t label_c_len = strlen(label_c);
+	size_t label_len = label_n_len + 1 + label_c_len;
+	STAT(t, cuts, 1);
+	EVENT(t, CTRIE_EVENT_CUT, label_len);
+
+	char *label;
+	if (label_len < sizeof(label_buf))
+		label = label_buf;
+	else
+		label = xmalloc(label_len + 1);
+
+	memcpy(label, label_n, label_n_len);
+	label[label_n_len] = char_array(t, n)[0];
+	memcpy(label + label_n_len + 1, label_c, label_c_len);
+	label[label_len] = '\0';
+
+	if (is_inline(c) && can_inline(t, label_len)) {
+		children(p)[pi] = make_inline(label, label_len, node_flags(c));
+	} else {
+		if (is_inline(c))
+			c = expand_inline(t, n, 0);
+		/* TODO we're basically double-copying the label - avoid that */
+		set_label_n(t, c, label, label_len);
+		set_child(t, p, pi, c);
+		if (t->index) {
+			index_move(t->index, c, 0, c, label_n_len + 1);
+			index_move(t->index, n, 0, c, 0);
+		}
+	}
+
+	if (label != label_buf)
+		free(label);
+	free_node(t, n);
+}
+
+/*
+ * Remove the word node `n` found by `find3` along with its predecessors.
+ */
+static void remove_node(struct ctrie *t,
+                        struct ctnode *n,
+                        struct ctnode *p,
+                        size_t pi,
+                        struct ctnode *pp,
+                        size_t ppi)
+{
+	assert(!t->frozen);
+	t->gen++;
+	assert(node_flags(n) & F_WORD);
+
+	if (!is_inline(n)) {
+		n->flags &= ~(F_WORD | F_WILD);
+
+		// The node is internal branching node or the root. Clearing
+		// F_WORD is enough, the node must be kept.
+		if (n->nchild > 1 || p == t->fake_root)
+			return;
+
+		// The node has a single child. We will cut the node and it's
+		// sole child will become a child of the parent.
+		if (n->nchild) {
+			cut(t, n, p, pi);
+			return;
+		}
+	}
+
+	assert(p->nchild > 1 || p->flags & F_WORD || pp == t->fake_root);
+	assert(get_child(t, p, pi) == n);
+
+	// Otherwise, the node is a leaf. Inline leaves live in the child
+	// array of `p`, so there's nothing to free.
+	if (!is_inline(n))
+		free_node(t, n);
+	ARRAY_SHIFT(children(p), pi, pi + 1, p->nchild);
+	ARRAY_SHIFT(char_array(t, p), pi, pi + 1, p->nchild);
+	p->nchild--;
+	if (p->nchild == 1 && !(p->flags & F_WORD) && pp != t->fake_root)
+		cut(t, p, pp, ppi);
+}
+
+bool ctrie_remove_if_n(struct ctrie *t,
+                       const char *key,
+                       size_t len,
+                       ctrie_pred_t *pred,
+                       void *arg)
+{
+	struct ctnode *pp, *p;
+	size_t ppi, pi;
+	HIST_START();
+	struct ctnode *n = find3(t, key, key + len, &pp, &ppi, &p, &pi);
+	bool removed = n && writable(t) && (!pred || pred(data(t, n), arg));
+	if (removed)
+		remove_node(t, n, p, pi, pp, ppi);
+	HIST_END(CTRIE_OP_REMOVE);
+	return removed;
+}
+
+bool ctrie_remove_if(struct ctrie *t,
+                     const char *key,
+                     ctrie_pred_t *pred,
+                     void *arg)
+{
+	return ctrie_remove_if_n(t, key, strlen(key), pred, arg);
+}
+
+void ctrie_remove_n(struct ctrie *t, const char *key, size_t len)
+{
+	ctrie_remove_if_n(t, key, len, NULL, NULL);
+}
+
+void ctrie_remove(struct ctrie *t, const char *key)
+{
+	ctrie_remove_n(t, key, strlen(key));
+}
+
+static size_t remove_prefix(struct ctrie *t, const char *prefix, size_t len)
+{
+	const char *end = prefix + len;
+	struct ctnode *pp = NULL, *p = t->fake_root, *n = root(t);
+	size_t ppi = 0, pi = 0, count;
+	while (1) {
+		char *l;
+		l = get_label(n);
+		for (; prefix < end && *l && *prefix == *l; l++, prefix++);
+		if (prefix == end) /* all keys in the subtree of `n` match */
+			break;
+		if (*l)
+			return 0;
+		size_t idx = find_child_idx(t, n, *prefix);
+		if (idx >= node_nchild(n) || char_array(t, n)[idx] != *prefix)
+			return 0;
+		prefix++;
+		pp = p;
+		ppi = pi;
+		p = n;
+		pi = idx;
+		n = get_child(t, n, idx);
+	}
+
+	if (!writable(t))
+		return 0;
+	if (p == t->fake_root) { /* keep the root, drop its children */
+		count = !!(n->flags & F_WORD);
+		for (size_t i = 0; i < n->nchild; i++)
+			count += delete_node(t, get_child(t, n, i));
+		n->nchild = 0;
+		n->flags &= ~(F_WORD | F_WILD);
+		t->gen += !!count;
+		return count;
+	}
+
+	/* detach the subtree and restore path compression at `p` */
+	t->gen++;
+	count = delete_node(t, n);
+	ARRAY_SHIFT(children(p), pi, pi + 1, p->nchild);
+	ARRAY_SHIFT(char_array(t, p), pi, pi + 1, p->nchild);
+	p->nchild--;
+	if (p->nchild == 1 && !(p->flags & F_WORD) && pp != t->fake_root)
+		cut(t, p, pp, ppi);
+	return count;
+}
+
+size_t ctrie_remove_prefix_n(struct ctrie *t, const char *prefix, size_t len)
+{
+	HIST_START();
+	size_t count = remove_prefix(t, prefix, len);
+	HIST_END(CTRIE_OP_REMOVE);
+	return count;
+}
+
+size_t ctrie_remove_prefix(struct ctrie *t, const char *prefix)
+{
+	return ctrie_remove_prefix_n(t, prefix, strlen(prefix));
+}
+
+bool ctrie_take_n(struct ctrie *t, const char *key, size_t len, void *out)
+{
+	struct ctnode *pp, *p;
+	size_t ppi, pi;
+	HIST_START();
+	struct ctnode *n = find3(t, key, key + len, &pp, &ppi, &p, &pi);
+	bool taken = n && writable(t);
+	if (taken) {
+		if (out)
+			memcpy(out, data(t, n), t->data_size);
+		remove_node(t, n, p, pi, pp, ppi);
+	}
+	HIST_END(CTRIE_OP_REMOVE);
+	return taken;
+}
+
+bool ctrie_take(struct ctrie *t, const char *key, void *out)
+{
+	return ctrie_take_n(t, key, strlen(key), out);
+}
+
+/*
+ * Iterator stack entry. Together, these objects hold the entire iteration state
+ * of the associated iterator.
+ */
+struct ctrie_iter_stkent
+{
+	struct ctnode *n; /* node that this entry describes */
+	size_t idx;       /* current child index in `n` */
+	size_t key_len;   /* length of `n`'s key */
+};
+
+/*
+ * Push and return new stack entry for node `n` onto the stack of iterator `it`.
+ */
+static struct ctrie_iter_stkent *push(struct ctrie_iter *it, struct ctnode *n)
+{
+	AGROW(it->stack, it->nstack, it->stack_size);
+	struct ctrie_iter_stkent *c = &it->stack[it->nstack++];
+	c->n = n;
+	c->idx = SIZE_MAX;
+	return c;
+}
+
+void ctrie_iter_init(struct ctrie *t, struct ctrie_iter *it)
+{
+	it->t = t;
+	it->stack = NULL;
+	it->stack_size = it->nstack = 0;
+	push(it, root(t))->key_len = 0;
+}
+
+static struct ctnode *iter_next(struct ctrie_iter *it,
+                                char **key,
+                                size_t *key_size)
+{
+	struct ctrie_iter_stkent *se;
+	struct ctnode *n;
+	size_t key_len;
+	size_t label_len;
+	while (it->nstack) {
+		se = &it->stack[it->nstack - 1];
+		se->idx++; /* deliberate overflow */
+		if (se->idx >= node_nchild(se->n)) {
+			it->nstack--;
+			continue;
+		}
+		char c = char_array(it->t, se->n)[se->idx];
+		n = get_child(it->t, se->n, se->idx);
+		char *label = get_label(n);
+		label_len = strlen(label);
+		key_len = se->key_len + 1 + label_len;
+		AGROW(*key, key_len + 1, *key_size);
+		(*key)[se->key_len] = c;
+		memcpy(*key + se->key_len + 1, label, label_len);
+		(*key)[key_len] = '\0';
+		if (node_nchild(n))
+			push(it, n)->key_len = key_len;
+		if (node_flags(n) & F_WORD)
+			return n;
+	}
+	return NULL;
+}
+
+struct ctnode *ctrie_iter_next(struct ctrie_iter *it,
+                               char **key,
+                               size_t *key_size)
+{
+	HIST_START();
+	struct ctnode *n = iter_next(it, key, key_size);
+	HIST_END(CTRIE_OP_ITER_NEXT);
+	return n;
+}
+
+void ctrie_iter_free(struct ctrie_iter *it)
+{
+	free(it->stack);
+}
+
+void *ctrie_node_data(struct ctrie *t, struct ctnode *n)
+{
+	return data(t, n);
+}
+
+/*
+ * State of a fuzzy search. The DP matrix is stored row by row in `rows`, one
+ * row of `qlen + 1` entries per character of the key currently being built
+ * in `key`, so that backtracking is free.
+ */
+struct fuzzy
+{
+	struct ctrie *t;      /* the trie being searched */
+	const char *q;        /* the query */
+	size_t qlen;          /* length of the query */
+	size_t max_dist;      /* maximum edit distance */
+	size_t *rows;         /* DP rows */
+	size_t rows_size;     /* capacity of `rows` */
+	char *key;            /* key of the current node */
+	size_t key_size;      /* size of `key` */
+	ctrie_fuzzy_cb_t *cb; /* user callback */
+	void *arg;            /* user callback argument */
+};
+
+/*
+ * Compute DP row `d + 1` from row `d` for key character `c`, store `c` as the
+ * `d`-th character of the key and return the minimum of the new row.
+ */
+static size_t fuzzy_step(struct fuzzy *f, size_t d, char c)
+{
+	size_t w = f->qlen + 1;
+	AGROW(f->rows, (d + 2) * w, f->rows_size);
+	AGROW(f->key, d + 1, f->key_size);
+	f->key[d] = c;
+
+	size_t *prev = f->rows + d * w;
+	size_t *row = prev + w;
+	size_t min = row[0] = prev[0] + 1;
+	for (size_t j = 1; j < w; j++) {
+		size_t sub = prev[j - 1] + (f->q[j - 1] != c);
+		row[j] = MIN(sub, MIN(prev[j], row[j - 1]) + 1);
+		min = MIN(min, row[j]);
+	}
+	return min;
+}
+
+/*
+ * Search the subtree of `n`, assuming that row `d` is computed for the key
+ * leading to `n` (without `n`'s label).
+ */
+static void fuzzy_node(struct fuzzy *f, struct ctnode *n, size_t d)
+{
+	for (char *l = get_label(n); *l; l++, d++)
+		if (fuzzy_step(f, d, *l) > f->max_dist)
+			return;
+
+	size_t dist = f->rows[d * (f->qlen + 1) + f->qlen];
+	if ((node_flags(n) & F_WORD) && dist <= f->max_dist) {
+		AGROW(f->key, d + 1, f->key_size);
+		f->key[d] = '\0';
+		f->cb(f->key, data(f->t, n), dist, f->arg);
+	}
+
+	for (size_t i = 0; i < node_nchild(n); i++)
+		if (fuzzy_step(f, d, char_array(f->t, n)[i]) <= f->max_dist)
+			fuzzy_node(f, get_child(f->t, n, i), d + 1);
+}
+
+void ctrie_fuzzy(struct ctrie *t,
+                 const char *key,
+                 size_t max_dist,
+                 ctrie_fuzzy_cb_t *cb,
+                 void *arg)
+{
+	struct fuzzy f = {
+		.t = t,
+		.q = key,
+		.qlen = strlen(key),
+		.max_dist = max_dist,
+		.cb = cb,
+		.arg = arg,
+	};
+	AGROW(f.rows, f.qlen + 1, f.rows_size);
+	for (size_t j = 0; j <= f.qlen; j++)
+		f.rows[j] = j;
+	fuzzy_node(&f, root(t), 0);
+	free(f.rows);
+	free(f.key);
+}
+
+/*
+ * A token of a compiled glob pattern. Every token except the star matches
+ * exactly one input character from `set`.
+ */
+struct glob_tok
+{
+	bool star;       /* is this a `*`? */
+	bool literal;    /* does `set` contain just `c`? */
+	char c;          /* the character matched by a literal token */
+	uint64_t set[4]; /* bitmap of the characters matched by the token */
+};
+
+static void glob_set(struct glob_tok *tok, byte_t c)
+{
+	tok->set[c >> 6] |= (uint64_t)1 << (c & 63);
+}
+
+static bool glob_has(struct glob_tok *tok, byte_t c)
+{
+	return tok->set[c >> 6] & ((uint64_t)1 << (c & 63));
+}
+
+/*
+ * Parse a character class starting just after the opening `[` at `p` into
+ * `tok`. Return pointer just past the closing `]`, or `NULL` if the class is
+ * not terminated.
+ */
+static const char *glob_class(const char *p, struct glob_tok *tok)
+{
+	bool neg = (*p == '!' || *p == '^');
+	if (neg)
+		p++;
+	const char *first = p;
+	for (; *p && (*p != ']' || p == first); p++) {
+		byte_t lo = *p, hi = *p;
+		if (p[1] == '-' && p[2] && p[2] != ']') {
+			hi = p[2];
+			p += 2;
+		}
+		for (size_t c = lo; c <= hi; c++)
+			glob_set(tok, c);
+	}
+	if (!*p)
+		return NULL;
+	if (neg)
+		for (size_t i = 0; i < 4; i++)
+			tok->set[i] = ~tok->set[i];
+	tok->set[0] &= ~(uint64_t)1; /* never match the NUL byte */
+	return p + 1;
+}
+
+/*
+ * Parse the glob pattern `p` into a newly allocated array of tokens `*toks`.
+ * Return the number of tokens.
+ */
+static size_t glob_parse(const char *p, struct glob_tok **toks)
+{
+	size_t ntok = 0, size = 0;
+	*toks = NULL;
+	while (*p) {
+		AGROW(*toks, ntok + 1, size);
+		struct glob_tok *tok = &(*toks)[ntok++];
+		memset(tok, 0, sizeof(*tok));
+		const char *end;
+		if (*p == '*') {
+			tok->star = true;
+			p++;
+		} else if (*p == '?') {
+			memset(tok->set, 0xff, sizeof(tok->set));
+			tok->set[0] &= ~(uint64_t)1;
+			p++;
+		} else if (*p == '[' && (end = glob_class(p + 1, tok))) {
+			p = end;
+		} else {
+			memset(tok->set, 0, sizeof(tok->set));
+			if (*p == '\\' && p[1])
+				p++;
+			tok->literal = true;
+			tok->c = *p++;
+			glob_set(tok, tok->c);
+		}
+	}
+	return ntok;
+}
+
+/*
+ * A lazily constructed DFA for a glob pattern. The states of the equivalent
+ * NFA are the positions in the token array, a DFA state is a set of NFA
+ * states. Transitions are only computed when they are first needed. State 0
+ * is the dead state.
+ */
+struct dfa
+{
+	struct glob_tok *toks; /* pattern tokens */
+	size_t ntok;           /* number of tokens */
+	size_t nwords;         /* number of words in an NFA state set */
+	uint64_t *sets;        /* NFA state sets, `nwords` per DFA state */
+	size_t sets_size;      /* capacity of `sets` */
+	int32_t *trans;        /* transitions, 256 per state, -1 if unknown */
+	size_t trans_size;     /* capacity of `trans` */
+	size_t nstates;        /* number of DFA states */
+	uint64_t *tmp;         /* scratch NFA state set */
+};
+
+#define BIT_GET(s, i) ((s)[(i) >> 6] & ((uint64_t)1 << ((i) & 63)))
+#define BIT_SET(s, i) ((s)[(i) >> 6] |= ((uint64_t)1 << ((i) & 63)))
+
+/*
+ * Return the DFA state with NFA state set `set`, creating it if necessary.
+ * The star tokens are followed (they match the empty string) before lookup.
+ */
+static size_t dfa_state(struct dfa *d, uint64_t *set)
+{
+	for (size_t i = 0; i < d->ntok; i++)
+		if (d->toks[i].star && BIT_GET(set, i))
+			BIT_SET(set, i + 1);
+
+	size_t bytes = d->nwords * sizeof(*set);
+	for (size_t s = 0; s < d->nstates; s++)
+		if (!memcmp(d->sets + s * d->nwords, set, bytes))
+			return s;
+
+	AGROW(d->sets, (d->nstates + 1) * d->nwords, d->sets_size);
+	AGROW(d->trans, (d->nstates + 1) * 256, d->trans_size);
+	memcpy(d->sets + d->nstates * d->nwords, set, bytes);
+	for (size_t c = 0; c < 256; c++)
+		d->trans[d->nstates * 256 + c] = -1;
+	return d->nstates++;
+}
+
+/*
+ * Initialize `d` for the glob `pattern` and return the initial state.
+ */
+static size_t dfa_init(struct dfa *d, const char *pattern)
+{
+	memset(d, 0, sizeof(*d));
+	d->ntok = glob_parse(pattern, &d->toks);
+	d->nwords = (d->ntok + 1 + 63) / 64;
+	d->tmp = xcalloc(d->nwords, sizeof(*d->tmp));
+	dfa_state(d, d->tmp); /* the dead state */
+	BIT_SET(d->tmp, 0);
+	return dfa_state(d, d->tmp);
+}
+
+static void dfa_free(struct dfa *d)
+{
+	free(d->toks);
+	free(d->sets);
+	free(d->trans);
+	free(d->tmp);
+}
+
+/*
+ * Return the state reached from state `s` on input character `c`.
+ */
+static size_t dfa_next(struct dfa *d, size_t s, char c)
+{
+	int32_t next = d->trans[s * 256 + (byte_t)c];
+	if (next >= 0)
+		return next;
+
+	uint64_t *set = d->sets + s * d->nwords;
+	memset(d->tmp, 0, d->nwords * sizeof(*d->tmp));
+	for (size_t i = 0; i < d->ntok; i++) {
+		if (!BIT_GET(set, i))
+			continue;
+		if (d->toks[i].star)
+			BIT_SET(d->tmp, i);
+		else if (glob_has(&d->toks[i], c))
+			BIT_SET(d->tmp, i + 1);
+	}
+	next = dfa_state(d, d->tmp);
+	d->trans[s * 256 + (byte_t)c] = next;
+	return next;
+}
+
+static bool dfa_accepts(struct dfa *d, size_t s)
+{
+	return BIT_GET(d->sets + s * d->nwords, d->ntok);
+}
+
+/*
+ * State of a pattern search.
+ */
+struct match
+{
+	struct ctrie *t; /* the trie being searched */
+	struct dfa dfa;  /* the pattern automaton */
+	char *key;       /* key of the current node */
+	size_t key_size; /* size of `key` */
+	ctrie_cb_t *cb;  /* user callback */
+	void *arg;       /* user callback argument */
+};
+
+/*
+ * Search the subtree of `n`, assuming that the DFA is in state `s` after
+ * reading the first `d` bytes of the key, which ends at label position `l`
+ * of `n`.
+ */
+static void match_node(struct match *m,
+                       struct ctnode *n,
+                       const char *l,
+                       size_t s,
+                       size_t d)
+{
+	for (; *l; l++) {
+		if (!(s = dfa_next(&m->dfa, s, *l)))
+			return;
+		AGROW(m->key, d + 1, m->key_size);
+		m->key[d++] = *l;
+	}
+
+	AGROW(m->key, d + 1, m->key_size);
+	if ((node_flags(n) & F_WORD) && dfa_accepts(&m->dfa, s)) {
+		m->key[d] = '\0';
+		m->cb(m->key, data(m->t, n), m->arg);
+	}
+
+	char *a = char_array(m->t, n);
+	for (size_t i = 0; i < node_nchild(n); i++) {
+		size_t next = dfa_next(&m->dfa, s, a[i]);
+		if (next) {
+			m->key[d] = a[i];
+			struct ctnode *c = get_child(m->t, n, i);
+			match_node(m, c, get_label(c), next, d + 1);
+		}
+	}
+}
+
+void ctrie_match(struct ctrie *t, const char *pattern, ctrie_cb_t *cb, void *arg)
+{
+	struct match m = {
+		.t = t,
+		.cb = cb,
+		.arg = arg,
+	};
+	size_t s = dfa_init(&m.dfa, pattern);
+
+	/* descend directly along the literal prefix of the pattern */
+	struct ctnode *n = root(t);
+	const char *l = get_label(n);
+	size_t d;
+	for (d = 0; d < m.dfa.ntok && m.dfa.toks[d].literal; d++) {
+		char c = m.dfa.toks[d].c;
+		if (*l) {
+			if (*l++ != c)
+				goto out;
+		} else {
+			size_t idx = find_child_idx(t, n, c);
+			if (idx >= node_nchild(n) || char_array(t, n)[idx] != c)
+				goto out;
+			n = get_child(t, n, idx);
+			l = get_label(n);
+		}
+		s = dfa_next(&m.dfa, s, c);
+		AGROW(m.key, d + 1, m.key_size);
+		m.key[d] = c;
+	}
+	match_node(&m, n, l, s, d);
+out:
+	dfa_free(&m.dfa);
+	free(m.key);
+}
+
+#define AC_NONE UINT32_MAX
+
+/*
+ * States shallower than `AC_DENSE_DEPTH` get a row of `ac->dense` holding
+ * their transitions on every input byte, failure links included, so that no
+ * failure chain is longer than the depth of the state it starts in.
+ */
+#define AC_DENSE_DEPTH 2
+#define AC_DENSE_ROW   256
+
+/*
+ * A state of the Aho-Corasick automaton. There is one state for every
+ * position within the labels of the trie: a state corresponds to the key
+ * prefix ending just before label character `c` of node `n`, or to the key
+ * of `n` itself if `c` is the NUL byte.
+ *
+ * The transitions are kept in the states, so that the scan only touches the
+ * trie to report a match. The first states of the children of a node are
+ * numbered consecutively in the order of their characters, each followed by
+ * the rest of its label and its subtree, so that a transition on a node finds
+ * the target among its siblings in a cache line or two, and walking a label
+ * reads the states in order.
+ */
+struct ctrie_ac_state
+{
+	struct ctnode *n; /* the node */
+	uint32_t fail;    /* failure link */
+	uint32_t out;     /* nearest word state reachable by failure links */
+	uint32_t depth;   /* length of the key prefix */
+	uint32_t next;    /* next state on `c`, or the first child of `n` */
+	uint32_t dense;   /* row of `ac->dense`, or `AC_NONE` */
+	byte_t nkids;     /* number of children of `n` if `c` is NUL */
+	char c;           /* next label character */
+	char in;          /* character leading to the state from its parent */
+	bool word;        /* is the state at the end of a (non-empty) word? */
+};
+
+/*
+ * Return the state which follows `s` on input character `c` in the trie,
+ * or `AC_NONE` if there is none.
+ */
+static inline uint32_t ac_goto(struct ctrie_ac *ac, uint32_t s, char c)
+{
+	struct ctrie_ac_state *st = &ac->states[s];
+	if (st->c)
+		return st->c == c ? st->next : AC_NONE;
+	struct ctrie_ac_state *kids = &ac->states[st->next];
+	size_t l = 0, r = st->nkids;
+	while (l < r) {
+		size_t m = (l + r) / 2;
+		if (kids[m].in == c)
+			return st->next + m;
+		if (kids[m].in < c)
+			l = m + 1;
+		else
+			r = m;
+	}
+	return AC_NONE;
+}
+
+/*
+ * Return the state which follows `s` on input character `c` in the automaton,
+ * following failure links until a state with a transition on `c` or a dense
+ * row is found.
+ */
+static inline uint32_t ac_next(struct ctrie_ac *ac, uint32_t s, char c)
+{
+	uint32_t next;
+	struct ctrie_ac_state *st = &ac->states[s];
+	while (st->dense == AC_NONE) {
+		if ((next = ac_goto(ac, s, c)) != AC_NONE)
+			return next;
+		s = st->fail;
+		st = &ac->states[s];
+	}
+	return ac->dense[(size_t)st->dense * AC_DENSE_ROW + (byte_t)c];
+}
+
+/*
+ * Reserve `count` states, or return false if there would be too many states
+ * to number.
+ */
+static bool ac_reserve(struct ctrie_ac *ac, size_t *states_size, size_t count)
+{
+	if (count >= AC_NONE - ac->nstates)
+		return false;
+	if (ac->nstates + count > *states_size) {
+		*states_size = MAX(ac->nstates + count, 2 * *states_size);
+		ac->states = xrealloc(ac->states,
+			*states_size * sizeof(*ac->states));
+	}
+	return true;
+}
+
+/*
+ * Set state `s` to the position `i` in the label of node `n`, whose label
+ * starts at depth `depth`.
+ */
+static void ac_set_state(struct ctrie_ac *ac,
+                         uint32_t s,
+                         struct ctnode *n,
+                         size_t i,
+                         size_t depth)
+{
+	const char *l = get_label(n);
+	ac->states[s] = (struct ctrie_ac_state) {
+		.n = n,
+		.fail = 0,
+		.out = 0,
+		.depth = depth + i,
+		.next = AC_NONE,
+		.dense = AC_NONE,
+		.nkids = 0,
+		.c = l[i],
+		.in = i ? l[i - 1] : 0,
+		.word = !l[i] && (node_flags(n) & F_WORD) && depth + i,
+	};
+}
+
+int ctrie_ac_init(struct ctrie *t, struct ctrie_ac *ac)
+{
+	size_t states_size = 0;
+	uint32_t *stack = NULL;
+	size_t nstack = 0, stack_size = 0;
+	ac->t = t;
+	ac->states = NULL;
+	ac->dense = NULL;
+	ac->nstates = ac->ndense = 0;
+
+	/*
+	 * Number the states depth first. The stack holds the first states of
+	 * the nodes whose labels and subtrees are yet to be numbered; the first
+	 * states themselves have been numbered with their siblings.
+	 */
+	ac_reserve(ac, &states_size, 1);
+	ac_set_state(ac, ac->nstates++, root(t), 0, 0);
+	AGROW(stack, nstack, stack_size);
+	stack[nstack++] = 0;
+	while (nstack) {
+		uint32_t s = stack[--nstack];
+		struct ctnode *n = ac->states[s].n;
+		size_t depth = ac->states[s].depth;
+		size_t len = strlen(get_label(n)), nchild = node_nchild(n);
+		if (!ac_reserve(ac, &states_size, len + nchild)) {
+			free(stack);
+			ctrie_ac_free(ac);
+			errno = EOVERFLOW;
+			return -1;
+		}
+		for (size_t i = 1; i <= len; i++) {
+			ac->states[s].next = ac->nstates;
+			s = ac->nstates++;
+			ac_set_state(ac, s, n, i, depth);
+		}
+		if (!nchild)
+			continue;
+		ac->states[s].next = ac->nstates;
+		ac->states[s].nkids = nchild;
+		for (size_t i = 0; i < nchild; i++) {
+			uint32_t k = ac->nstates++;
+			ac_set_state(ac, k, get_child(t, n, i), 0, depth + len + 1);
+			ac->states[k].in = char_array(t, n)[i];
+		}
+		for (size_t i = nchild; i-- > 0;) {
+			AGROW(stack, nstack, stack_size);
+			stack[nstack++] = ac->states[s].next + i;
+		}
+	}
+	free(stack);
+
+	/*
+	 * Compute failure links in BFS order of the states. The failure link of
+	 * a state is shallower than the state, so it has been dequeued, and its
+	 * dense row, if any, filled before the state is.
+	 */
+	uint32_t *queue = xmalloc(ac->nstates * sizeof(*queue));
+	size_t head = 0, tail = 0;
+	queue[tail++] = 0;
+	while (head < tail) {
+		uint32_t s = queue[head++];
+		struct ctrie_ac_state *st = &ac->states[s];
+		if (st->depth < AC_DENSE_DEPTH) {
+			ac->dense = xrealloc(ac->dense,
+				(ac->ndense + AC_DENSE_ROW) * sizeof(*ac->dense));
+			st->dense = ac->ndense / AC_DENSE_ROW;
+			uint32_t *row = ac->dense + ac->ndense;
+			for (size_t c = 0; c < AC_DENSE_ROW; c++) {
+				uint32_t v = ac_goto(ac, s, c);
+				if (v == AC_NONE)
+					v = s ? ac_next(ac, st->fail, c) : 0;
+				row[c] = v;
+			}
+			ac->ndense += AC_DENSE_ROW;
+		}
+		size_t nsucc = st->c ? 1 : st->nkids;
+		for (size_t i = 0; i < nsucc; i++) {
+			uint32_t u = st->next + i;
+			char c = st->c ? st->c : ac->states[u].in;
+			uint32_t f = 0;
+			if (s != 0) {
+				uint32_t v;
+				for (f = st->fail; (v = ac_goto(ac, f, c)) == AC_NONE && f; )
+					f = ac->states[f].fail;
+				f = (v == AC_NONE) ? 0 : v;
+			}
+			ac->states[u].fail = f;
+			ac->states[u].out = ac->states[f].word ? f : ac->states[f].out;
+			queue[tail++] = u;
+		}
+	}
+	free(queue);
+	ctrie_ac_reset(ac);
+	return 0;
+}
+
+void ctrie_scan(struct ctrie_ac *ac,
+                const char *text,
+                size_t len,
+                ctrie_scan_cb_t *cb,
+                void *arg)
+{
+	uint32_t s = ac->state;
+	for (size_t i = 0; i < len; i++) {
+		s = ac_next(ac, s, text[i]);
+		struct ctrie_ac_state *st = &ac->states[s];
+		for (uint32_t o = st->word ? s : st->out; o; o = ac->states[o].out)
+			cb(ac->pos + i + 1,
+			   ac->states[o].depth,
+			   data(ac->t, ac->states[o].n),
+			   arg);
+	}
+	ac->state = s;
+	ac->pos += len;
+}
+
+void ctrie_ac_reset(struct ctrie_ac *ac)
+{
+	ac->state = 0;
+	ac->pos = 0;
+}
+
+void ctrie_ac_free(struct ctrie_ac *ac)
+{
+	free(ac->states);
+	free(ac->dense);
+}
+
+/*
+ * Which keys a set operation reports: keys in the first trie only, in the
+ * second trie only, or in both tries.
+ */
+enum
+{
+	M_A  = 1 << 0,
+	M_B  = 1 << 1,
+	M_AB = 1 << 2,
+};
+
+/*
+ * State of a set operation.
+ */
+struct merge
+{
+	struct ctrie *t[2];    /* the tries */
+	int ops;               /* which keys to report (`M_*` flags) */
+	char *key;             /* key of the current position */
+	size_t key_size;       /* size of `key` */
+	ctrie_merge_cb_t *cb;  /* user callback */
+	void *arg;             /* user callback argument */
+};
+
+/*
+ * Report key `key[0..d)` if requested. Word nodes `na` and `nb` are the nodes
+ * of the key in the first and second trie, respectively, `NULL` if the key is
+ * not present in that trie.
+ */
+static void merge_report(struct merge *m,
+                         size_t d,
+                         struct ctnode *na,
+                         struct ctnode *nb)
+{
+	int op = (na && nb) ? M_AB : (na ? M_A : M_B);
+	if (!(m->ops & op))
+		return;
+	AGROW(m->key, d + 1, m->key_size);
+	m->key[d] = '\0';
+	m->cb(m->key,
+	      na ? data(m->t[0], na) : NULL,
+	      nb ? data(m->t[1], nb) : NULL,
+	      m->arg);
+}
+
+/*
+ * Report all keys below label position `l` of node `n` of trie `i` (0 for the
+ * first trie, 1 for the second trie), assuming that these keys are not
+ * present in the other trie.
+ */
+static void merge_one(struct merge *m,
+                      int i,
+                      struct ctnode *n,
+                      const char *l,
+                      size_t d)
+{
+	if (!(m->ops & (i ? M_B : M_A)))
+		return;
+	for (; *l; l++) {
+		AGROW(m->key, d + 1, m->key_size);
+		m->key[d++] = *l;
+	}
+	if (node_flags(n) & F_WORD)
+		merge_report(m, d, i ? NULL : n, i ? n : NULL);
+	AGROW(m->key, d + 1, m->key_size);
+	for (size_t j = 0; j < node_nchild(n); j++) {
+		m->key[d] = char_array(m->t[i], n)[j];
+		struct ctnode *c = get_child(m->t[i], n, j);
+		merge_one(m, i, c, get_label(c), d + 1);
+	}
+}
+
+/*
+ * Merge the subtrees below label position `la` of node `na` of the first
+ * trie and label position `lb` of node `nb` of the second trie, assuming that
+ * both positions correspond to the key prefix `key[0..d)`.
+ */
+static void merge_node(struct merge *m,
+                       struct ctnode *na,
+                       const char *la,
+                       struct ctnode *nb,
+                       const char *lb,
+                       size_t d)
+{
+	for (; *la && *la == *lb; la++, lb++) {
+		AGROW(m->key, d + 1, m->key_size);
+		m->key[d++] = *la;
+	}
+
+	if (*la && *lb) { /* the paths diverge */
+		if (*la < *lb) {
+			merge_one(m, 0, na, la, d);
+			merge_one(m, 1, nb, lb, d);
+		} else {
+			merge_one(m, 1, nb, lb, d);
+			merge_one(m, 0, na, la, d);
+		}
+		return;
+	}
+
+	if (!*la && (node_flags(na) & F_WORD))
+		merge_report(m, d, na, (!*lb && (node_flags(nb) & F_WORD)) ? nb : NULL);
+	else if (!*lb && (node_flags(nb) & F_WORD))
+		merge_report(m, d, NULL, nb);
+
+	AGROW(m->key, d + 1, m->key_size);
+	char *a = char_array(m->t[0], na);
+	char *b = char_array(m->t[1], nb);
+	size_t i = 0, j = 0;
+	bool done = false; /* has the continuing label been merged already? */
+	if (*la) { /* `nb` ends here, `na` continues with `*la` */
+		for (; j < node_nchild(nb); j++) {
+			struct ctnode *c = get_child(m->t[1], nb, j);
+			if (!done && *la < b[j]) {
+				merge_one(m, 0, na, la, d);
+				done = true;
+			}
+			m->key[d] = b[j];
+			if (b[j] == *la) {
+				merge_node(m, na, la + 1, c, get_label(c), d + 1);
+				done = true;
+			} else {
+				merge_one(m, 1, c, get_label(c), d + 1);
+			}
+		}
+		if (!done)
+			merge_one(m, 0, na, la, d);
+	} else if (*lb) { /* `na` ends here, `nb` continues with `*lb` */
+		for (; i < node_nchild(na); i++) {
+			struct ctnode *c = get_child(m->t[0], na, i);
+			if (!done && *lb < a[i]) {
+				merge_one(m, 1, nb, lb, d);
+				done = true;
+			}
+			m->key[d] = a[i];
+			if (a[i] == *lb) {
+				merge_node(m, c, get_label(c), nb, lb + 1, d + 1);
+				done = true;
+			} else {
+				merge_one(m, 0, c, get_label(c), d + 1);
+			}
+		}
+		if (!done)
+			merge_one(m, 1, nb, lb, d);
+	} else { /* both end here, merge the child arrays */
+		while (i < node_nchild(na) || j < node_nchild(nb)) {
+			struct ctnode *ca = i < node_nchild(na) ? get_child(m->t[0], na, i) : NULL;
+			struct ctnode *cb = j < node_nchild(nb) ? get_child(m->t[1], nb, j) : NULL;
+			if (ca && cb && a[i] == b[j]) {
+				m->key[d] = a[i++];
+				j++;
+				merge_node(m, ca, get_label(ca), cb, get_label(cb), d + 1);
+			} else if (ca && (!cb || a[i] < b[j])) {
+				m->key[d] = a[i++];
+				merge_one(m, 0, ca, get_label(ca), d + 1);
+			} else {
+				m->key[d] = b[j++];
+				merge_one(m, 1, cb, get_label(cb), d + 1);
+			}
+		}
+	}
+}
+
+static void merge(struct ctrie *a,
+                  struct ctrie *b,
+                  int ops,
+                  ctrie_merge_cb_t *cb,
+                  void *arg)
+{
+	struct merge m = {
+		.t = { a, b },
+		.ops = ops,
+		.cb = cb,
+		.arg = arg,
+	};
+	struct ctnode *ra = root(a);
+	struct ctnode *rb = root(b);
+	merge_node(&m, ra, get_label(ra), rb, get_label(rb), 0);
+	free(m.key);
+}
+
+void ctrie_union(struct ctrie *a, struct ctrie *b, ctrie_merge_cb_t *cb, void *arg)
+{
+	merge(a, b, M_A | M_B | M_AB, cb, arg);
+}
+
+void ctrie_intersect(struct ctrie *a, struct ctrie *b, ctrie_merge_cb_t *cb, void *arg)
+{
+	merge(a, b, M_AB, cb, arg);
+}
+
+void ctrie_diff(struct ctrie *a, struct ctrie *b, ctrie_merge_cb_t *cb, void *arg)
+{
+	merge(a, b, M_A, cb, arg);
+}
+
+/*
+ * Entry of a cursor path.
+ */
+struct ctrie_cursor_ent
+{
+	struct ctnode *n; /* the node */
+	size_t idx;       /* index of `n` in its parent's child array */
+	size_t start;     /* offset of the `n`'s label in the key */
+};
+
+static void cursor_push(struct ctrie_cursor *c,
+                        struct ctnode *n,
+                        size_t idx,
+                        size_t start)
+{
+	AGROW(c->path, c->npath, c->path_size);
+	c->path[c->npath++] = (struct ctrie_cursor_ent) {
+		.n = n,
+		.idx = idx,
+		.start = start,
+	};
+}
+
+void ctrie_cursor_init(struct ctrie *t, struct ctrie_cursor *c)
+{
+	c->t = t;
+	c->gen = t->gen;
+	c->path = NULL;
+	c->path_size = c->npath = 0;
+	c->key = NULL;
+	c->key_size = 0;
+}
+
+/*
+ * Find the longest prefix of `key` in the trie, starting from the deepest
+ * node on the path of `c` which is shared with the previous key. When done,
+ * the last node of the path is the node where the search stopped, `*l` is
+ * set to the first character of its label which was not matched and `*k` to
+ * the remaining part of the key.
+ */
+static void cursor_descend(struct ctrie_cursor *c,
+                           const char *key,
+                           char **l,
+                           const char **k)
+{
+	struct ctrie *t = c->t;
+	size_t lcp = 0;
+	if (c->gen != t->gen) {
+		c->npath = 0;
+		c->gen = t->gen;
+	} else if (c->npath) {
+		while (key[lcp] && key[lcp] == c->key[lcp])
+			lcp++;
+	}
+
+	/* keep only the nodes whose key is a prefix of both keys */
+	while (c->npath > 1 && c->path[c->npath - 1].start > lcp)
+		c->npath--;
+	if (!c->npath)
+		cursor_push(c, root(t), 0, 0);
+
+	struct ctrie_cursor_ent *e = &c->path[c->npath - 1];
+	struct ctnode *n = e->n;
+	*k = key + e->start;
+	while (1) {
+		for (*l = get_label(n); **k && **k == **l; (*l)++, (*k)++);
+		if (**l || !**k)
+			break;
+		size_t idx = find_child_idx(t, n, **k);
+		if (idx >= node_nchild(n) || char_array(t, n)[idx] != **k)
+			break;
+		(*k)++;
+		n = get_child(t, n, idx);
+		cursor_push(c, n, idx, *k - key);
+	}
+
+	size_t len = *k - key + strlen(*k);
+	AGROW(c->key, len + 1, c->key_size);
+	memcpy(c->key + lcp, key + lcp, len + 1 - lcp);
+}
+
+void *ctrie_cursor_find(struct ctrie_cursor *c, const char *key)
+{
+	char *l;
+	const char *k;
+	cursor_descend(c, key, &l, &k);
+	struct ctnode *n = c->path[c->npath - 1].n;
+	if (!*l && !*k && (node_flags(n) & F_WORD))
+		return data(c->t, n);
+
+	/* return the deepest wild-card node fully matched by the key */
+	size_t i = c->npath - (!*l && *k ? 0 : 1);
+	while (i--)
+		if (node_flags(c->path[i].n) & F_WILD)
+			return data(c->t, c->path[i].n);
+	return NULL;
+}
+
+void *ctrie_cursor_insert(struct ctrie_cursor *c, const char *key, bool wildcard)
+{
+	char *l;
+	const char *k;
+	HIST_START();
+	cursor_descend(c, key, &l, &k);
+	c->npath--;
+	struct ctnode *parent = c->npath ? c->path[c->npath - 1].n : c->t->fake_root;
+	size_t idx = c->path[c->npath].idx;
+	struct ctnode *n = c->path[c->npath].n;
+	size_t gen = c->t->gen;
+	n = insert_at(c->t, parent, idx, n, l, k, k + strlen(k), wildcard, NULL);
+	if (c->t->index && c->t->gen != gen)
+		index_key(c->t, key, strlen(key));
+
+	/* the path up to `parent` is still valid */
+	c->gen = c->t->gen;
+	HIST_END(CTRIE_OP_INSERT);
+	return n ? data(c->t, n) : NULL;
+}
+
+void ctrie_cursor_free(struct ctrie_cursor *c)
+{
+	free(c->path);
+	free(c->key);
+}
+
+/*
+ * Node on the path of the previous key added to a builder which is not built
+ * yet, because more children may follow.
+ */
+struct ctrie_builder_ent
+{
+	size_t end;   /* length of the key of the node */
+	size_t base;  /* index of the first child of the node in `children` */
+	byte_t flags; /* flags of the node */
+};
+
+/*
+ * Built child of a node on the path of a builder.
+ */
+struct ctrie_builder_child
+{
+	ctref_t r; /* the child */
+	char c;    /* character leading to the child */
+};
+
+static void builder_push(struct ctrie_builder *b, size_t end, size_t base, byte_t flags)
+{
+	size_t ds = b->t->data_size, path_size = b->path_size;
+	AGROW(b->path, b->npath, b->path_size);
+	if (ds && b->path_size != path_size)
+		b->data = xrealloc(b->data, b->path_size * ds);
+	b->path[b->npath++] = (struct ctrie_builder_ent) { end, base, flags };
+	if (ds)
+		memset(b->data + (b->npath - 1) * ds, 0, ds);
+}
+
+/*
+ * Build node `e`, the `i`-th one on the path of `b`, whose label starts at
+ * offset `start` of the previous key, out of its children, which are on top
+ * of `children`, and return a reference to it.
+ */
+static ctref_t builder_node(struct ctrie_builder *b,
+                            struct ctrie_builder_ent *e,
+                            size_t i,
+                            size_t start)
+{
+	struct ctrie *t = b->t;
+	const char *label = b->key ? b->key + start : ""; /* no keys yet */
+	size_t len = e->end - start, nchild = b->nchildren - e->base;
+	struct ctrie_builder_child *ch = &b->children[e->base];
+	b->nchildren = e->base;
+	if (!nchild && i && can_inline(t, len)) /* not the root */
+		return make_inline(label, len, e->flags);
+	struct ctnode *n = new_node(t, nchild);
+	set_label_n(t, n, label, len);
+	n->flags |= e->flags;
+	if ((e->flags & F_WORD) && t->data_size)
+		memcpy(data(t, n), b->data + i * t->data_size, t->data_size);
+	/*
+	 * The children come in the order of unsigned characters, the trie keeps
+	 * them in the order of `char`, which may be signed.
+	 */
+	for (int neg = 1; neg >= 0; neg--) {
+		for (size_t j = 0; j < nchild; j++) {
+			if ((ch[j].c < 0) != neg)
+				continue;
+			char_array(t, n)[n->nchild] = ch[j].c;
+			children(n)[n->nchild++] = ch[j].r;
+		}
+	}
+	return ref(t, n);
+}
+
+/*
+ * Build the nodes on the path of `b` whose keys are longer than `l`, so that
+ * the path ends in a node whose key is the first `l` characters of the
+ * previous key, splitting a label if need be.
+ */
+static void builder_close(struct ctrie_builder *b, size_t l)
+{
+	while (b->path[b->npath - 1].end > l) {
+		struct ctrie_builder_ent e = b->path[--b->npath];
+		size_t pend = b->path[b->npath - 1].end;
+		bool split = pend < l;
+		if (split)
+			pend = l;
+		ctref_t r = builder_node(b, &e, b->npath, pend + 1);
+		if (split)
+			builder_push(b, l, e.base, 0);
+		AGROW(b->children, b->nchildren, b->children_size);
+		b->children[b->nchildren++] = (struct ctrie_builder_child) { r, b->key[pend] };
+	}
+}
+
+int ctrie_builder_init(struct ctrie *t, struct ctrie_builder *b)
+{
+	if (!ctrie_empty(t) || t->frozen) {
+		errno = EINVAL;
+		return -1;
+	}
+	b->t = t;
+	b->key = NULL;
+	b->key_len = b->key_size = 0;
+	b->path = NULL;
+	b->npath = b->path_size = 0;
+	b->children = NULL;
+	b->nchildren = b->children_size = 0;
+	b->data = NULL;
+	builder_push(b, 0, 0, 0); /* the root */
+	return 0;
+}
+
+int ctrie_builder_add(struct ctrie_builder *b,
+                      const char *key,
+                      size_t len,
+                      bool wildcard,
+                      const void *data)
+{
+	size_t l = 0, m = MIN(len, b->key_len);
+	while (l < m && key[l] == b->key[l])
+		l++;
+	if (!len || memchr(key, '\0', len)
+	    || (b->key_len && l == len && l < b->key_len)
+	    || (l < m && (unsigned char)key[l] < (unsigned char)b->key[l])) {
+		errno = EINVAL;
+		return -1;
+	}
+	byte_t flags = F_WORD | (wildcard ? F_WILD : 0);
+	if (l == len && l == b->key_len) { /* the previous key again */
+		b->path[b->npath - 1].flags |= flags;
+	} else {
+		builder_close(b, l);
+		AGROW(b->key, len, b->key_size);
+		memcpy(b->key + l, key + l, len - l);
+		b->key_len = len;
+		builder_push(b, len, b->nchildren, flags);
+	}
+	if (data && b->t->data_size)
+		memcpy(b->data + (b->npath - 1) * b->t->data_size, data, b->t->data_size);
+	return 0;
+}
+
+void ctrie_builder_finish(struct ctrie_builder *b)
+{
+	struct ctrie *t = b->t;
+	builder_close(b, 0);
+	struct ctnode *r = deref(t, builder_node(b, &b->path[0], 0, 0));
+	free_node(t, root(t));
+	set_child(t, t->fake_root, 0, r);
+	t->gen++;
+	if (t->index) {
+		ctrie_index_free(t);
+		ctrie_index_init(t);
+	}
+	free(b->key);
+	free(b->path);
+	free(b->children);
+	free(b->data);
+}
+
+/*
+ * A bulk build by `ctrie_build_parallel`. The keys share their first `depth`
+ * characters and are partitioned by the next one. Partition `c` holds the
+ * keys `keys[start[c]]` to `keys[start[c + 1] - 1]`.
+ */
+struct build_job
+{
+	const char **keys;    /* the keys, partitioned */
+	size_t start[257];    /* partition offsets */
+	size_t depth;         /* length of the common prefix of the keys */
+	byte_t order[255];    /* non-empty partitions, largest first */
+	size_t norder;        /* number of non-empty partitions */
+	atomic_size_t next;   /* next partition of `order` to build */
+	ctref_t sub[256];     /* built subtrees of the partitions */
+	size_t owner[256];    /* workers which built the subtrees */
+};
+
+/*
+ * Worker of a bulk build. The subtrees are built in a trie of the worker's
+ * own, so that the workers never share an allocator (or an arena).
+ */
+struct build_worker
+{
+	struct build_job *job; /* the build */
+	size_t id;             /* index of the worker */
+	struct ctrie t;        /* trie the subtrees are built in */
+	pthread_t thread;      /* the thread, unless run by the caller */
+	bool started;          /* was `thread` started? */
+};
+
+/*
+ * Number of characters of the keys compared at a time by `sort_keys`, and the
+ * run length below which `qsort(3)` beats a radix sort.
+ */
+#define SORT_CHARS     16
+#define SORT_QSORT_MAX 64
+
+/*
+ * How many keys ahead loops over arrays of keys prefetch. Keys handed over as
+ * an array of pointers are usually scattered over the heap, so every key read
+ * is a cache miss otherwise.
+ */
+#define KEYS_PREFETCH 8
+
+#define PREFETCH_KEY(keys, n, i, off) \
+	do { \
+		if ((i) + KEYS_PREFETCH < (n)) \
+			__builtin_prefetch((keys)[(i) + KEYS_PREFETCH] + (off)); \
+	} while (0)
+
+/*
+ * Key being sorted by `sort_keys`, with its next `SORT_CHARS` characters
+ * cached as a big-endian number, padded with zeros past the end of the key.
+ */
+struct sort_ent
+{
+	uint64_t pre[SORT_CHARS / 8]; /* next characters of the key */
+	const char *key;              /* the key */
+};
+
+/*
+ * A run of `n` entries from `start` which share their first `depth`
+ * characters.
+ */
+struct sort_run
+{
+	size_t start; /* first entry of the run */
+	size_t n;     /* number of entries */
+	size_t depth; /* number of characters the entries share */
+};
+
+static int cmp_sort_ents(const void *a, const void *b)
+{
+	const struct sort_ent *x = a, *y = b;
+	for (size_t i = 0; i < SORT_CHARS / 8; i++) {
+		if (x->pre[i] != y->pre[i])
+			return x->pre[i] > y->pre[i] ? 1 : -1;
 	}
+	return 0;
 }
 
-void ctrie_dump(struct ctrie *t)
+static void sort_ent_fill(struct sort_ent *e, const char *key)
 {
-	ctrie_print_node(t, t->fake_root->child[0], 0);
+	for (size_t i = 0; i < SORT_CHARS / 8; i++) {
+		uint64_t pre = 0;
+		for (size_t j = 0; j < 8; j++) {
+			pre <<= 8;
+			if (*key)
+				pre |= (byte_t)*key++;
+		}
+		e->pre[i] = pre;
+	}
 }
 
-void *ctrie_insert(struct ctrie *t, char *key, bool wildcard)
+/*
+ * Return the `i`-th cached character of `e`.
+ */
+static inline byte_t sort_ent_char(const struct sort_ent *e, size_t i)
 {
-	/* TODO assert key not empty */
-	struct ctnode *n = t->fake_root->child[0], *parent = t->fake_root;
-	size_t idx = 0;
-	char *l;
-	while (1) { /* find longest prefix of key in the trie */
-		for (l = get_label(n); *key && *key == *l; l++, key++);
-		if (*l || !*key) /* false for root label and non-empty key */
-			break;
-		size_t next_idx = find_child_idx(t, n, *key);
-		if (next_idx >= n->nchild || char_array(t, n)[next_idx] != *key)
-			break;
-		key++;
-		parent = n;
-		n = n->child[next_idx];
-		idx = next_idx;
+	return e->pre[i / 8] >> 8 * (7 - i % 8);
+}
+
+/*
+ * Sort the `n` entries `e` by their cached characters, using `tmp` of the
+ * same size. This is an LSD radix sort, which skips the characters all the
+ * entries share.
+ */
+static void sort_ents(struct sort_ent *e, struct sort_ent *tmp, size_t n)
+{
+	if (n <= SORT_QSORT_MAX) {
+		qsort(e, n, sizeof(*e), cmp_sort_ents);
+		return;
 	}
-	if (*l) { /* create new node between `parent` and `n`, split label */
-		struct ctnode *s = new_node(t, 1);
-		s = insert_child(t, s, *l, n); /* won't trigger resize */
-		*l++ = '\0';
-		set_label(s, get_label(n));
-		parent->child[idx] = s;
-		set_label(n, l);
-		n = s;
+	size_t count[SORT_CHARS][256] = { 0 };
+	for (size_t i = 0; i < n; i++) {
+		for (size_t c = 0; c < SORT_CHARS; c++)
+			count[c][sort_ent_char(&e[i], c)]++;
 	}
-	if (*key) { /* `n` is a prefix for `key`, prolong the path */
-		struct ctnode *new = new_node(t, 0);
-		n = insert_child(t, n, *key++, new);
-		set_label(new, key); /* without the first char */
-		parent->child[idx] = n;
-		n = new;
+	struct sort_ent *src = e, *dst = tmp, *swap;
+	for (size_t c = SORT_CHARS; c-- > 0;) {
+		if (count[c][sort_ent_char(e, c)] == n)
+			continue;
+		size_t pos[256];
+		for (size_t b = 0, sum = 0; b < 256; b++) {
+			pos[b] = sum;
+			sum += count[c][b];
+		}
+		for (size_t i = 0; i < n; i++)
+			dst[pos[sort_ent_char(&src[i], c)]++] = src[i];
+		swap = src;
+		src = dst;
+		dst = swap;
 	}
-	n->flags |= F_WORD;
-	if (wildcard)
-		n->flags |= F_WILD;
-	return data(t, n);
+	if (src != e)
+		memcpy(e, src, n * sizeof(*e));
 }
 
 /*
- * Cut `n` from `t`, where `p` is the parent of `n`. This assumes that `n` has
- * only a single child and `n` is not a word node, i.e. it can be merged with
- * its only child.
+ * Sort the `n` `keys`, which share their first `depth` characters, in the
+ * order of `strcmp(3)`. The keys are sorted by their next `SORT_CHARS`
+ * characters, which are cached in the entries sorted, so that the sort
+ * doesn't chase pointers to the keys. Runs of keys whose next characters are
+ * equal are then sorted by the following ones, until the keys end.
  */
-static void cut(struct ctrie *t,
-                       struct ctnode *n,
-                       struct ctnode *p,
-                       size_t pi)
+static void sort_keys(const char **keys, size_t n, size_t depth)
 {
-	assert(p->nchild >= 1);
-	assert(p->child[pi] == n);
-	assert(n->nchild == 1);
-	assert(!(n->flags & F_WORD));
-
-	char label_buf[LABEL_BUF_SIZE];
-
-	struct ctnode *c = n->child[0];
-	char *label_n = get_label(n);
-	char *label_c = get_label(c);
-	size_t label_n_len = strlen(label_n);
-	size_t label_c_len = strlen(label_c);
-	size_t label_len = label_n_len + 1 + label_c_len;
-
-	char *label;
-	if (label_len < sizeof(label_buf))
-		label = label_buf;
-	else
-		label = xmalloc(label_len + 1);
+	struct sort_ent *e = xmalloc(n * sizeof(*e));
+	struct sort_ent *tmp = xmalloc(n * sizeof(*tmp));
+	struct sort_run *stack = NULL;
+	size_t nstack = 0, stack_size = 0;
+	for (size_t i = 0; i < n; i++)
+		e[i].key = keys[i];
+	AGROW(stack, nstack, stack_size);
+	stack[nstack++] = (struct sort_run) { 0, n, depth };
+	while (nstack) {
+		struct sort_run r = stack[--nstack];
+		struct sort_ent *run = e + r.start;
+		for (size_t i = 0; i < r.n; i++) {
+			if (i + KEYS_PREFETCH < r.n)
+				__builtin_prefetch(run[i + KEYS_PREFETCH].key + r.depth);
+			sort_ent_fill(&run[i], run[i].key + r.depth);
+		}
+		sort_ents(run, tmp, r.n);
+		for (size_t i = 0, j; i < r.n; i = j) {
+			for (j = i + 1; j < r.n && !cmp_sort_ents(&run[i], &run[j]); j++);
+			if (j - i > 1 && sort_ent_char(&run[i], SORT_CHARS - 1)) {
+				/* the keys go on */
+				AGROW(stack, nstack, stack_size);
+				stack[nstack++] = (struct sort_run) {
+					r.start + i, j - i, r.depth + SORT_CHARS
+				};
+			}
+		}
+	}
+	for (size_t i = 0; i < n; i++)
+		keys[i] = e[i].key;
+	free(stack);
+	free(tmp);
+	free(e);
+}
 
-	memcpy(label, label_n, label_n_len);
-	label[label_n_len] = char_array(t, n)[0];
-	memcpy(label + label_n_len + 1, label_c, label_c_len);
-	label[label_len] = '\0';
+/*
+ * Build partitions until there are none left. A partition is sorted and its
+ * keys, less the common prefix, are added to a builder, which leaves the
+ * subtree as the only child of the root of the worker's trie. The subtree is
+ * detached from the root then, so that the next builder finds the trie empty.
+ */
+static void *build_worker(void *arg)
+{
+	struct build_worker *w = arg;
+	struct build_job *job = w->job;
+	size_t i;
+	while ((i = atomic_fetch_add(&job->next, 1)) < job->norder) {
+		byte_t c = job->order[i];
+		const char **keys = job->keys + job->start[c];
+		size_t n = job->start[c + 1] - job->start[c];
+		struct ctrie_builder b;
+		sort_keys(keys, n, job->depth);
+		ctrie_builder_init(&w->t, &b);
+		for (size_t j = 0; j < n; j++) {
+			PREFETCH_KEY(keys, n, j, job->depth);
+			const char *k = keys[j] + job->depth;
+			ctrie_builder_add(&b, k, strlen(k), false, NULL);
+		}
+		ctrie_builder_finish(&b);
+		struct ctnode *r = root(&w->t);
+		assert(r->nchild == 1);
+		job->sub[c] = children(r)[0];
+		job->owner[c] = w->id;
+		r->nchild = 0;
+	}
+	return NULL;
+}
 
-	/* TODO we're basically double-copying the label - avoid that */
-	set_label(c, label);
-	p->child[pi] = c;
+#ifdef CTRIE_REF32
 
-	if (label != label_buf)
-		free(label);
-	if (n->flags & F_SEPL)
-		free(label_n);
-	free(n);
+/*
+ * Add `base` chunks to the references in the subtree `r` built in another
+ * arena, which was merged by `arena_merge`, and return the rebased `r`.
+ */
+static ctref_t rebase(struct ctrie *t, ctref_t r, size_t base)
+{
+	if (r & 1)
+		return r; /* inline leaf */
+	ctref_t add = (ctref_t)base << (ARENA_OFF_BITS + 1);
+	struct ctnode **stack = NULL;
+	size_t nstack = 0, stack_size = 0;
+	r += add;
+	AGROW(stack, nstack, stack_size);
+	stack[nstack++] = deref(t, r);
+	while (nstack) {
+		struct ctnode *n = stack[--nstack];
+		for (size_t i = 0; i < n->nchild; i++) {
+			ctref_t *c = &children(n)[i];
+			if (*c & 1)
+				continue;
+			*c += add;
+			AGROW(stack, nstack, stack_size);
+			stack[nstack++] = deref(t, *c);
+		}
+	}
+	free(stack);
+	return r;
 }
 
-void ctrie_remove(struct ctrie *t, char *key)
+#endif
+
+int ctrie_build_parallel(struct ctrie *t,
+                         const char *const *keys,
+                         size_t n,
+                         int threads)
 {
-	struct ctnode *pp, *p;
-	size_t ppi, pi;
-	struct ctnode *n = find3(t, key, &pp, &ppi, &p, &pi);
+	struct ctnode *r = root(t);
+	if (r->nchild || (r->flags & F_WORD) || t->frozen) {
+		errno = EINVAL;
+		return -1;
+	}
 	if (!n)
-		return;
+		return 0;
 
-	assert(n->flags & F_WORD);
-	n->flags &= ~F_WORD;
+	struct build_job *job = xcalloc(1, sizeof(*job));
+	size_t count[256] = { 0 };
+	size_t d = strlen(keys[0]);
+	for (size_t i = 1; i < n && d; i++) {
+		PREFETCH_KEY(keys, n, i, 0);
+		size_t l = 0;
+		while (l < d && keys[i][l] == keys[0][l])
+			l++;
+		d = l;
+	}
+	byte_t *part = xmalloc(n);
+	for (size_t i = 0; i < n; i++) {
+		PREFETCH_KEY(keys, n, i, d);
+		count[part[i] = keys[i][d]]++;
+	}
+	if (!d && count[0]) { /* empty keys */
+		free(part);
+		free(job);
+		errno = EINVAL;
+		return -1;
+	}
+	job->depth = d;
+	for (size_t c = 0; c < 256; c++) {
+		job->start[c + 1] = job->start[c] + count[c];
+		if (c && count[c]) {
+			size_t j = job->norder++;
+			for (; j && count[job->order[j - 1]] < count[c]; j--)
+				job->order[j] = job->order[j - 1];
+			job->order[j] = c;
+		}
+	}
+	job->keys = xmalloc(n * sizeof(*job->keys));
+	size_t pos[256];
+	memcpy(pos, job->start, sizeof(pos));
+	for (size_t i = 0; i < n; i++)
+		job->keys[pos[part[i]]++] = keys[i];
+	free(part);
 
-	// The node is internal branching node. Clearing F_WORD is
-	// enough, the node must be kept.
-	if (n->nchild > 1)
-		return;
+	if (threads <= 0)
+		threads = MAX(1, sysconf(_SC_NPROCESSORS_ONLN));
+	size_t nworkers = MIN((size_t)threads, MAX(1, job->norder));
+	struct build_worker *workers = xcalloc(nworkers, sizeof(*workers));
+	for (size_t i = 0; i < nworkers; i++) {
+		workers[i].job = job;
+		workers[i].id = i;
+		ctrie_init(&workers[i].t, t->data_size);
+	}
+	/* the caller works too; workers which fail to start are not missed */
+	for (size_t i = 1; i < nworkers; i++)
+		workers[i].started = !pthread_create(&workers[i].thread, NULL,
+			build_worker, &workers[i]);
+	build_worker(&workers[0]);
+	for (size_t i = 1; i < nworkers; i++) {
+		if (workers[i].started)
+			pthread_join(workers[i].thread, NULL);
+	}
 
-	// The node has a single child. We will cut the node and it's
-	// sole child will become a child of the parent.
-	if (n->nchild) {
-		cut(t, n, p, pi);
-		return;
+	for (size_t i = 0; i < nworkers; i++) {
+		struct ctrie *w = &workers[i].t;
+		free_node(w, root(w));
+		free_node(w, w->fake_root);
+		free(w->stats);
+#ifdef CTRIE_REF32
+		size_t base = arena_merge(t->arena, w->arena);
+		for (size_t j = 0; j < job->norder; j++) {
+			byte_t c = job->order[j];
+			if (job->owner[c] == i)
+				job->sub[c] = rebase(t, job->sub[c], base);
+		}
+#endif
 	}
 
-	assert(p->nchild > 1 || p->flags & F_WORD || pp == t->fake_root);
-	assert(p->child[pi] == n);
+	/*
+	 * The top node, which holds the common prefix, is allocated with room
+	 * for exactly the children it gets, in the order of `char`.
+	 */
+	struct ctnode *top = new_node(t, job->norder);
+	for (int neg = 1; neg >= 0; neg--) {
+		for (size_t c = 1; c < 256; c++) {
+			if (!count[c] || ((char)c < 0) != neg)
+				continue;
+			char_array(t, top)[top->nchild] = c;
+			children(top)[top->nchild++] = job->sub[c];
+		}
+	}
+	free_node(t, r);
+	if (d) {
+		r = new_node(t, 1);
+		if (!top->nchild && can_inline(t, d - 1)) { /* a single key */
+			free_node(t, top);
+			r = insert_ref(t, r, keys[0][0],
+				make_inline(keys[0] + 1, d - 1, F_WORD));
+		} else {
+			set_label_n(t, top, keys[0] + 1, d - 1);
+			if (count[0])
+				top->flags |= F_WORD;
+			r = insert_child(t, r, keys[0][0], top);
+		}
+	} else {
+		r = top;
+	}
+	set_child(t, t->fake_root, 0, r);
+	t->gen++;
+	if (t->index) {
+		ctrie_index_free(t);
+		ctrie_index_init(t);
+	}
+	free(workers);
+	free(job->keys);
+	free(job);
+	return 0;
+}
 
-	// Otherwise, the node is a leaf.
-	ARRAY_SHIFT(p->child, pi, pi + 1, p->nchild);
-	ARRAY_SHIFT(char_array(t, p), pi, pi + 1, p->nchild);
-	if (n->flags & F_SEPL)
-		free(get_label(n));
-	free(n);
-	p->nchild--;
-	if (p->nchild == 1 && !(p->flags & F_WORD) && pp != t->fake_root)
-		cut(t, p, pp, ppi);
+/*
+ * Table of the distinct nodes of a trie being minimized, hashed by their
+ * labels, flags and children. Open addressing with linear probing.
+ */
+struct dawg_table
+{
+	struct ctnode **slots; /* the nodes, `NULL` for free slots */
+	size_t size;           /* number of slots, a power of two */
+	size_t n;              /* number of nodes */
+};
+
+static uint64_t dawg_hash(struct ctrie *t, struct ctnode *n)
+{
+	const char *l = get_label(n);
+	uint64_t h = cache_hash(l, strlen(l)) ^ (n->flags & SAVE_FLAGS);
+	h = h * 0x9e3779b97f4a7c15 ^ cache_hash(char_array(t, n), n->nchild);
+	return h * 0x9e3779b97f4a7c15 ^ cache_hash((const char *)children(n),
+		n->nchild * sizeof(ctref_t));
+}
+
+static bool dawg_equal(struct ctrie *t, struct ctnode *a, struct ctnode *b)
+{
+	return (a->flags & SAVE_FLAGS) == (b->flags & SAVE_FLAGS)
+	       && a->nchild == b->nchild
+	       && !strcmp(get_label(a), get_label(b))
+	       && !memcmp(char_array(t, a), char_array(t, b), a->nchild)
+	       && !memcmp(children(a), children(b), a->nchild * sizeof(ctref_t));
 }
 
 /*
- * Array growing helper. Ensure that the array `a` of `sizeof(*a)`-sized items
- * with current capacity `cap` can hold `size + 1` items (i.e., is not full).
- * If `size` has reached `a`'s capacity limit, use `realloc(3)` to resize the
- * array to at least twice current capacity.
+ * Return the slot of `d` holding the node equal to `n`, adding `n` to `d` if
+ * there's none.
  */
-#define AGROW(a, size, cap) do { \
-	if ((size) >= (cap)) { \
-		(cap) = MAX(size, MAX(1, 2 * (cap))); \
-		(a) = xrealloc((a), (cap) * sizeof(*(a))); \
-	} \
-} while (0)
+static struct ctnode **dawg_intern(struct ctrie *t,
+                                   struct dawg_table *d,
+                                   struct ctnode *n)
+{
+	if (2 * (d->n + 1) > d->size) {
+		struct dawg_table g = { xcalloc(2 * d->size, sizeof(*g.slots)), 2 * d->size, d->n };
+		for (size_t i = 0; i < d->size; i++) {
+			struct ctnode *m = d->slots[i];
+			if (!m)
+				continue;
+			size_t j = dawg_hash(t, m) & (g.size - 1);
+			while (g.slots[j])
+				j = (j + 1) & (g.size - 1);
+			g.slots[j] = m;
+		}
+		free(d->slots);
+		*d = g;
+	}
+	size_t i = dawg_hash(t, n) & (d->size - 1);
+	for (; d->slots[i]; i = (i + 1) & (d->size - 1)) {
+		if (dawg_equal(t, d->slots[i], n))
+			return &d->slots[i];
+	}
+	d->slots[i] = n;
+	d->n++;
+	return &d->slots[i];
+}
 
 /*
- * Iterator stack entry. Together, these objects hold the entire iteration state
- * of the associated iterator.
+ * Return the number of words below `n` in a numbered trie.
  */
-struct ctrie_iter_stkent
+static inline size_t subtree_words(struct ctrie *t, struct ctnode *n)
 {
-	struct ctnode *n; /* node that this entry describes */
-	size_t idx;       /* current child index in `n` */
-	size_t key_len;   /* length of `n`'s key */
-};
+	if (!node_nchild(n))
+		return !!(node_flags(n) & F_WORD); /* only the empty root isn't */
+	return ranks(t, n)[n->nchild];
+}
 
 /*
- * Push and return new stack entry for node `n` onto the stack of iterator `it`.
+ * Return `n` reallocated with room for exactly its children, followed by its
+ * rank array if `number` is set, or `n` itself if that gains nothing. The
+ * children of `n` must have their rank arrays already.
  */
-static struct ctrie_iter_stkent *push(struct ctrie_iter *it, struct ctnode *n)
+static struct ctnode *compact(struct ctrie *t, struct ctnode *n, bool number)
 {
-	AGROW(it->stack, it->nstack, it->stack_size);
-	struct ctrie_iter_stkent *c = &it->stack[it->nstack++];
-	c->n = n;
-	c->idx = SIZE_MAX;
-	return c;
+	size_t size = MAX(n->nchild, NODE_INIT_SIZE);
+	if (!number && n->size <= size)
+		return n;
+	size_t bytes = alloc_size(t, size) + (number ? ranks_size(size) : 0);
+	ALLOC_START(t);
+	struct ctnode *m = node_alloc(t, bytes);
+	ALLOC_END(t);
+	memset(m, 0, bytes);
+	memcpy(m, n, sizeof(*n));
+	m->size = size;
+	memcpy(char_array(t, m), char_array(t, n), n->nchild);
+	memcpy(children(m), children(n), n->nchild * sizeof(ctref_t));
+	node_release(t, n, alloc_size(t, n->size)); /* the label moved to `m` */
+	if (number && m->nchild) {
+		uint32_t *r = ranks(t, m), k = !!(m->flags & F_WORD);
+		for (size_t i = 0; i < m->nchild; i++) {
+			r[i] = k;
+			k += subtree_words(t, get_child(t, m, i));
+		}
+		r[m->nchild] = k;
+	}
+	return m;
 }
 
-void ctrie_iter_init(struct ctrie *t, struct ctrie_iter *it)
+/*
+ * Return the number of words of the trie `t`, which is not frozen.
+ */
+static size_t count_words(struct ctrie *t)
 {
-	it->t = t;
-	it->stack = NULL;
-	it->stack_size = it->nstack = 0;
-	push(it, t->fake_root->child[0])->key_len = 0;
+	struct save_ent *stack = NULL;
+	size_t nstack = 0, stack_size = 0, n = 0;
+
+	AGROW(stack, nstack, stack_size);
+	stack[nstack++] = (struct save_ent) { root(t), 0 };
+	while (nstack) {
+		struct save_ent *e = &stack[nstack - 1];
+		if (e->i == e->n->nchild) {
+			nstack--;
+			continue;
+		}
+		struct ctnode *c = get_child(t, e->n, e->i++);
+		n += !!(node_flags(c) & F_WORD);
+		if (!is_inline(c)) {
+			AGROW(stack, nstack, stack_size);
+			stack[nstack++] = (struct save_ent) { c, 0 };
+		}
+	}
+	free(stack);
+	return n;
 }
 
-struct ctnode *ctrie_iter_next(struct ctrie_iter *it,
-                               char **key,
-                               size_t *key_size)
+/*
+ * Minimize `t` like `ctrie_minimize`, and number its words if `number` is
+ * set.
+ */
+static int minimize(struct ctrie *t, bool number)
 {
-	struct ctrie_iter_stkent *se;
-	struct ctnode *n;
-	size_t key_len;
-	size_t label_len;
-	while (it->nstack) {
-		se = &it->stack[it->nstack - 1];
-		se->idx++; /* deliberate overflow */
-		if (se->idx >= se->n->nchild) {
-			it->nstack--;
+	if (t->data_size || (t->frozen && number && !t->numbered)) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (t->frozen)
+		return 0;
+	if (number && count_words(t) > UINT32_MAX) {
+		errno = EOVERFLOW;
+		return -1;
+	}
+	ctrie_index_free(t);
+	struct dawg_table d = { xcalloc(1024, sizeof(*d.slots)), 1024, 0 };
+	struct save_ent *stack = NULL;
+	size_t nstack = 0, stack_size = 0;
+
+	/*
+	 * Walk the nodes in postorder, so that the children of a node have been
+	 * replaced by their canonical copies by the time the node itself is
+	 * looked up. Inline leaves are values, equal leaves are equal refs.
+	 * Nodes are only reallocated once they turn out to be distinct, the
+	 * table then gets the new copy.
+	 */
+	AGROW(stack, nstack, stack_size);
+	stack[nstack++] = (struct save_ent) { t->fake_root, 0 };
+	while (nstack) {
+		struct save_ent *e = &stack[nstack - 1];
+		if (e->i < e->n->nchild) {
+			struct ctnode *c = get_child(t, e->n, e->i++);
+			if (!is_inline(c)) {
+				AGROW(stack, nstack, stack_size);
+				stack[nstack++] = (struct save_ent) { c, 0 };
+			}
 			continue;
 		}
-		char c = char_array(it->t, se->n)[se->idx];
-		n = se->n->child[se->idx];
-		char *label = get_label(n);
-		label_len = strlen(label);
-		key_len = se->key_len + 1 + label_len;
-		AGROW(*key, key_len + 1, *key_size);
-		(*key)[se->key_len] = c;
-		memcpy(*key + se->key_len + 1, label, label_len);
-		(*key)[key_len] = '\0';
-		if (n->nchild)
-			push(it, n)->key_len = key_len;
-		if (n->flags & F_WORD)
-			return n;
+		struct ctnode *n = e->n;
+		if (--nstack == 0)
+			break; /* the fake root */
+		struct ctnode *p = stack[nstack - 1].n;
+		size_t i = stack[nstack - 1].i - 1;
+		struct ctnode **s = NULL;
+		if (p != t->fake_root) { /* the root has no equals */
+			s = dawg_intern(t, &d, n);
+			if (*s != n) {
+				free_node(t, n);
+				set_child(t, p, i, *s);
+				continue;
+			}
+		}
+		struct ctnode *m = compact(t, n, number);
+		if (m != n) {
+			set_child(t, p, i, m);
+			if (s)
+				*s = m;
+		}
 	}
-	return NULL;
+	if (number) {
+		/* all nodes are freed alike, the fake root included */
+		t->fake_root = compact(t, t->fake_root, true);
+		t->numbered = true;
+	}
+	t->frozen = true;
+	t->gen++;
+	free(stack);
+	free(d.slots);
+	return 0;
 }
 
-void ctrie_iter_free(struct ctrie_iter *it)
+int ctrie_minimize(struct ctrie *t)
 {
-	free(it->stack);
+	return minimize(t, false);
+}
+
+int ctrie_number(struct ctrie *t, size_t *nwords)
+{
+	if (minimize(t, true))
+		return -1;
+	*nwords = subtree_words(t, root(t));
+	return 0;
+}
+
+bool ctrie_word_id_n(struct ctrie *t, const char *key, size_t len, size_t *id)
+{
+	assert(t->numbered);
+	const char *end = key + len;
+	struct ctnode *n = root(t);
+	size_t r = 0, w = SIZE_MAX;
+	for (;;) {
+		const char *l;
+		for (l = get_label(n); key < end && *l && *key == *l; l++, key++);
+		if (*l) /* label mismatch */
+			break;
+		if (key == end) {
+			if (!(node_flags(n) & F_WORD))
+				break;
+			*id = r;
+			return true;
+		}
+		if (node_flags(n) & F_WILD)
+			w = r; /* the last wild-card, if the key isn't found */
+		char k = *key++;
+		size_t i = find_child_idx(t, n, k);
+		if (i >= node_nchild(n) || char_array(t, n)[i] != k)
+			break;
+		r += ranks(t, n)[i];
+		n = get_child(t, n, i);
+	}
+	*id = w;
+	return w != SIZE_MAX;
+}
+
+bool ctrie_word_id(struct ctrie *t, const char *key, size_t *id)
+{
+	return ctrie_word_id_n(t, key, strlen(key), id);
+}
+
+bool ctrie_id_to_key(struct ctrie *t, size_t id, char **key, size_t *key_size)
+{
+	assert(t->numbered);
+	struct ctnode *n = root(t);
+	size_t len = 0;
+	if (id >= subtree_words(t, n))
+		return false;
+	for (;;) {
+		const char *l = get_label(n);
+		size_t llen = strlen(l);
+		AGROW(*key, len + llen + 2, *key_size);
+		memcpy(*key + len, l, llen);
+		len += llen;
+		if (is_inline(n) || (!id && (node_flags(n) & F_WORD)))
+			break;
+		/* descend into the last child whose subtree starts at or before `id` */
+		uint32_t *r = ranks(t, n);
+		size_t lo = 0, hi = n->nchild - 1;
+		while (lo < hi) {
+			size_t m = (lo + hi + 1) / 2;
+			if (r[m] <= id)
+				lo = m;
+			else
+				hi = m - 1;
+		}
+		id -= r[lo];
+		(*key)[len++] = char_array(t, n)[lo];
+		n = get_child(t, n, lo);
+	}
+	(*key)[len] = '\0';
+	return true;
+}
+
+#ifdef CTRIE_HIST
+
+/*
+ * Walk the counts of the threads: those which exited, then the blocks.
+ */
+static struct hist_thread *hist_next(struct hist_thread *x)
+{
+	return x == &hist_retired ? atomic_load(&hist_threads) : x->next;
+}
+
+void ctrie_hist_merge(struct ctrie_hist *h)
+{
+	memset(h, 0, sizeof(*h));
+	for (struct hist_thread *x = &hist_retired; x; x = hist_next(x))
+		for (size_t op = 0; op < CTRIE_OP_COUNT; op++)
+			for (size_t b = 0; b < CTRIE_HIST_BUCKETS; b++)
+				h->count[op][b] += atomic_load_explicit(&x->count[op][b],
+					memory_order_relaxed);
+}
+
+void ctrie_hist_reset(void)
+{
+	for (struct hist_thread *x = &hist_retired; x; x = hist_next(x))
+		for (size_t op = 0; op < CTRIE_OP_COUNT; op++)
+			for (size_t b = 0; b < CTRIE_HIST_BUCKETS; b++)
+				atomic_store_explicit(&x->count[op][b], 0,
+					memory_order_relaxed);
+}
+
+/*
+ * Return the largest value which falls into bucket `b`.
+ */
+static uint64_t hist_value(size_t b)
+{
+	if (b < CTRIE_HIST_SUB)
+		return b;
+	int shift = b / CTRIE_HIST_SUB - 1;
+	uint64_t m = CTRIE_HIST_SUB + b % CTRIE_HIST_SUB;
+	return ((m + 1) << shift) - 1;
+}
+
+uint64_t ctrie_hist_percentile(const struct ctrie_hist *h,
+                               enum ctrie_op op,
+                               double p)
+{
+	uint64_t total = 0, seen = 0;
+	for (size_t b = 0; b < CTRIE_HIST_BUCKETS; b++)
+		total += h->count[op][b];
+	if (!total)
+		return 0;
+	uint64_t rank = (uint64_t)(p / 100 * total);
+	rank = MAX(1, MIN(rank, total));
+	for (size_t b = 0; b < CTRIE_HIST_BUCKETS; b++)
+		if ((seen += h->count[op][b]) >= rank)
+			return hist_value(b);
+	return 0; /* not reached */
+}
+
+/*
+ * Estimate the number of ticks per nanosecond by spinning for a millisecond.
+ */
+static double hist_ticks_per_ns(void)
+{
+	struct timespec a, b;
+	clock_gettime(CLOCK_MONOTONIC, &a);
+	uint64_t start = hist_ticks();
+	double ns;
+	do {
+		clock_gettime(CLOCK_MONOTONIC, &b);
+		ns = (b.tv_sec - a.tv_sec) * 1e9 + (b.tv_nsec - a.tv_nsec);
+	} while (ns < 1e6);
+	return (hist_ticks() - start) / ns;
+}
+
+void ctrie_hist_dump(const struct ctrie_hist *h, FILE *f)
+{
+	static const char *names[CTRIE_OP_COUNT] = {
+		[CTRIE_OP_FIND] = "find",
+		[CTRIE_OP_INSERT] = "insert",
+		[CTRIE_OP_REMOVE] = "remove",
+		[CTRIE_OP_ITER_NEXT] = "iter_next",
+	};
+	static const double ps[] = { 50, 90, 99, 99.9, 100 };
+	double tpn = hist_ticks_per_ns();
+	fprintf(f, "%-10s %12s %10s %10s %10s %10s %10s   (ticks, %.2f per ns)\n",
+		"op", "count", "p50", "p90", "p99", "p99.9", "max", tpn);
+	for (size_t op = 0; op < CTRIE_OP_COUNT; op++) {
+		uint64_t total = 0;
+		for (size_t b = 0; b < CTRIE_HIST_BUCKETS; b++)
+			total += h->count[op][b];
+		if (!total)
+			continue;
+		fprintf(f, "%-10s %12" PRIu64, names[op], total);
+		for (size_t i = 0; i < sizeof(ps) / sizeof(*ps); i++)
+			fprintf(f, " %10" PRIu64, ctrie_hist_percentile(h, op, ps[i]));
+		fputc('\n', f);
+	}
 }
+
+#endif
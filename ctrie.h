@@ -12,6 +12,56 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#ifdef CTRIE_STATS
+
+struct ctrie;
+
+/*
+ * Events reported to the `hook` of `struct ctrie_stats`, and the meaning of
+ * the argument passed along.
+ */
+enum ctrie_event
+{
+	CTRIE_EVENT_FIND,           /* a descent ended, number of nodes visited */
+	CTRIE_EVENT_RESIZE,         /* a node was resized, number of bytes moved */
+	CTRIE_EVENT_CUT,            /* a node was merged with its only child,
+	                               length of the merged label */
+	CTRIE_EVENT_LABEL_EMBEDDED, /* a label was stored in its node, its length */
+	CTRIE_EVENT_LABEL_HEAP,     /* a label was allocated, its length */
+	CTRIE_EVENT_ALLOC,          /* an allocator call returned, nanoseconds
+	                               spent in it */
+};
+
+/*
+ * Counters of the internal operations of a trie, kept in builds with
+ * `CTRIE_STATS` defined. Without it, neither the counters nor the hook exist
+ * and the operations are not instrumented at all. The counters are allocated
+ * apart from `struct ctrie`, so that its layout doesn't depend on the macro
+ * and code built with and without it can be linked together.
+ *
+ * The counters may be read and reset at any time. If `hook` is set, it's
+ * called with `hook_arg` after every event has been counted.
+ */
+struct ctrie_stats
+{
+	size_t finds;           /* descents from the root */
+	size_t nodes_visited;   /* nodes visited by the descents */
+	size_t label_bytes;     /* label bytes matched by the descents */
+	size_t resizes;         /* node resizes */
+	size_t resize_bytes;    /* bytes moved by the resizes */
+	size_t cuts;            /* nodes merged with their only children */
+	size_t labels_embedded; /* labels stored in their nodes */
+	size_t labels_heap;     /* labels allocated separately */
+	size_t allocs;          /* calls of the node and label allocator */
+	uint64_t alloc_ns;      /* nanoseconds spent in the allocator */
+	void (*hook)(struct ctrie *t, enum ctrie_event ev, size_t arg, void *hook_arg);
+	void *hook_arg;         /* argument of `hook` */
+};
+
+#endif
 
 /*
  * Compressed trie.
@@ -20,40 +70,268 @@ struct ctrie
 {
 	struct ctnode *fake_root; /* fake root node to simplify code */
 	size_t data_size;         /* number of bytes to allocate for data */
+	size_t gen;               /* incremented on every modification */
+	bool frozen;              /* minimized by `ctrie_minimize`, read-only */
+	bool numbered;            /* words numbered by `ctrie_number` */
+	struct ctrie_arena *arena; /* node arena (CTRIE_REF32 builds only) */
+	struct ctrie_index *index; /* prefix hash index, if enabled */
+	struct ctrie_cache *cache; /* lookup cache, if enabled */
+	struct ctrie_stats *stats; /* instrumentation, `NULL` without CTRIE_STATS */
+#ifdef __cplusplus
+	/* C++ interface, see ctrie.hpp */
+	template<typename T> struct is_relocatable;
+	template<typename T> class map;
+#endif
 };
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 /*
  * Init `t`. The trie will allocate `data_size` bytes for data in each node.
+ * Return 0, or -1 with `errno` set to `EINVAL` if `data_size` is too large
+ * for a node. In `CTRIE_REF32` builds, a node must fit in an arena chunk,
+ * which limits `data_size` to a few KiB short of 1 MiB.
  *
  * TODO: Allocating only makes sense for word nodes, not for e.g. branching
  *       nodes. Currently we allocate everywhere, which sucks.
  */
-void ctrie_init(struct ctrie *t, size_t data_size);
+int ctrie_init(struct ctrie *t, size_t data_size);
+
+/*
+ * Keys are NUL-terminated strings. The functions below taking a key also have
+ * an `_n` variant taking the key as `len` bytes at `key`, which need not be
+ * NUL-terminated. Keys holding NUL bytes are never present in a trie: lookups
+ * and removals of such keys find nothing, and insertions reject them by
+ * returning `NULL` and setting `errno` to `EINVAL`. The trie never writes
+ * through nor keeps the `key` pointer.
+ *
+ * Tries minimized by `ctrie_minimize` are read-only: insertions and removals
+ * which would change one fail, returning `NULL`, `false` or 0 and setting
+ * `errno` to `EPERM`. Inserting a key already present, or removing one which
+ * isn't, still succeeds as it changes nothing.
+ */
 
 /*
  * Find node with by `key` and return it. If `key` is not present in `t`,
  * return `NULL`.
  */
-void *ctrie_find(struct ctrie *t, char *key);
+void *ctrie_find(struct ctrie *t, const char *key);
+void *ctrie_find_n(struct ctrie *t, const char *key, size_t len);
 
 /*
  * Does `t` contain `key`?
  */
-bool ctrie_contains(struct ctrie *t, char *key);
+bool ctrie_contains(struct ctrie *t, const char *key);
+bool ctrie_contains_n(struct ctrie *t, const char *key, size_t len);
+
+/*
+ * Does `t` hold no key at all?
+ */
+bool ctrie_empty(struct ctrie *t);
 
 /*
  * Insert `key` into `t` and return a pointer to the memory allocated for data,
  * which is at least `t->data_size` bytes long and aligned at `sizeof(void*)`.
  *
  * The `wildcard` argument denotes whether the key should be treated as a prefix
- * wildcard.
+ * wildcard. The data of a key which was not present in `t` are zeroed.
+ */
+void *ctrie_insert(struct ctrie *t, const char *key, bool wildcard);
+void *ctrie_insert_n(struct ctrie *t,
+                     const char *key,
+                     size_t len,
+                     bool wildcard);
+
+/*
+ * Like `ctrie_insert` with `wildcard` unset, but also set `*inserted` to
+ * whether `key` was not present in `t` before, so that the caller can tell
+ * zeroed data of a new key from data of an existing one without looking the
+ * key up first.
+ */
+void *ctrie_upsert(struct ctrie *t, const char *key, bool *inserted);
+void *ctrie_upsert_n(struct ctrie *t,
+                     const char *key,
+                     size_t len,
+                     bool *inserted);
+
+/*
+ * Initialization callback for `ctrie_emplace`. Called with the zeroed `data`
+ * of a new key and the user-supplied `arg`.
+ */
+typedef void ctrie_init_cb_t(void *data, void *arg);
+
+/*
+ * Return the data of `key`, inserting `key` first if it's not present in `t`.
+ * Call `init` on the data only if `key` was inserted.
+ */
+void *ctrie_emplace(struct ctrie *t,
+                    const char *key,
+                    ctrie_init_cb_t *init,
+                    void *arg);
+void *ctrie_emplace_n(struct ctrie *t,
+                      const char *key,
+                      size_t len,
+                      ctrie_init_cb_t *init,
+                      void *arg);
+
+/*
+ * Remove `key` from `t`. If `key` is not found in `t`, do nothing. A removed
+ * wild-card key no longer matches the keys it's a prefix of, even if it stays
+ * a prefix of other keys. Removing the empty key leaves the other keys alone.
+ */
+void ctrie_remove(struct ctrie *t, const char *key);
+void ctrie_remove_n(struct ctrie *t, const char *key, size_t len);
+
+/*
+ * Remove all keys starting with `prefix` from `t` and return their number.
+ * This detaches the subtree of `prefix` in a single descent, so it's much
+ * cheaper than removing the keys one by one. The empty prefix clears `t`.
+ */
+size_t ctrie_remove_prefix(struct ctrie *t, const char *prefix);
+size_t ctrie_remove_prefix_n(struct ctrie *t, const char *prefix, size_t len);
+
+/*
+ * Remove `key` from `t` like `ctrie_remove`, but first copy its data to `out`
+ * (`t->data_size` bytes, unless `out` is `NULL`). Return whether `key` was
+ * found.
+ */
+bool ctrie_take(struct ctrie *t, const char *key, void *out);
+bool ctrie_take_n(struct ctrie *t, const char *key, size_t len, void *out);
+
+/*
+ * Predicate for `ctrie_remove_if`. Called with the `data` of a key and the
+ * user-supplied `arg`.
  */
-void *ctrie_insert(struct ctrie *t, char *key, bool wildcard);
+typedef bool ctrie_pred_t(void *data, void *arg);
 
 /*
- * Remove `key` from `t`. If `key` is not found in `t`, do nothing.
+ * Remove `key` from `t` if `pred` returns true for its data. Return whether
+ * `key` was removed. The predicate is evaluated during the same descent which
+ * removes the key.
  */
-void ctrie_remove(struct ctrie *t, char *key);
+bool ctrie_remove_if(struct ctrie *t,
+                     const char *key,
+                     ctrie_pred_t *pred,
+                     void *arg);
+bool ctrie_remove_if_n(struct ctrie *t,
+                       const char *key,
+                       size_t len,
+                       ctrie_pred_t *pred,
+                       void *arg);
+
+/*
+ * Build a prefix hash index of `t`, which is then kept up to date as `t` is
+ * modified until `ctrie_index_free` or `ctrie_free` is called.
+ *
+ * The index maps the prefixes of the keys whose lengths are multiples of 16
+ * to the nodes they lead to. A lookup of a long key binary searches these
+ * prefixes and descends from the node of the longest one present, so that it
+ * visits a number of nodes which no longer grows with the length of the key.
+ * This helps long keys with long shared prefixes, such as URLs, at the cost of
+ * memory for the index and slower insertions. The index is not used for
+ * lookups in tries with wild-card keys, and not built for tries minimized by
+ * `ctrie_minimize`.
+ */
+void ctrie_index_init(struct ctrie *t);
+
+/*
+ * Drop the index of `t`, if any.
+ */
+void ctrie_index_free(struct ctrie *t);
+
+/*
+ * Put a cache of about `size` entries in front of the lookups of `t`, which is
+ * used until `ctrie_cache_free` or `ctrie_free` is called.
+ *
+ * The cache remembers the results of `ctrie_find` and `ctrie_contains` for
+ * keys of up to 52 bytes in a 4-way set-associative table, so that repeated
+ * lookups of hot keys cost a hash of the key and a comparison instead of a
+ * descent. Any modification of `t` invalidates all the entries, which makes
+ * the cache pay off only for workloads which mostly read.
+ *
+ * Lookups modify the cache, so concurrent lookups in a trie with a cache must
+ * be serialized.
+ */
+void ctrie_cache_init(struct ctrie *t, size_t size);
+
+/*
+ * Drop the cache of `t`, if any.
+ */
+void ctrie_cache_free(struct ctrie *t);
+
+/*
+ * Set `*hits` and `*misses` to the numbers of lookups which were and were not
+ * answered by the cache of `t`.
+ */
+void ctrie_cache_stats(struct ctrie *t, size_t *hits, size_t *misses);
+
+#ifdef CTRIE_HIST
+
+/*
+ * Operations whose latencies are recorded in builds with `CTRIE_HIST`
+ * defined. `ctrie_contains` counts as a find; `ctrie_upsert`, `ctrie_emplace`
+ * (without the `init` callback) and `ctrie_cursor_insert` as inserts; and
+ * `ctrie_take` and `ctrie_remove_prefix` as removals.
+ */
+enum ctrie_op
+{
+	CTRIE_OP_FIND,
+	CTRIE_OP_INSERT,
+	CTRIE_OP_REMOVE,
+	CTRIE_OP_ITER_NEXT,
+	CTRIE_OP_COUNT,
+};
+
+#define CTRIE_HIST_SUB_BITS 4
+#define CTRIE_HIST_SUB      (1 << CTRIE_HIST_SUB_BITS)
+#define CTRIE_HIST_BUCKETS  ((64 - CTRIE_HIST_SUB_BITS + 1) * CTRIE_HIST_SUB)
+
+/*
+ * Latency histograms of the operations, in ticks of the time stamp counter
+ * (`rdtsc`) on x86, in nanoseconds elsewhere.
+ *
+ * Each thread records the latencies of the operations it does, on any trie,
+ * into histograms of its own, which costs two reads of the time stamp counter
+ * and an increment per operation. Like in HDR histograms, every power of two
+ * is split into 16 buckets, so the values are exact below 16 and within 1/16
+ * above.
+ */
+struct ctrie_hist
+{
+	uint64_t count[CTRIE_OP_COUNT][CTRIE_HIST_BUCKETS]; /* counts of values */
+};
+
+/*
+ * Set `h` to the sum of the histograms of all threads, including those which
+ * exited, as of now. The counts of a thread exiting concurrently may be
+ * missed.
+ */
+void ctrie_hist_merge(struct ctrie_hist *h);
+
+/*
+ * Zero the histograms of all threads. Latencies recorded concurrently may be
+ * lost.
+ */
+void ctrie_hist_reset(void);
+
+/*
+ * Return the `p`-th percentile, `p` between 0 and 100, of the latencies of
+ * `op` in `h`, or 0 if there are none. The value returned is the largest one
+ * of its bucket.
+ */
+uint64_t ctrie_hist_percentile(const struct ctrie_hist *h,
+                               enum ctrie_op op,
+                               double p);
+
+/*
+ * Print the counts and percentiles of the latencies in `h` to `f`, along with
+ * an estimate of ticks per nanosecond, which takes a millisecond.
+ */
+void ctrie_hist_dump(const struct ctrie_hist *h, FILE *f);
+
+#endif
 
 /*
  * Print a textual representation of the trie. Useful for debugging only.
@@ -65,6 +343,25 @@ void ctrie_dump(struct ctrie *t);
  */
 void ctrie_free(struct ctrie *t);
 
+/*
+ * Write `t` to `f`. The nodes are written as they are laid out in the trie,
+ * so that `ctrie_load` can rebuild the trie without searching it. The stream
+ * may be piped through a compressor. Return 0 on success, otherwise return -1
+ * with `errno` set by the failed write.
+ */
+int ctrie_save(struct ctrie *t, FILE *f);
+
+/*
+ * Initialize `t` and load into it a trie written by `ctrie_save` from `f`.
+ * Every node is allocated once, at its final size, while reading `f`
+ * sequentially. Return 0 on success. Otherwise, return -1 and set `errno`
+ * (`EINVAL` if the stream is malformed or truncated); `t` is left
+ * uninitialized then. Lengths read from `f` are checked against what the
+ * stream actually holds before anything is allocated for them, so a corrupt
+ * stream fails with `EINVAL` rather than exhausting memory.
+ */
+int ctrie_load(struct ctrie *t, FILE *f);
+
 /*
  * A trie node iterator.
  */
@@ -108,4 +405,312 @@ struct ctnode *ctrie_iter_next(struct ctrie_iter *it,
  */
 void ctrie_iter_free(struct ctrie_iter *it);
 
+/*
+ * Return the data of node `n` of `t`, as returned by `ctrie_iter_next`.
+ */
+void *ctrie_node_data(struct ctrie *t, struct ctnode *n);
+
+/*
+ * Generic key callback. Called with a `key` of the trie, its `data` and the
+ * user-supplied `arg`. The `key` is only valid for the duration of the call.
+ */
+typedef void ctrie_cb_t(const char *key, void *data, void *arg);
+
+/*
+ * Callback for `ctrie_fuzzy`. Called with the matching `key`, its `data`, the
+ * edit distance `dist` of `key` from the query and the user-supplied `arg`.
+ * The `key` is only valid for the duration of the call.
+ */
+typedef void ctrie_fuzzy_cb_t(const char *key, void *data, size_t dist, void *arg);
+
+/*
+ * Call `cb` for each key of `t` whose Levenshtein distance from `key` is at
+ * most `max_dist`. Keys are reported in the same order as `ctrie_iter_next`
+ * would return them. Wild-card nodes are treated as ordinary keys.
+ *
+ * The trie is walked with one incremental DP row per key character and every
+ * subtree whose row minimum exceeds `max_dist` is pruned, so only a small
+ * fraction of the trie is visited for small distances.
+ */
+void ctrie_fuzzy(struct ctrie *t,
+                 const char *key,
+                 size_t max_dist,
+                 ctrie_fuzzy_cb_t *cb,
+                 void *arg);
+
+/*
+ * Call `cb` for each key of `t` matching the glob `pattern`, in the order in
+ * which `ctrie_iter_next` would return them. The following syntax is
+ * understood:
+ *
+ *   `*`          matches any (possibly empty) string
+ *   `?`          matches any single character
+ *   `[abc]`      matches any of the listed characters; ranges such as `a-z`
+ *                are allowed, `[!...]` or `[^...]` negates the class
+ *   `\c`         matches `c` literally
+ *
+ * An unterminated `[` is matched literally. Wild-card nodes are treated as
+ * ordinary keys.
+ *
+ * The pattern is compiled to a DFA (lazily, only the states which are reached
+ * are constructed) which is run along the trie. Subtrees reached in the dead
+ * state are pruned and the literal prefix of the pattern is used to descend
+ * into the trie directly.
+ */
+void ctrie_match(struct ctrie *t, const char *pattern, ctrie_cb_t *cb, void *arg);
+
+/*
+ * Aho-Corasick automaton built over a trie. Allows to find all occurrences
+ * of all keys of the trie in a text in a single pass over the text.
+ *
+ * The automaton refers to the nodes of the trie, which must not be modified
+ * until the automaton is freed.
+ */
+struct ctrie_ac
+{
+	struct ctrie *t;                 /* the trie */
+	struct ctrie_ac_state *states;   /* automaton states */
+	size_t nstates;                  /* number of states */
+	uint32_t *dense;                 /* transitions of shallow states */
+	size_t ndense;                   /* number of items in `dense` */
+	size_t state;                    /* current state of the scan */
+	size_t pos;                      /* number of bytes scanned so far */
+};
+
+/*
+ * Callback for `ctrie_scan`. Called for a key of length `len` whose
+ * occurrence ends at offset `end` of the scanned stream (i.e. the key
+ * starts at `end - len`) with the key's `data` and the user-supplied `arg`.
+ */
+typedef void ctrie_scan_cb_t(size_t end, size_t len, void *data, void *arg);
+
+/*
+ * Build the Aho-Corasick automaton `ac` for the keys of `t`. Wild-card nodes
+ * are treated as ordinary keys, the empty key is never reported. Return 0 on
+ * success. If the automaton would have more states than can be numbered in
+ * 32 bits, i.e. the keys of `t` have about 4 G label characters, return -1 and
+ * set `errno` to `EOVERFLOW`; `ac` needn't be freed then.
+ */
+int ctrie_ac_init(struct ctrie *t, struct ctrie_ac *ac);
+
+/*
+ * Feed `len` bytes of `text` to `ac` and call `cb` for every occurrence of a
+ * key of the trie which ends within `text`. The text is treated as a
+ * continuation of the text fed to `ac` previously (if any), so that a large
+ * text can be scanned in chunks. Occurrences ending at the same position are
+ * reported from the longest to the shortest.
+ */
+void ctrie_scan(struct ctrie_ac *ac,
+                const char *text,
+                size_t len,
+                ctrie_scan_cb_t *cb,
+                void *arg);
+
+/*
+ * Reset `ac` to the state it had after `ctrie_ac_init`.
+ */
+void ctrie_ac_reset(struct ctrie_ac *ac);
+
+/*
+ * Dispose `ac`.
+ */
+void ctrie_ac_free(struct ctrie_ac *ac);
+
+/*
+ * Callback for the set operations below. Called with a `key` of the result,
+ * the data of `key` in the first and second trie (`NULL` if `key` is not in
+ * the respective trie) and the user-supplied `arg`. The `key` is only valid
+ * for the duration of the call.
+ */
+typedef void ctrie_merge_cb_t(const char *key,
+                              void *data_a,
+                              void *data_b,
+                              void *arg);
+
+/*
+ * Call `cb` for each key which is in `a` or in `b`.
+ *
+ * All set operations walk both tries at once, merging the child arrays and
+ * aligning the labels, so that they only visit the parts of the tries which
+ * contribute to the result, plus the paths leading to them. The keys are
+ * reported in the order in which `ctrie_iter_next` would return them.
+ * Wild-card nodes are treated as ordinary keys.
+ */
+void ctrie_union(struct ctrie *a, struct ctrie *b, ctrie_merge_cb_t *cb, void *arg);
+
+/*
+ * Call `cb` for each key which is both in `a` and in `b`.
+ */
+void ctrie_intersect(struct ctrie *a, struct ctrie *b, ctrie_merge_cb_t *cb, void *arg);
+
+/*
+ * Call `cb` for each key which is in `a`, but not in `b`.
+ */
+void ctrie_diff(struct ctrie *a, struct ctrie *b, ctrie_merge_cb_t *cb, void *arg);
+
+/*
+ * A cursor (finger) into a trie. The cursor remembers the path to the node
+ * reached by the last operation and the key used. The next operation starts
+ * from the deepest node on that path which is shared with the new key, so that
+ * on sorted or otherwise locality-heavy key streams only the suffix of each
+ * key in which it differs from the previous one needs to be walked.
+ *
+ * The cursor may be used together with direct modifications of the trie,
+ * it notices them and starts from the root again.
+ */
+struct ctrie_cursor
+{
+	struct ctrie *t;                   /* the trie */
+	size_t gen;                        /* `t->gen` the `path` is valid for */
+	struct ctrie_cursor_ent *path;     /* root-to-node path */
+	size_t path_size;                  /* size of the `path` array */
+	size_t npath;                      /* number of entries in `path` */
+	char *key;                         /* key of the last operation */
+	size_t key_size;                   /* size of the `key` array */
+};
+
+/*
+ * Initialize the cursor `c` into trie `t`.
+ */
+void ctrie_cursor_init(struct ctrie *t, struct ctrie_cursor *c);
+
+/*
+ * Like `ctrie_find`, but use and update cursor `c`.
+ */
+void *ctrie_cursor_find(struct ctrie_cursor *c, const char *key);
+
+/*
+ * Like `ctrie_insert`, but use and update cursor `c`.
+ */
+void *ctrie_cursor_insert(struct ctrie_cursor *c, const char *key, bool wildcard);
+
+/*
+ * Dispose `c`.
+ */
+void ctrie_cursor_free(struct ctrie_cursor *c);
+
+/*
+ * A builder of a trie out of sorted keys. The nodes are built bottom-up, each
+ * once all of its children are known, so they are allocated at their final
+ * sizes and never resized or split, and only the path of the last key added
+ * is kept aside. This is several times faster than inserting the keys.
+ */
+struct ctrie_builder
+{
+	struct ctrie *t;                      /* the trie being built */
+	char *key;                            /* the previous key */
+	size_t key_len;                       /* length of `key` */
+	size_t key_size;                      /* size of the `key` array */
+	struct ctrie_builder_ent *path;       /* unbuilt nodes on the path of `key` */
+	size_t npath;                         /* number of entries in `path` */
+	size_t path_size;                     /* size of the `path` array */
+	struct ctrie_builder_child *children; /* built children of the `path` nodes */
+	size_t nchildren;                     /* number of entries in `children` */
+	size_t children_size;                 /* size of the `children` array */
+	unsigned char *data;                  /* data of the `path` nodes */
+};
+
+/*
+ * Initialize builder `b` of trie `t`, which must be empty. The keys added to
+ * `b` become part of `t` by `ctrie_builder_finish`, `t` must not be used
+ * until then. Return 0 on success, or -1 and set `errno` to `EINVAL` if `t`
+ * is not empty.
+ */
+int ctrie_builder_init(struct ctrie *t, struct ctrie_builder *b);
+
+/*
+ * Add the `len` characters at `key` to the trie of `b`, like `ctrie_insert_n`,
+ * and set their data to the `t->data_size` bytes at `data`, unless `data` is
+ * `NULL`. The keys must be added in the order of `memcmp(3)`; adding a key
+ * again only updates it.
+ *
+ * Return 0 on success. If `key` is empty, holds a NUL byte or sorts before the
+ * previous key, return -1 and set `errno` to `EINVAL`; `b` may still be used
+ * then.
+ */
+int ctrie_builder_add(struct ctrie_builder *b,
+                      const char *key,
+                      size_t len,
+                      bool wildcard,
+                      const void *data);
+
+/*
+ * Build the rest of the trie of `b` and dispose `b`.
+ */
+void ctrie_builder_finish(struct ctrie_builder *b);
+
+/*
+ * Insert the `n` NUL-terminated `keys`, which need not be sorted, into the
+ * empty trie `t`, using up to `threads` threads, or one per online CPU if
+ * `threads` is not positive. The data of the keys is zeroed.
+ *
+ * The keys are partitioned by their first character following the prefix
+ * which all of them share, and the subtree of every partition is sorted and
+ * built by a `ctrie_builder` on one of the threads. The threads allocate the
+ * nodes independently, also in `CTRIE_REF32` builds, whose arenas are merged
+ * when the threads are done. Partitions are handed out largest first, but
+ * keys which mostly share the character after the common prefix still leave
+ * most of the work to a single thread.
+ *
+ * Return 0 on success. If `t` is not empty or a key is empty, return -1 and
+ * set `errno` to `EINVAL`.
+ */
+int ctrie_build_parallel(struct ctrie *t,
+                         const char *const *keys,
+                         size_t n,
+                         int threads);
+
+/*
+ * Minimize `t` into a directed acyclic word graph: subtrees which are equal,
+ * such as the ones holding the common endings of the words of a natural
+ * language, are replaced by a single shared copy, and nodes are shrunk to the
+ * number of their children.
+ *
+ * `t` becomes frozen. It may still be searched and iterated, but insertions
+ * and removals which would change it fail with `EPERM`. Its prefix index, if
+ * any, is dropped and `ctrie_index_init` does nothing; `ctrie_save` writes the
+ * keys as if `t` was not minimized.
+ *
+ * Only tries without data may be minimized, as the data of the keys would
+ * make their subtrees differ. Return 0 on success. If `t->data_size` is not
+ * zero, return -1 and set `errno` to `EINVAL`.
+ */
+int ctrie_minimize(struct ctrie *t);
+
+/*
+ * Minimize `t` like `ctrie_minimize` and number its words: the number, or ID,
+ * of a word is its rank in the order of `ctrie_iter_next`, so the IDs of the
+ * `*nwords` words of `t` are `0` to `*nwords - 1`. Values of the words can
+ * then be kept in an array indexed by ID instead of in the nodes.
+ *
+ * Every node with children stores the number of words preceding each of its
+ * children in its subtree as a 32-bit integer, and the ID of a key is summed
+ * up from these as it's looked up.
+ *
+ * Return 0 on success. If `t->data_size` is not zero or `t` has already been
+ * minimized by `ctrie_minimize`, return -1 and set `errno` to `EINVAL`. If `t`
+ * holds more than `UINT32_MAX` words, return -1 and set `errno` to
+ * `EOVERFLOW`. `t` is left alone on errors.
+ */
+int ctrie_number(struct ctrie *t, size_t *nwords);
+
+/*
+ * Find `key` in the trie `t` numbered by `ctrie_number` like `ctrie_find`, and
+ * store the ID of the word found, which may be a wild-card prefix of `key`,
+ * into `*id`. Return whether there's one.
+ */
+bool ctrie_word_id(struct ctrie *t, const char *key, size_t *id);
+bool ctrie_word_id_n(struct ctrie *t, const char *key, size_t len, size_t *id);
+
+/*
+ * Store the word with ID `id` of the trie `t` numbered by `ctrie_number` into
+ * `*key`, which is allocated or grown as by `ctrie_iter_next`. Return `false`
+ * if there's no such word.
+ */
+bool ctrie_id_to_key(struct ctrie *t, size_t id, char **key, size_t *key_size);
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif
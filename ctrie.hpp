@@ -0,0 +1,444 @@
+/*
+ * C++ interface to the compressed trie. Header-only, requires C++17.
+ *
+ * `ctrie::map<T>` maps non-empty keys, which cannot contain NUL bytes, to
+ * values of type `T`. Values are constructed in place in the trie nodes when
+ * inserted and destroyed when erased or when the map is destroyed.
+ */
+
+#ifndef CTRIE_HPP
+#define CTRIE_HPP
+
+#include "ctrie.h"
+#include <cstddef>
+#include <cstdlib>
+#include <exception>
+#include <iterator>
+#include <memory>
+#include <new>
+#include <optional>
+#include <stdexcept>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+
+#if __cplusplus >= 202002L
+#include <span>
+#endif
+
+/*
+ * Overloads of the C interface taking `std::string_view` keys. Keys holding
+ * NUL bytes are treated like by the `_n` functions.
+ */
+inline void *ctrie_find(::ctrie *t, std::string_view key)
+{
+	return ctrie_find_n(t, key.data(), key.size());
+}
+
+inline bool ctrie_contains(::ctrie *t, std::string_view key)
+{
+	return ctrie_contains_n(t, key.data(), key.size());
+}
+
+inline void *ctrie_insert(::ctrie *t, std::string_view key, bool wildcard)
+{
+	return ctrie_insert_n(t, key.data(), key.size(), wildcard);
+}
+
+inline void ctrie_remove(::ctrie *t, std::string_view key)
+{
+	ctrie_remove_n(t, key.data(), key.size());
+}
+
+/*
+ * Can values of type `T` be moved around in memory by `memmove(3)`? The trie
+ * reallocates nodes as it changes, moving the data along, so values of types
+ * which are not relocatable are stored boxed, i.e. allocated separately and
+ * referred to by a pointer.
+ *
+ * Specialize this for types which are relocatable even though they are not
+ * trivially copyable to have them stored in the nodes directly.
+ */
+template<typename T>
+struct ctrie::is_relocatable : std::is_trivially_copyable<T> {};
+
+namespace ctrie_detail {
+
+/*
+ * Storage of a value of type `T` in the data of a trie node.
+ */
+template<typename T, bool Inline = ctrie::is_relocatable<T>::value
+                                   && alignof(T) <= alignof(void *)>
+struct slot
+{
+	static constexpr size_t size = sizeof(T);
+	static constexpr bool trivial = std::is_trivially_destructible_v<T>;
+
+	template<typename... Args>
+	static void construct(void *p, Args &&...args)
+	{
+		new (p) T(std::forward<Args>(args)...);
+	}
+
+	static T &get(void *p)
+	{
+		return *std::launder(static_cast<T *>(p));
+	}
+
+	static void destroy(void *p)
+	{
+		get(p).~T();
+	}
+};
+
+template<typename T>
+struct slot<T, false>
+{
+	static constexpr size_t size = sizeof(T *);
+	static constexpr bool trivial = false;
+
+	template<typename... Args>
+	static void construct(void *p, Args &&...args)
+	{
+		*static_cast<T **>(p) = new T(std::forward<Args>(args)...);
+	}
+
+	static T &get(void *p)
+	{
+		return **static_cast<T **>(p);
+	}
+
+	static void destroy(void *p)
+	{
+		delete *static_cast<T **>(p);
+	}
+};
+
+#if __cplusplus >= 202002L
+inline std::string_view as_key(std::span<const std::byte> key)
+{
+	return { reinterpret_cast<const char *>(key.data()), key.size() };
+}
+#endif
+
+} /* namespace ctrie_detail */
+
+template<typename T>
+class ctrie::map
+{
+	using slot = ctrie_detail::slot<T>;
+
+public:
+	/*
+	 * Input iterator over the keys and values of a map, in the order of
+	 * `ctrie_iter_next`. Dereferences to a pair of the key, which is valid
+	 * until the iterator is advanced, and a reference to the value. Copies of
+	 * an iterator share the iteration state, so advancing one of them
+	 * invalidates the others.
+	 *
+	 * The map must not be modified while iterating.
+	 */
+	template<typename V>
+	class basic_iterator
+	{
+	public:
+		using iterator_category = std::input_iterator_tag;
+		using value_type = std::pair<std::string_view, V &>;
+		using difference_type = std::ptrdiff_t;
+		using pointer = void;
+		using reference = value_type;
+
+		basic_iterator() = default;
+
+		value_type operator*() const
+		{
+			return { s_->key, slot::get(ctrie_node_data(s_->it.t, n_)) };
+		}
+
+		basic_iterator &operator++()
+		{
+			n_ = ctrie_iter_next(&s_->it, &s_->key, &s_->key_size);
+			if (!n_)
+				s_.reset();
+			return *this;
+		}
+
+		bool operator==(const basic_iterator &o) const
+		{
+			return n_ == o.n_;
+		}
+
+		bool operator!=(const basic_iterator &o) const
+		{
+			return n_ != o.n_;
+		}
+
+	private:
+		friend class map;
+
+		struct state
+		{
+			::ctrie_iter it;
+			char *key = nullptr;
+			size_t key_size = 0;
+
+			~state()
+			{
+				ctrie_iter_free(&it);
+				std::free(key);
+			}
+		};
+
+		explicit basic_iterator(::ctrie *t)
+			: s_(std::make_shared<state>())
+		{
+			ctrie_iter_init(t, &s_->it);
+			++*this;
+		}
+
+		std::shared_ptr<state> s_;
+		::ctnode *n_ = nullptr;
+	};
+
+	using iterator = basic_iterator<T>;
+	using const_iterator = basic_iterator<const T>;
+
+	map()
+	{
+		ctrie_init(&t_, slot::size);
+	}
+
+	map(const map &) = delete;
+	map &operator=(const map &) = delete;
+
+	/*
+	 * Take over the contents of `o`, which is left empty.
+	 */
+	map(map &&o) noexcept
+		: t_(o.t_), size_(o.size_)
+	{
+		ctrie_init(&o.t_, slot::size);
+		o.size_ = 0;
+	}
+
+	map &operator=(map &&o) noexcept
+	{
+		if (this != &o) {
+			destroy();
+			t_ = o.t_;
+			size_ = o.size_;
+			ctrie_init(&o.t_, slot::size);
+			o.size_ = 0;
+		}
+		return *this;
+	}
+
+	~map()
+	{
+		destroy();
+	}
+
+	size_t size() const
+	{
+		return size_;
+	}
+
+	bool empty() const
+	{
+		return !size_;
+	}
+
+	/*
+	 * Return a pointer to the value of `key`, or `nullptr` if there's none.
+	 */
+	T *find(std::string_view key)
+	{
+		void *d = ctrie_find(&t_, key);
+		return d ? &slot::get(d) : nullptr;
+	}
+
+	const T *find(std::string_view key) const
+	{
+		return const_cast<map *>(this)->find(key);
+	}
+
+	bool contains(std::string_view key) const
+	{
+		return find(key) != nullptr;
+	}
+
+	/*
+	 * Insert `key` with a value constructed from `args`, unless `key` is
+	 * already present. Return a pointer to the value of `key` and whether
+	 * it was inserted. Throw `std::invalid_argument` if `key` is empty or
+	 * holds a NUL byte.
+	 */
+	template<typename... Args>
+	std::pair<T *, bool> emplace(std::string_view key, Args &&...args)
+	{
+		if (key.empty())
+			throw std::invalid_argument("ctrie::map: empty key");
+		bool inserted;
+		void *d = ctrie_upsert_n(&t_, key.data(), key.size(), &inserted);
+		if (!d)
+			throw std::invalid_argument("ctrie::map: NUL byte in key");
+		if (!inserted)
+			return { &slot::get(d), false };
+		try {
+			slot::construct(d, std::forward<Args>(args)...);
+		} catch (...) {
+			ctrie_remove(&t_, key);
+			throw;
+		}
+		size_++;
+		return { &slot::get(d), true };
+	}
+
+	/*
+	 * Return the value of `key`, inserting a value-initialized one if `key`
+	 * is not present.
+	 */
+	T &operator[](std::string_view key)
+	{
+		return *emplace(key).first;
+	}
+
+	/*
+	 * Remove `key` and destroy its value. Return whether `key` was present.
+	 */
+	bool erase(std::string_view key)
+	{
+		auto destroy = [](void *d, void *) {
+			slot::destroy(d);
+			return true;
+		};
+		if (!ctrie_remove_if_n(&t_, key.data(), key.size(), destroy, nullptr))
+			return false;
+		size_--;
+		return true;
+	}
+
+	/*
+	 * Remove `key` and return its value, or nothing if `key` was not present.
+	 * If moving the value out throws, `key` is kept and the exception is
+	 * rethrown.
+	 */
+	std::optional<T> take(std::string_view key)
+	{
+		struct out
+		{
+			std::optional<T> v;
+			std::exception_ptr e;
+		} o;
+		/* the exception can't cross the C code, it's passed around it */
+		auto take = [](void *d, void *arg) {
+			out *o = static_cast<out *>(arg);
+			try {
+				o->v.emplace(std::move(slot::get(d)));
+			} catch (...) {
+				o->e = std::current_exception();
+				return false;
+			}
+			slot::destroy(d);
+			return true;
+		};
+		if (ctrie_remove_if_n(&t_, key.data(), key.size(), take, &o))
+			size_--;
+		if (o.e)
+			std::rethrow_exception(o.e);
+		return std::move(o.v);
+	}
+
+#if __cplusplus >= 202002L
+	/*
+	 * Overloads taking the key as bytes.
+	 */
+	T *find(std::span<const std::byte> key)
+	{
+		return find(ctrie_detail::as_key(key));
+	}
+
+	const T *find(std::span<const std::byte> key) const
+	{
+		return find(ctrie_detail::as_key(key));
+	}
+
+	bool contains(std::span<const std::byte> key) const
+	{
+		return contains(ctrie_detail::as_key(key));
+	}
+
+	template<typename... Args>
+	std::pair<T *, bool> emplace(std::span<const std::byte> key,
+	                             Args &&...args)
+	{
+		return emplace(ctrie_detail::as_key(key),
+		               std::forward<Args>(args)...);
+	}
+
+	T &operator[](std::span<const std::byte> key)
+	{
+		return (*this)[ctrie_detail::as_key(key)];
+	}
+
+	bool erase(std::span<const std::byte> key)
+	{
+		return erase(ctrie_detail::as_key(key));
+	}
+#endif
+
+	/*
+	 * Remove all keys.
+	 */
+	void clear()
+	{
+		destroy();
+		ctrie_init(&t_, slot::size);
+		size_ = 0;
+	}
+
+	iterator begin()
+	{
+		return iterator(&t_);
+	}
+
+	iterator end()
+	{
+		return iterator();
+	}
+
+	const_iterator begin() const
+	{
+		return const_iterator(const_cast<::ctrie *>(&t_));
+	}
+
+	const_iterator end() const
+	{
+		return const_iterator();
+	}
+
+	/*
+	 * The underlying C trie, e.g. for use with `ctrie_fuzzy`. The data
+	 * pointers it hands out point to the slots of the values, which hold
+	 * a `T *` instead of a `T` for boxed types.
+	 */
+	::ctrie *c_trie()
+	{
+		return &t_;
+	}
+
+private:
+	void destroy()
+	{
+		if constexpr (!slot::trivial) {
+			for (iterator it = begin(); it != end(); ++it)
+				slot::destroy(ctrie_node_data(&t_, it.n_));
+		}
+		ctrie_free(&t_);
+	}
+
+	::ctrie t_;
+	size_t size_ = 0;
+};
+
+#endif
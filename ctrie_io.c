@@ -0,0 +1,538 @@
+#include "ctrie_io.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#define MAX(a, b)      ((a) >= (b) ? (a) : (b))
+
+#define LOG_NAME       "log"
+#define CKPT_NAME      "checkpoint"
+#define CKPT_TMP_NAME  "checkpoint.tmp"
+#define BATCH_HDR_SIZE 8
+#define VARINT_MAX     10
+
+typedef unsigned char  byte_t;
+
+/*
+ * Record operations. A record is the operation byte, the varint length of the
+ * key, the key and, with `OP_DATA`, `t->data_size` bytes of data.
+ */
+enum
+{
+	OP_INSERT = 1 << 0, /* insert the key */
+	OP_REMOVE = 1 << 1, /* remove the key */
+	OP_WILD   = 1 << 2, /* insert the key as a wild-card */
+	OP_DATA   = 1 << 3, /* the record carries the data of the key */
+};
+
+static void *xrealloc(void *ptr, size_t size)
+{
+	ptr = realloc(ptr, size);
+	if (!ptr) {
+		perror("realloc");
+		abort();
+	}
+	return ptr;
+}
+
+/*
+ * Ensure that the array `buf` of capacity `*size` can hold `len + n` bytes.
+ */
+static byte_t *reserve(byte_t *buf, size_t *size, size_t len, size_t n)
+{
+	if (len + n > *size) {
+		*size = MAX(len + n, 2 * *size);
+		buf = xrealloc(buf, *size);
+	}
+	return buf;
+}
+
+static uint32_t crc_table[256];
+
+/*
+ * CRC-32 (IEEE 802.3) of the `len` bytes at `p`.
+ */
+static uint32_t crc32(const byte_t *p, size_t len)
+{
+	if (!crc_table[1]) {
+		for (uint32_t i = 0; i < 256; i++) {
+			uint32_t c = i;
+			for (size_t k = 0; k < 8; k++)
+				c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+			crc_table[i] = c;
+		}
+	}
+	uint32_t c = 0xffffffff;
+	for (size_t i = 0; i < len; i++)
+		c = crc_table[(c ^ p[i]) & 0xff] ^ (c >> 8);
+	return c ^ 0xffffffff;
+}
+
+static void put_u32(byte_t *p, uint32_t v)
+{
+	for (size_t i = 0; i < 4; i++)
+		p[i] = v >> (8 * i);
+}
+
+static uint32_t get_u32(const byte_t *p)
+{
+	uint32_t v = 0;
+	for (size_t i = 0; i < 4; i++)
+		v |= (uint32_t)p[i] << (8 * i);
+	return v;
+}
+
+/*
+ * Store `v` at `p` in LEB128 and return the number of bytes used.
+ */
+static size_t put_varint(byte_t *p, uint64_t v)
+{
+	size_t n = 0;
+	for (; v >= 0x80; v >>= 7)
+		p[n++] = v | 0x80;
+	p[n++] = v;
+	return n;
+}
+
+/*
+ * Decode a LEB128 number from `*p`, which must be below `end`, into `*v` and
+ * advance `*p` past it. Return false if it's truncated or too long.
+ */
+static bool get_varint(const byte_t **p, const byte_t *end, uint64_t *v)
+{
+	*v = 0;
+	for (size_t shift = 0; *p < end && shift < 64; shift += 7) {
+		byte_t b = *(*p)++;
+		*v |= (uint64_t)(b & 0x7f) << shift;
+		if (!(b & 0x80))
+			return true;
+	}
+	return false;
+}
+
+/*
+ * Append a record of operation `op` on the `len` bytes of `key` to the array
+ * `buf` holding `*buf_len` bytes. Return the (possibly reallocated) array.
+ */
+static byte_t *put_record(byte_t *buf,
+                          size_t *buf_len,
+                          size_t *buf_size,
+                          int op,
+                          const char *key,
+                          size_t len,
+                          const void *data,
+                          size_t data_size)
+{
+	size_t n = *buf_len;
+	buf = reserve(buf, buf_size, n, 1 + VARINT_MAX + len + data_size);
+	buf[n++] = op;
+	n += put_varint(buf + n, len);
+	memcpy(buf + n, key, len);
+	n += len;
+	if (op & OP_DATA) {
+		memcpy(buf + n, data, data_size);
+		n += data_size;
+	}
+	*buf_len = n;
+	return buf;
+}
+
+/*
+ * Write all the `iovcnt` buffers of `iov` to `fd`, retrying short writes.
+ */
+static int write_all(int fd, struct iovec *iov, int iovcnt)
+{
+	while (iovcnt) {
+		ssize_t n = writev(fd, iov, iovcnt);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		for (; iovcnt && (size_t)n >= iov->iov_len; iov++, iovcnt--)
+			n -= iov->iov_len;
+		if (iovcnt) {
+			iov->iov_base = (byte_t *)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Write the `len` bytes of records at `buf` to `fd` as a batch: the length of
+ * the records and their checksum, followed by the records.
+ */
+static int write_batch(int fd, byte_t *buf, size_t len)
+{
+	byte_t hdr[BATCH_HDR_SIZE];
+	assert(len <= UINT32_MAX);
+	put_u32(hdr, len);
+	put_u32(hdr + 4, crc32(buf, len));
+	struct iovec iov[] = {
+		{ hdr, sizeof(hdr) },
+		{ buf, len },
+	};
+	return write_all(fd, iov, 2);
+}
+
+/*
+ * Apply the `len` bytes of records at `p` to `t`. Return false if they are
+ * malformed.
+ */
+static bool apply_records(struct ctrie *t, const byte_t *p, size_t len)
+{
+	const byte_t *end = p + len;
+	while (p < end) {
+		int op = *p++;
+		uint64_t klen;
+		if (!get_varint(&p, end, &klen) || klen > (size_t)(end - p))
+			return false;
+		const char *key = (const char *)p;
+		p += klen;
+		if (op & OP_REMOVE) {
+			ctrie_remove_n(t, key, klen);
+			continue;
+		}
+		if (!(op & OP_INSERT) || !klen)
+			return false;
+		if ((op & OP_DATA) && t->data_size > (size_t)(end - p))
+			return false;
+		void *d = ctrie_insert_n(t, key, klen, op & OP_WILD);
+		if (op & OP_DATA) {
+			memcpy(d, p, t->data_size);
+			p += t->data_size;
+		}
+	}
+	return true;
+}
+
+/*
+ * Apply the batches in the `len` bytes at `buf` to `t`. Stop at the first
+ * batch which is incomplete or whose checksum doesn't match, and return the
+ * number of bytes of the batches applied.
+ */
+static size_t apply_batches(struct ctrie *t, const byte_t *buf, size_t len)
+{
+	size_t off = 0;
+	while (len - off >= BATCH_HDR_SIZE) {
+		size_t n = get_u32(buf + off);
+		const byte_t *p = buf + off + BATCH_HDR_SIZE;
+		if (n > len - off - BATCH_HDR_SIZE || crc32(p, n) != get_u32(buf + off + 4))
+			break;
+		if (!apply_records(t, p, n))
+			break;
+		off += BATCH_HDR_SIZE + n;
+	}
+	return off;
+}
+
+/*
+ * Read the file `name` in directory `dir` into `*buf`, which is allocated
+ * using `malloc(3)`, and set `*len` to its length. A missing file is read as
+ * an empty one. Return 0 on success, otherwise return -1 and set `errno`.
+ */
+static int read_file(int dir, const char *name, byte_t **buf, size_t *len)
+{
+	struct stat st;
+	*buf = NULL;
+	*len = 0;
+	int fd = openat(dir, name, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return errno == ENOENT ? 0 : -1;
+	if (fstat(fd, &st))
+		goto err;
+	*buf = xrealloc(NULL, st.st_size + 1);
+	while (*len < (size_t)st.st_size) {
+		ssize_t n = read(fd, *buf + *len, st.st_size - *len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			goto err;
+		if (!n)
+			break;
+		*len += n;
+	}
+	close(fd);
+	return 0;
+err:
+	close(fd);
+	free(*buf);
+	*buf = NULL;
+	return -1;
+}
+
+/*
+ * Load the checkpoint in `dir`, written by `ctrie_save`, into `t` and set
+ * `*found` to whether there's one.
+ */
+static int load_checkpoint(struct ctrie *t, int dir, bool *found)
+{
+	struct ctrie c;
+	*found = false;
+	int fd = openat(dir, CKPT_NAME, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return errno == ENOENT ? 0 : -1;
+	FILE *f = fdopen(fd, "r");
+	if (!f) {
+		close(fd);
+		return -1;
+	}
+	*found = true;
+	int ret = ctrie_load(&c, f);
+	if (!ret && (getc(f) != EOF || c.data_size != t->data_size)) {
+		ctrie_free(&c);
+		errno = EINVAL;
+		ret = -1;
+	}
+	fclose(f);
+	if (!ret) {
+		/* take over the nodes, keeping the index, cache and stats of `t` */
+		struct ctnode *fake_root = t->fake_root;
+		struct ctrie_arena *arena = t->arena;
+		t->fake_root = c.fake_root;
+		t->arena = c.arena;
+		c.fake_root = fake_root;
+		c.arena = arena;
+		ctrie_free(&c);
+		t->gen++;
+		if (t->index) {
+			ctrie_index_free(t);
+			ctrie_index_init(t);
+		}
+	}
+	return ret;
+}
+
+int ctrie_wal_open(struct ctrie_wal *w, struct ctrie *t, const char *dir)
+{
+	byte_t *buf;
+	size_t len;
+	bool found;
+	*w = (struct ctrie_wal) {
+		.t = t,
+		.dir = -1,
+		.fd = -1,
+		.batch_size = CTRIE_WAL_BATCH_SIZE,
+	};
+	if (!ctrie_empty(t) || t->frozen) {
+		errno = EINVAL;
+		return -1;
+	}
+	if ((w->dir = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+		return -1;
+	if (load_checkpoint(t, w->dir, &found))
+		goto err;
+	w->fd = openat(w->dir, LOG_NAME, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+	if (w->fd < 0 || read_file(w->dir, LOG_NAME, &buf, &len))
+		goto err;
+	w->log_size = apply_batches(t, buf, len);
+	free(buf);
+	if (w->log_size < len) { /* drop the torn batch */
+		if (ftruncate(w->fd, w->log_size) || fdatasync(w->fd))
+			goto err;
+	}
+	/* without a checkpoint, the data size of the log is not recorded */
+	if (!found && ctrie_wal_checkpoint(w))
+		goto err;
+	return 0;
+err:
+	ctrie_wal_close(w);
+	return -1;
+}
+
+void *ctrie_wal_insert_n(struct ctrie_wal *w,
+                         const char *key,
+                         size_t len,
+                         bool wildcard,
+                         const void *data)
+{
+	struct ctrie *t = w->t;
+	int op = OP_INSERT | (wildcard ? OP_WILD : 0) | (data ? OP_DATA : 0);
+	void *d = ctrie_insert_n(t, key, len, wildcard);
+	if (!d)
+		return NULL; /* a NUL byte in `key`, or `t` is frozen */
+	if (data)
+		memcpy(d, data, t->data_size);
+	w->buf = put_record(w->buf, &w->len, &w->buf_size, op, key, len,
+		data, t->data_size);
+	if (w->len >= w->batch_size && ctrie_wal_commit(w))
+		return NULL;
+	return d;
+}
+
+void *ctrie_wal_insert(struct ctrie_wal *w,
+                       const char *key,
+                       bool wildcard,
+                       const void *data)
+{
+	return ctrie_wal_insert_n(w, key, strlen(key), wildcard, data);
+}
+
+int ctrie_wal_remove_n(struct ctrie_wal *w, const char *key, size_t len)
+{
+	if (w->t->frozen) {
+		errno = EPERM;
+		return -1;
+	}
+	ctrie_remove_n(w->t, key, len);
+	w->buf = put_record(w->buf, &w->len, &w->buf_size, OP_REMOVE, key, len,
+		NULL, 0);
+	if (w->len >= w->batch_size)
+		return ctrie_wal_commit(w);
+	return 0;
+}
+
+int ctrie_wal_remove(struct ctrie_wal *w, const char *key)
+{
+	return ctrie_wal_remove_n(w, key, strlen(key));
+}
+
+int ctrie_wal_commit(struct ctrie_wal *w)
+{
+	if (!w->len)
+		return 0;
+	if (write_batch(w->fd, w->buf, w->len) || fdatasync(w->fd)) {
+		/* the log may end with a part of the batch, drop it */
+		int err = errno;
+		if (!ftruncate(w->fd, w->log_size))
+			errno = err;
+		return -1;
+	}
+	w->log_size += BATCH_HDR_SIZE + w->len;
+	w->len = 0;
+	return 0;
+}
+
+/*
+ * The checkpoint is written aside and renamed over the previous one, then the
+ * log is emptied. Should we crash in between, recovery replays the log over
+ * the new checkpoint, which already reflects it. That's harmless: every record
+ * sets or removes a key regardless of its state, so replaying a sequence of
+ * records twice leaves each key as replaying it once does.
+ */
+int ctrie_wal_checkpoint(struct ctrie_wal *w)
+{
+	if (ctrie_wal_commit(w))
+		return -1;
+	int fd = openat(w->dir, CKPT_TMP_NAME,
+		O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	if (fd < 0)
+		return -1;
+	FILE *f = fdopen(fd, "w");
+	if (!f || ctrie_save(w->t, f) || fflush(f) || fdatasync(fd)) {
+		int err = errno;
+		if (f)
+			fclose(f);
+		else
+			close(fd);
+		unlinkat(w->dir, CKPT_TMP_NAME, 0);
+		errno = err;
+		return -1;
+	}
+	if (fclose(f)) {
+		int err = errno;
+		unlinkat(w->dir, CKPT_TMP_NAME, 0);
+		errno = err;
+		return -1;
+	}
+	if (renameat(w->dir, CKPT_TMP_NAME, w->dir, CKPT_NAME))
+		return -1;
+	/*
+	 * The checkpoint is committed: whichever of the two checkpoints
+	 * recovery finds, the log brings it up to date. The log may only be
+	 * emptied once the rename is durable, and if that fails, it's merely
+	 * replayed once more.
+	 */
+	if (!fsync(w->dir) && !ftruncate(w->fd, 0)) {
+		w->log_size = 0;
+		fdatasync(w->fd);
+	}
+	return 0;
+}
+
+int ctrie_wal_close(struct ctrie_wal *w)
+{
+	int ret = 0;
+	if (w->fd >= 0) {
+		ret = ctrie_wal_commit(w);
+		close(w->fd);
+	}
+	if (w->dir >= 0)
+		close(w->dir);
+	free(w->buf);
+	w->buf = NULL;
+	w->fd = w->dir = -1;
+	return ret;
+}
+
+/*
+ * The lines are parsed in place in the mapping, `memchr(3)` finding the line
+ * ends many bytes at a time. The keys go to a builder as long as they come in
+ * order, so that sorted files are loaded without any node being resized; once
+ * a key is out of order, the keys so far are built and the rest is inserted.
+ */
+int ctrie_load_lines(struct ctrie *t, const char *path, int flags)
+{
+	struct stat st;
+	if (t->frozen) {
+		errno = EPERM;
+		return -1;
+	}
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &st)) {
+		close(fd);
+		return -1;
+	}
+	if (!st.st_size) {
+		close(fd);
+		return 0;
+	}
+	const char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	int err = errno;
+	close(fd);
+	if (map == MAP_FAILED) {
+		errno = err;
+		return -1;
+	}
+	madvise((void *)map, st.st_size, MADV_SEQUENTIAL);
+	const char *p = map, *end = map + st.st_size;
+	if (memchr(map, '\0', st.st_size)) { /* keys can't hold NUL bytes */
+		munmap((void *)map, st.st_size);
+		errno = EINVAL;
+		return -1;
+	}
+
+	struct ctrie_builder b;
+	bool sorted = !ctrie_builder_init(t, &b);
+	bool wildcard = flags & CTRIE_LINES_WILDCARD;
+	while (p < end) {
+		const char *nl = memchr(p, '\n', end - p);
+		if (!nl)
+			nl = end;
+		size_t len = nl - p;
+		if ((flags & CTRIE_LINES_CRLF) && len && p[len - 1] == '\r')
+			len--;
+		if (len && sorted && ctrie_builder_add(&b, p, len, wildcard, NULL)) {
+			ctrie_builder_finish(&b);
+			sorted = false;
+		}
+		if (len && !sorted)
+			ctrie_insert_n(t, p, len, wildcard);
+		p = nl + 1;
+	}
+	if (sorted)
+		ctrie_builder_finish(&b);
+	munmap((void *)map, st.st_size);
+	return 0;
+}
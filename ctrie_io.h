@@ -0,0 +1,148 @@
+/*
+ * Durability for the compressed trie: a write-ahead log of modifications and
+ * periodic checkpoints of the whole trie. Also loading of key files. Requires
+ * POSIX.
+ *
+ * A trie is persisted to a directory holding two files: `checkpoint`, a
+ * snapshot of the trie, and `log`, the modifications done since. Recovery
+ * loads the checkpoint and replays the log, so the time it takes depends on
+ * the size of the trie at the last checkpoint and on the churn since, not on
+ * how the trie was built.
+ */
+
+#ifndef CTRIE_IO_H
+#define CTRIE_IO_H
+
+#include "ctrie.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Write-ahead log of a trie.
+ *
+ * Modifications done through the log are applied to the trie at once, but
+ * their records are only collected in a batch. The batch is written to the
+ * log and synced to disk by a single `fdatasync(2)` when it's committed, so
+ * that the cost of the sync is shared by all the records of the batch (group
+ * commit). A modification is durable once the batch holding it is committed.
+ */
+struct ctrie_wal
+{
+	struct ctrie *t;    /* the trie */
+	int dir;            /* the directory of the files */
+	int fd;             /* the log */
+	unsigned char *buf; /* records of the pending batch */
+	size_t len;         /* number of bytes in `buf` */
+	size_t buf_size;    /* size of the `buf` array */
+	size_t batch_size;  /* commit when this many bytes are pending */
+	uint64_t log_size;  /* number of bytes in the log */
+};
+
+/*
+ * Default `batch_size` of a log.
+ */
+#define CTRIE_WAL_BATCH_SIZE (1 << 20)
+
+/*
+ * Open the log of `t` in directory `dir`, which must exist. The trie `t` must
+ * be empty, it's recovered from the files in `dir` (if any). Its prefix index,
+ * lookup cache and statistics, if set up, are kept and cover the recovered
+ * keys. Modifications of a batch which was not entirely written are
+ * discarded.
+ *
+ * Return 0 on success. Otherwise, return -1 and set `errno`; `t` may hold
+ * part of the recovered keys then. If `t` is not empty or is minimized,
+ * `errno` is `EINVAL` and `t` is left alone.
+ */
+int ctrie_wal_open(struct ctrie_wal *w, struct ctrie *t, const char *dir);
+
+/*
+ * Insert `key` into the trie of `w` like `ctrie_insert` and log it. If `data`
+ * is not `NULL`, set the data of `key` to the `t->data_size` bytes at `data`.
+ * Return the data of `key`.
+ *
+ * Changes of the data done through the returned pointer are not logged, set
+ * the data by inserting the key again instead.
+ *
+ * If the batch is committed and the commit fails, return `NULL` and set
+ * `errno`. The key is inserted anyway. A key holding a NUL byte is neither
+ * inserted nor logged, `NULL` is returned and `errno` set to `EINVAL`;
+ * likewise with `EPERM` for a new key if the trie is minimized.
+ */
+void *ctrie_wal_insert(struct ctrie_wal *w,
+                       const char *key,
+                       bool wildcard,
+                       const void *data);
+void *ctrie_wal_insert_n(struct ctrie_wal *w,
+                         const char *key,
+                         size_t len,
+                         bool wildcard,
+                         const void *data);
+
+/*
+ * Remove `key` from the trie of `w` like `ctrie_remove` and log it. Return 0
+ * on success, or -1 if the batch is committed and the commit fails. If the
+ * trie is minimized, nothing is removed nor logged, -1 is returned and `errno`
+ * set to `EPERM`.
+ */
+int ctrie_wal_remove(struct ctrie_wal *w, const char *key);
+int ctrie_wal_remove_n(struct ctrie_wal *w, const char *key, size_t len);
+
+/*
+ * Write the pending batch to the log and sync it. Return 0 on success,
+ * otherwise return -1 and set `errno`.
+ */
+int ctrie_wal_commit(struct ctrie_wal *w);
+
+/*
+ * Commit, then write a checkpoint of the trie and empty the log. Return 0 on
+ * success, otherwise return -1 and set `errno`. A failed checkpoint leaves
+ * the previous checkpoint and the log in place.
+ *
+ * Once the new checkpoint has replaced the previous one, 0 is returned even
+ * if the log can't be emptied: it's then replayed over the checkpoint on
+ * recovery, which is harmless, and emptied by the next checkpoint.
+ */
+int ctrie_wal_checkpoint(struct ctrie_wal *w);
+
+/*
+ * Commit and dispose `w`. The trie is left alone. Return 0 if the commit
+ * succeeded, otherwise return -1 and set `errno`.
+ */
+int ctrie_wal_close(struct ctrie_wal *w);
+
+/*
+ * Flags of `ctrie_load_lines`.
+ */
+enum
+{
+	CTRIE_LINES_WILDCARD = 1 << 0, /* insert the keys as wild-cards */
+	CTRIE_LINES_CRLF     = 1 << 1, /* strip carriage returns ending the lines */
+};
+
+/*
+ * Insert the lines of the file at `path` into `t` as keys, like
+ * `ctrie_insert_n`. Empty lines are skipped, a missing newline at the end of
+ * the file is fine.
+ *
+ * The file is mapped into memory rather than read. If `t` is empty and the
+ * lines are sorted by `memcmp(3)`, as by `LC_ALL=C sort`, the trie is built
+ * bottom-up by a `ctrie_builder`, which is about twice as fast as inserting
+ * the keys one by one.
+ *
+ * Return 0 on success. Otherwise, return -1 and set `errno`; if the file holds
+ * NUL bytes, `errno` is `EINVAL` and `t` is left alone. If `t` is minimized,
+ * `errno` is `EPERM`.
+ */
+int ctrie_load_lines(struct ctrie *t, const char *path, int flags);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
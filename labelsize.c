@@ -0,0 +1,311 @@
+/*
+ * Recommend LABEL_SIZE for a sample of keys.
+ *
+ * Usage: labelsize [-d DATA_SIZE] [-r] [FILE]
+ *
+ * Reads keys from FILE (or the standard input), one per line, computes the
+ * nodes of the compressed trie of the keys and, for every LABEL_SIZE which
+ * doesn't waste any header padding, prints the total bytes spent on the nodes
+ * and on separately allocated labels. The size with the smallest total is
+ * recommended.
+ *
+ * The estimate is for a trie of `DATA_SIZE` bytes of data per node (0 by
+ * default) built by insertions, in the default build or, with `-r`, in a
+ * `CTRIE_REF32` build. Data-less leaves short enough to be stored inline in
+ * their parents cost nothing. Nodes and labels are charged the chunks of
+ * glibc's malloc(3) they take, or in `CTRIE_REF32` builds, the arena units,
+ * which carry no malloc overhead.
+ *
+ * The trie is not actually built: the nodes are derived from the sorted keys
+ * and the longest common prefixes of the neighbouring ones, so any LABEL_SIZE
+ * can be evaluated without rebuilding the library.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define ALIGN(x, a)      (((x) + (a) - 1) / (a) * (a))
+#define MAX(a, b)        ((a) > (b) ? (a) : (b))
+#define LABEL_MIN        sizeof(char *)
+#define HEADER_MAX       64
+#define HEADER_EXTRA     3 /* flags, size and nchild of struct ctnode */
+#define NODE_MAX_SIZE    255
+#define CACHE_LINE       64
+#define ARENA_UNIT       8
+#define ARENA_LABEL_MAX  (64 * 1024)
+#define NCLASS           10 /* capacities 0, 1, 2, 4, ..., 128, 255 */
+
+/*
+ * The build to estimate the sizes for, see above.
+ */
+struct build
+{
+	size_t data_size; /* bytes of data per node */
+	bool ref32;       /* is it a `CTRIE_REF32` build? */
+};
+
+/*
+ * Nodes of the compressed trie by label length and capacity class. A node
+ * of `nchild` children grows by doubling as children are inserted, so its
+ * capacity is the class of the smallest power of two at least `nchild`.
+ */
+struct hist
+{
+	size_t (*n)[NCLASS]; /* number of nodes of each label length and class */
+	size_t size;         /* capacity of `n` */
+	size_t nnodes;       /* total number of nodes */
+};
+
+static size_t class_of(size_t nchild)
+{
+	size_t c = 0;
+	while (nchild > (c ? (size_t)1 << (c - 1) : 0) && c < NCLASS - 1)
+		c++;
+	return c;
+}
+
+static size_t class_size(size_t c)
+{
+	return c == NCLASS - 1 ? NODE_MAX_SIZE : c ? (size_t)1 << (c - 1) : 0;
+}
+
+static void add_node(struct hist *h, size_t len, size_t nchild)
+{
+	if (len >= h->size) {
+		size_t size = MAX(2 * h->size, len + 1);
+		h->n = realloc(h->n, size * sizeof(*h->n));
+		assert(h->n);
+		memset(h->n + h->size, 0, (size - h->size) * sizeof(*h->n));
+		h->size = size;
+	}
+	h->n[len][class_of(nchild)]++;
+	h->nnodes++;
+}
+
+static int cmp_keys(const void *a, const void *b)
+{
+	return strcmp(*(char **)a, *(char **)b);
+}
+
+static size_t lcp(const char *a, const char *b)
+{
+	size_t i;
+	for (i = 0; a[i] && a[i] == b[i]; i++);
+	return i;
+}
+
+/*
+ * A node on the path to the previous key: the length of the key it spells,
+ * and its number of children so far.
+ */
+struct path_ent
+{
+	size_t depth;
+	size_t nchild;
+};
+
+/*
+ * Walk the compressed trie of the sorted unique `keys` and record every node
+ * into `h`.
+ *
+ * A node is identified by its depth, the length of the key it spells. The
+ * stack holds the nodes on the path from the root to the previous key. The
+ * label of a node of depth `d` whose parent has depth `pd` is `d - pd - 1`
+ * characters long, the remaining character being the one in the parent's
+ * character array.
+ */
+static void walk(char **keys, size_t nkeys, struct hist *h)
+{
+	struct path_ent *stack = malloc((1 + nkeys) * 2 * sizeof(*stack));
+	size_t nstack = 0;
+	assert(stack);
+	stack[nstack++] = (struct path_ent) { 0, 0 }; /* the root */
+	for (size_t i = 0; i < nkeys; i++) {
+		size_t l = i ? lcp(keys[i - 1], keys[i]) : 0;
+		struct path_ent last = { SIZE_MAX, 0 };
+		while (stack[nstack - 1].depth > l) {
+			last = stack[--nstack];
+			size_t pd = MAX(stack[nstack - 1].depth, l);
+			add_node(h, last.depth - pd - 1, last.nchild);
+		}
+		if (last.depth != SIZE_MAX && stack[nstack - 1].depth < l) {
+			/* branching node, taking the place of `last` */
+			stack[nstack++] = (struct path_ent) { l, 1 };
+		}
+		size_t len = strlen(keys[i]);
+		if (len > stack[nstack - 1].depth) {
+			stack[nstack - 1].nchild++;
+			stack[nstack++] = (struct path_ent) { len, 0 };
+		}
+	}
+	while (nstack > 1) {
+		struct path_ent e = stack[--nstack];
+		add_node(h, e.depth - stack[nstack - 1].depth - 1, e.nchild);
+	}
+	add_node(h, 0, stack[0].nchild);
+	free(stack);
+}
+
+/*
+ * Return the bytes taken by a malloc(3) of `size` bytes. This models the
+ * chunks of glibc's malloc(3).
+ */
+static size_t heap_size(size_t size)
+{
+	size_t chunk = ALIGN(size + sizeof(size_t), 2 * sizeof(size_t));
+	return MAX(chunk, 4 * sizeof(size_t));
+}
+
+/*
+ * Return the bytes taken by a node of capacity `size` with a header of `hdr`
+ * bytes in build `b`, not counting its label.
+ */
+static size_t node_size(const struct build *b, size_t hdr, size_t size)
+{
+	size_t ref = b->ref32 ? sizeof(uint32_t) : sizeof(void *);
+	size_t bytes = hdr + ALIGN(size, sizeof(void *))
+		+ ALIGN(size * ref, sizeof(void *)) + b->data_size;
+	if (b->ref32)
+		return ALIGN(bytes, ARENA_UNIT);
+	/* larger nodes are aligned at cache line by aligned_alloc(3) */
+	return heap_size(bytes > CACHE_LINE ? ALIGN(bytes, CACHE_LINE) : bytes);
+}
+
+/*
+ * Return the bytes taken by a separately allocated label of length `len`.
+ */
+static size_t label_size(const struct build *b, size_t len)
+{
+	if (!b->ref32)
+		return heap_size(len + 1);
+	if (len + 1 <= ARENA_LABEL_MAX)
+		return ALIGN(len + 1, ARENA_UNIT);
+	return heap_size(2 * sizeof(void *) + len + 1);
+}
+
+static int usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-d DATA_SIZE] [-r] [FILE]\n", prog);
+	return EXIT_FAILURE;
+}
+
+int main(int argc, char *argv[])
+{
+	struct build b = { 0, false };
+	FILE *f = stdin;
+	int opt;
+	while ((opt = getopt(argc, argv, "d:r")) != -1) {
+		switch (opt) {
+		case 'd':
+			b.data_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			b.ref32 = true;
+			break;
+		default:
+			return usage(argv[0]);
+		}
+	}
+	if (argc - optind > 1)
+		return usage(argv[0]);
+	if (optind < argc && !(f = fopen(argv[optind], "r"))) {
+		perror(argv[optind]);
+		return EXIT_FAILURE;
+	}
+
+	char **keys = NULL;
+	size_t nkeys = 0, keys_size = 0;
+	char *line = NULL;
+	size_t line_size = 0;
+	ssize_t len;
+	while ((errno = 0, len = getline(&line, &line_size, f)) > 0) {
+		if (line[len - 1] == '\n')
+			line[--len] = '\0';
+		if (!len)
+			continue; /* the trie never holds the empty key */
+		if (nkeys >= keys_size) {
+			keys_size = keys_size ? 2 * keys_size : 1024;
+			keys = realloc(keys, keys_size * sizeof(*keys));
+			assert(keys);
+		}
+		keys[nkeys++] = strdup(line);
+	}
+	if (errno) {
+		perror("getline");
+		return EXIT_FAILURE;
+	}
+	free(line);
+	if (f != stdin)
+		fclose(f);
+
+	qsort(keys, nkeys, sizeof(*keys), cmp_keys);
+	size_t n = 0;
+	for (size_t i = 0; i < nkeys; i++) {
+		if (n && !strcmp(keys[n - 1], keys[i]))
+			free(keys[i]);
+		else
+			keys[n++] = keys[i];
+	}
+	nkeys = n;
+
+	struct hist h = { NULL, 0, 0 };
+	walk(keys, nkeys, &h);
+
+	size_t median = 0;
+	for (size_t i = 0, seen = 0; i < h.size; i++) {
+		for (size_t c = 0; c < NCLASS; c++)
+			seen += h.n[i][c];
+		if (2 * seen >= h.nnodes) {
+			median = i;
+			break;
+		}
+	}
+	/* leaves fit in a child reference but for its tag byte and the NUL */
+	size_t inline_max = b.data_size ? 0
+		: (b.ref32 ? sizeof(uint32_t) : sizeof(void *)) - 2;
+	size_t ninline = 0;
+	for (size_t i = 0; i <= inline_max && i < h.size; i++)
+		ninline += h.n[i][0];
+	printf("%zu keys, %zu nodes, %zu inline, median label length %zu\n",
+		nkeys, h.nnodes, ninline, median);
+	printf("data_size %zu, %s build\n", b.data_size,
+		b.ref32 ? "CTRIE_REF32" : "default");
+	printf("LABEL_SIZE  header  heap labels       bytes\n");
+
+	size_t best = 0, best_total = SIZE_MAX;
+	for (size_t hdr = ALIGN(LABEL_MIN + HEADER_EXTRA, sizeof(char *));
+	     hdr <= HEADER_MAX; hdr += sizeof(char *)) {
+		size_t label_max = hdr - HEADER_EXTRA;
+		size_t nheap = 0, total = 0;
+		for (size_t i = 0; i < h.size; i++) {
+			for (size_t c = 0; c < NCLASS; c++) {
+				size_t n = h.n[i][c];
+				if (!n || (!c && i <= inline_max))
+					continue;
+				total += n * node_size(&b, hdr, class_size(c));
+				if (i >= label_max) {
+					nheap += n;
+					total += n * label_size(&b, i);
+				}
+			}
+		}
+		printf("%10zu  %6zu  %11zu  %10zu\n", label_max, hdr, nheap, total);
+		if (total < best_total) {
+			best_total = total;
+			best = label_max;
+		}
+	}
+	printf("recommended: -DCTRIE_LABEL_SIZE=%zu\n", best);
+
+	for (size_t i = 0; i < nkeys; i++)
+		free(keys[i]);
+	free(keys);
+	free(h.n);
+	return EXIT_SUCCESS;
+}
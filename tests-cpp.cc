@@ -0,0 +1,249 @@
+#include "ctrie.hpp"
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <map>
+#include <stdexcept>
+#include <string>
+
+#define KEY_MAX_LEN 6
+
+static void rst(std::string &k)
+{
+	k.assign(KEY_MAX_LEN, 'a');
+}
+
+static bool inc(std::string &k)
+{
+	int i;
+	for (i = KEY_MAX_LEN - 1; i >= 0; i--) {
+		if (++k[i] <= 'c')
+			break;
+		k[i] = 'a';
+	}
+	return i >= 0;
+}
+
+/*
+ * Value which counts its live instances. Stored boxed.
+ */
+struct counted
+{
+	static long live;
+	std::string s;
+
+	explicit counted(std::string s) : s(std::move(s)) { live++; }
+	counted(const counted &o) : s(o.s) { live++; }
+	~counted() { live--; }
+};
+
+long counted::live = 0;
+
+/*
+ * Like `counted`, but declared relocatable, so it's stored in the nodes.
+ */
+struct counted_inline
+{
+	static long live;
+	long v;
+
+	explicit counted_inline(long v) : v(v) { live++; }
+	counted_inline(const counted_inline &o) : v(o.v) { live++; }
+	~counted_inline() { live--; }
+};
+
+long counted_inline::live = 0;
+
+template<>
+struct ctrie::is_relocatable<counted_inline> : std::true_type {};
+
+/*
+ * Value whose move constructor throws once `fail` is set.
+ */
+struct throwing
+{
+	static bool fail;
+	int v;
+
+	explicit throwing(int v) : v(v) {}
+	throwing(const throwing &) = default;
+	throwing(throwing &&o) : v(o.v)
+	{
+		if (fail)
+			throw std::runtime_error("move");
+	}
+};
+
+bool throwing::fail = false;
+
+static_assert(ctrie_detail::slot<int>::size == sizeof(int));
+static_assert(ctrie_detail::slot<counted_inline>::size == sizeof(long));
+static_assert(ctrie_detail::slot<counted>::size == sizeof(counted *));
+
+/*
+ * Test against `std::map`. All keys consist of characters which sort the same
+ * whether signed or not, so the iteration orders must agree.
+ */
+static void test_vs_std_map(void)
+{
+	ctrie::map<int> m;
+	std::map<std::string, int> ref;
+	std::string key;
+
+	rst(key);
+	do {
+		std::string prefix = key.substr(0, 1 + rand() % KEY_MAX_LEN);
+		int v = rand();
+		auto [p, inserted] = m.emplace(prefix, v);
+		auto [rp, rinserted] = ref.emplace(prefix, v);
+		assert(inserted == rinserted);
+		assert(*p == rp->second);
+		if (rand() % 4 == 0) {
+			prefix = key.substr(0, 1 + rand() % KEY_MAX_LEN);
+			assert(m.erase(prefix) == (ref.erase(prefix) == 1));
+		}
+		m[key] += 1;
+		ref[key] += 1;
+	} while (inc(key));
+	assert(m.size() == ref.size());
+
+	auto rit = ref.begin();
+	for (auto [k, v] : m) {
+		assert(rit != ref.end());
+		assert(k == rit->first);
+		assert(v == rit->second);
+		++rit;
+	}
+	assert(rit == ref.end());
+
+	const ctrie::map<int> &cm = m;
+	size_t n = 0;
+	for (auto it = cm.begin(); it != cm.end(); ++it, n++)
+		assert(*cm.find((*it).first) == (*it).second);
+	assert(n == ref.size());
+	assert(!cm.contains("d"));
+}
+
+template<typename T, typename Make>
+static void test_lifetime(Make make)
+{
+	std::string key;
+	{
+		ctrie::map<T> m;
+		rst(key);
+		do {
+			m.emplace(key, make(key));
+			assert(!m.emplace(key, make(key)).second);
+			if (rand() % 2)
+				m.erase(key.substr(0, 1 + rand() % KEY_MAX_LEN));
+		} while (inc(key));
+		assert(T::live == (long)m.size());
+
+		ctrie::map<T> m2(std::move(m));
+		assert(m.empty());
+		assert(T::live == (long)m2.size());
+		m = std::move(m2);
+		assert(T::live == (long)m.size());
+
+		m2.emplace("abc", make("abc"));
+		m2.clear();
+		assert(T::live == (long)m.size());
+
+		m.emplace("aaaaaa", make("aaaaaa"));
+		size_t size = m.size();
+		auto v = m.take("aaaaaa");
+		assert(v && m.size() == size - 1);
+		assert(!m.take("aaaaaa"));
+		assert(T::live == (long)m.size() + 1);
+	}
+	assert(T::live == 0);
+}
+
+/*
+ * Look up slices of a buffer, as string views and, with C++20, as bytes.
+ */
+static void test_slices(void)
+{
+	static const char buf[] = "abcabcbcaacbbcacab";
+	std::string_view all(buf, sizeof(buf) - 1);
+	ctrie::map<size_t> m;
+	std::map<std::string, size_t> ref;
+
+	for (size_t n = 0; n < 4096; n++) {
+		size_t off = rand() % all.size();
+		std::string_view key = all.substr(off, 1 + rand() % (all.size() - off));
+		if (rand() % 2) {
+			m[key] = off;
+			ref[std::string(key)] = off;
+		}
+		const size_t *v = m.find(key);
+		auto it = ref.find(std::string(key));
+		assert(!v == (it == ref.end()));
+		assert(!v || *v == it->second);
+#if __cplusplus >= 202002L
+		assert(v == m.find(std::as_bytes(std::span(key))));
+#endif
+	}
+
+	struct ctrie t;
+	ctrie_init(&t, 0);
+	ctrie_insert(&t, all.substr(3, 5), false);
+	assert(ctrie_contains(&t, std::string("abcbc")));
+	assert(!ctrie_contains(&t, all.substr(3, 4)));
+	ctrie_remove(&t, all.substr(3, 5));
+	assert(!ctrie_contains(&t, "abcbc"));
+	ctrie_free(&t);
+}
+
+static void test_exceptions(void)
+{
+	ctrie::map<throwing> m;
+	m.emplace("abc", 1);
+	m.emplace("abd", 2);
+
+	bool thrown = false;
+	try {
+		m.emplace("", 3);
+	} catch (const std::invalid_argument &) {
+		thrown = true;
+	}
+	assert(thrown && m.size() == 2);
+	thrown = false;
+	try {
+		m.emplace(std::string_view("a\0c", 3), 3);
+	} catch (const std::invalid_argument &) {
+		thrown = true;
+	}
+	assert(thrown && m.size() == 2);
+
+	throwing::fail = true;
+	thrown = false;
+	try {
+		m.take("abc");
+	} catch (const std::runtime_error &) {
+		thrown = true;
+	}
+	assert(thrown && m.size() == 2);
+	assert(m.find("abc") && m.find("abc")->v == 1);
+	assert(!m.take("abx"));
+	throwing::fail = false;
+	auto v = m.take("abc");
+	assert(v && v->v == 1 && m.size() == 1 && !m.contains("abc"));
+}
+
+int main(void)
+{
+	time_t t = time(NULL);
+	fprintf(stderr, "Running with seed 0x%lx\n", t);
+	srand(t);
+
+	test_vs_std_map();
+	test_slices();
+	test_exceptions();
+	test_lifetime<counted>([](const std::string &k) { return counted(k); });
+	test_lifetime<counted_inline>([](const std::string &k) {
+		return counted_inline(k.size());
+	});
+	return EXIT_SUCCESS;
+}
@@ -1,11 +1,15 @@
 #include "ctrie.h"
+#include "ctrie_io.h"
 #include <assert.h>
 #include <errno.h>
+#include <fnmatch.h>
+#include <pthread.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <unistd.h>
 
 #define KEY_MAX_LEN        6
 #define LONG_KEY_TEST_SIZE 1024
@@ -116,6 +120,72 @@ static void test_insert_long_keys(void)
 	ctrie_free(&t);
 }
 
+/*
+ * Split labels too long for the arena of `CTRIE_REF32` builds, which are
+ * allocated apart, at various offsets, and keep allocating nodes afterwards.
+ */
+static void test_split_big_label(void)
+{
+	struct ctrie t;
+	size_t len = 100000;
+	char *key = malloc(len + 1);
+	char k[4];
+
+	assert(key);
+	ctrie_init(&t, 0);
+	for (size_t off = 1; off < 64; off++) {
+		memset(key, 'a', len);
+		key[0] = '0' + off;
+		key[len] = '\0';
+		ctrie_insert(&t, key, false);
+		key[off] = 'b';
+		ctrie_insert_n(&t, key, off + 1, false);
+	}
+	for (size_t n = 0; n < 20000; n++) {
+		k[0] = 'a' + n % 20;
+		k[1] = 'a' + n / 20 % 26;
+		k[2] = 'a' + n / 520 % 26;
+		k[3] = '\0';
+		ctrie_insert(&t, k, false);
+	}
+	for (size_t off = 1; off < 64; off++) {
+		memset(key, 'a', len);
+		key[0] = '0' + off;
+		assert(ctrie_contains(&t, key));
+		key[off] = 'b';
+		assert(ctrie_contains_n(&t, key, off + 1));
+		assert(!ctrie_contains(&t, key));
+	}
+	ctrie_free(&t);
+	free(key);
+}
+
+/*
+ * Data sizes too large for a node are rejected, and sizes just below the
+ * limit of `CTRIE_REF32` builds still work.
+ */
+static void test_big_data(void)
+{
+	struct ctrie t;
+	char *d;
+
+	errno = 0;
+	assert(ctrie_init(&t, SIZE_MAX) == -1 && errno == EINVAL);
+#ifdef CTRIE_REF32
+	errno = 0;
+	assert(ctrie_init(&t, 2 << 20) == -1 && errno == EINVAL);
+#endif
+	assert(!ctrie_init(&t, 1000000));
+	for (const char *k = "abcdefgh"; *k; k++) {
+		d = ctrie_insert_n(&t, k, 1, false);
+		memset(d, *k, 1000000);
+	}
+	assert(ctrie_insert(&t, "cx", false));
+	d = ctrie_find(&t, "c");
+	assert(d && d[0] == 'c' && d[999999] == 'c');
+	ctrie_free(&t);
+}
+
 static void test_insert_english(void)
 {
 	struct ctrie t;
@@ -217,6 +287,42 @@ static void test_remove_seq(void)
 	ctrie_free(&c);
 }
 
+/*
+ * Test that removing a wild-card key stops it matching the keys it's a prefix
+ * of, and that removing the empty key keeps the root of the trie.
+ */
+static void test_remove_flags(void)
+{
+	struct ctrie a;
+
+	ctrie_init(&a, 0);
+	ctrie_insert(&a, "ab", true);
+	ctrie_insert(&a, "abc", false);
+	ctrie_insert(&a, "abd", false);
+	assert(ctrie_contains(&a, "abx"));
+	ctrie_remove(&a, "ab");
+	assert(!ctrie_contains(&a, "ab") && !ctrie_contains(&a, "abx"));
+	assert(ctrie_contains(&a, "abc") && ctrie_contains(&a, "abd"));
+	ctrie_insert(&a, "ab", false);
+	assert(!ctrie_contains(&a, "abx"));
+	ctrie_free(&a);
+
+	ctrie_init(&a, 0);
+	ctrie_insert(&a, "", true);
+	ctrie_insert(&a, "a", false);
+	assert(ctrie_contains(&a, "xyz"));
+	ctrie_remove(&a, "");
+	assert(!ctrie_contains(&a, "") && !ctrie_contains(&a, "xyz"));
+	assert(ctrie_contains(&a, "a"));
+	ctrie_remove(&a, "a");
+	ctrie_insert(&a, "", false);
+	ctrie_remove(&a, "");
+	assert(!ctrie_contains(&a, ""));
+	ctrie_insert(&a, "b", false);
+	assert(ctrie_contains(&a, "b") && !ctrie_contains(&a, ""));
+	ctrie_free(&a);
+}
+
 // Test that the key does not contain the empty key, unless inserted.
 static void test_not_contains_empty(void)
 {
@@ -226,6 +332,1692 @@ static void test_not_contains_empty(void)
 	ctrie_free(&a);
 }
 
+static size_t levenshtein(const char *a, const char *b)
+{
+	size_t la = strlen(a), lb = strlen(b);
+	size_t row[KEY_MAX_LEN + 2];
+	assert(lb <= KEY_MAX_LEN);
+	for (size_t j = 0; j <= lb; j++)
+		row[j] = j;
+	for (size_t i = 1; i <= la; i++) {
+		size_t diag = row[0];
+		row[0] = i;
+		for (size_t j = 1; j <= lb; j++) {
+			size_t up = row[j];
+			size_t sub = diag + (a[i - 1] != b[j - 1]);
+			size_t del = up + 1, ins = row[j - 1] + 1;
+			row[j] = sub < del ? sub : del;
+			row[j] = row[j] < ins ? row[j] : ins;
+			diag = up;
+		}
+	}
+	return row[lb];
+}
+
+struct fuzzy_ctx
+{
+	const char *query;
+	size_t nmatches;
+};
+
+static void fuzzy_cb(const char *key, void *data, size_t dist, void *arg)
+{
+	struct fuzzy_ctx *ctx = arg;
+	assert(levenshtein(key, ctx->query) == dist);
+	assert(!strcmp(data, key));
+	ctx->nmatches++;
+}
+
+/*
+ * Test fuzzy search against a brute-force computation of the edit distance
+ * from random queries to every key in the trie.
+ */
+static void test_fuzzy(void)
+{
+	struct ctrie t;
+	char key[KEY_MAX_LEN + 1];
+	char query[KEY_MAX_LEN + 1];
+
+	ctrie_init(&t, KEY_MAX_LEN + 1);
+	rst(key);
+	do {
+		if (rand() % 4 == 0)
+			strcpy(ctrie_insert(&t, key, false), key);
+	} while (inc(key));
+
+	struct ctrie_iter it;
+	char *key2 = NULL;
+	size_t key2_size = 0;
+	for (size_t n = 0; n < 64; n++) {
+		size_t len = rand() % (KEY_MAX_LEN + 1);
+		for (size_t i = 0; i < len; i++)
+			query[i] = 'a' + rand() % 4;
+		query[len] = '\0';
+		for (size_t max_dist = 0; max_dist <= 3; max_dist++) {
+			struct fuzzy_ctx ctx = { .query = query };
+			ctrie_fuzzy(&t, query, max_dist, fuzzy_cb, &ctx);
+			size_t expected = 0;
+			ctrie_iter_init(&t, &it);
+			while (ctrie_iter_next(&it, &key2, &key2_size))
+				expected += levenshtein(key2, query) <= max_dist;
+			ctrie_iter_free(&it);
+			assert(ctx.nmatches == expected);
+		}
+	}
+	free(key2);
+	ctrie_free(&t);
+}
+
+struct match_ctx
+{
+	const char *pattern;
+	size_t nmatches;
+};
+
+static void match_cb(const char *key, void *data, void *arg)
+{
+	struct match_ctx *ctx = arg;
+	assert(!fnmatch(ctx->pattern, key, 0));
+	assert(!strcmp(data, key));
+	ctx->nmatches++;
+}
+
+/*
+ * Test glob matching against fnmatch(3) applied to every key in the trie.
+ */
+static void test_match(void)
+{
+	static const char *atoms[] = {
+		"a", "b", "c", "d", "?", "*", "[ab]", "[!a]", "[a-b]", "\\c",
+	};
+	struct ctrie t;
+	char key[KEY_MAX_LEN + 1];
+	char prefix[KEY_MAX_LEN + 1];
+	char pattern[64];
+
+	ctrie_init(&t, KEY_MAX_LEN + 1);
+	rst(key);
+	do {
+		if (rand() % 2 == 0)
+			strcpy(ctrie_insert(&t, key, false), key);
+		if (rand() % 8 == 0) { /* some shorter keys as well */
+			strcpy(prefix, key);
+			prefix[1 + rand() % (KEY_MAX_LEN - 1)] = '\0';
+			strcpy(ctrie_insert(&t, prefix, false), prefix);
+		}
+	} while (inc(key));
+
+	struct ctrie_iter it;
+	char *key2 = NULL;
+	size_t key2_size = 0;
+	for (size_t n = 0; n < 256; n++) {
+		pattern[0] = '\0';
+		size_t len = rand() % (KEY_MAX_LEN + 2);
+		for (size_t i = 0; i < len; i++)
+			strcat(pattern, atoms[rand() % (sizeof(atoms) / sizeof(*atoms))]);
+		struct match_ctx ctx = { .pattern = pattern };
+		ctrie_match(&t, pattern, match_cb, &ctx);
+		size_t expected = 0;
+		ctrie_iter_init(&t, &it);
+		while (ctrie_iter_next(&it, &key2, &key2_size))
+			expected += !fnmatch(pattern, key2, 0);
+		ctrie_iter_free(&it);
+		assert(ctx.nmatches == expected);
+	}
+	free(key2);
+	ctrie_free(&t);
+}
+
+#define SCAN_TEXT_LEN 4096
+
+struct scan_ctx
+{
+	struct ctrie *t;
+	const char *text;
+	size_t nmatches;
+};
+
+static void scan_cb(size_t end, size_t len, void *data, void *arg)
+{
+	struct scan_ctx *ctx = arg;
+	char key[KEY_MAX_LEN + 1];
+	assert(len <= KEY_MAX_LEN && len <= end);
+	memcpy(key, ctx->text + end - len, len);
+	key[len] = '\0';
+	assert(ctrie_find(ctx->t, key) == data);
+	ctx->nmatches++;
+}
+
+/*
+ * Test Aho-Corasick scanning by comparing the number of matches found with
+ * lookups of all substrings of the text, over letters and over bytes on both
+ * sides of 0x80, which are ordered as negative `char`s.
+ */
+static void test_scan(void)
+{
+	static const char *const alphabets[] = { "abcd", "\x7f\x80\xff\x01" };
+	struct ctrie t;
+	struct ctrie_ac ac;
+	char key[KEY_MAX_LEN + 1];
+	char text[SCAN_TEXT_LEN];
+
+	for (size_t a = 0; a < sizeof(alphabets) / sizeof(*alphabets); a++) {
+		const char *alpha = alphabets[a];
+		ctrie_init(&t, sizeof(int));
+		rst(key);
+		do {
+			if (rand() % 16 == 0) {
+				char prefix[KEY_MAX_LEN + 1];
+				for (size_t i = 0; i <= KEY_MAX_LEN; i++)
+					prefix[i] = key[i] ? alpha[key[i] - 'a'] : '\0';
+				prefix[1 + rand() % KEY_MAX_LEN] = '\0';
+				ctrie_insert(&t, prefix, false);
+			}
+		} while (inc(key));
+
+		for (size_t i = 0; i < SCAN_TEXT_LEN; i++)
+			text[i] = alpha[rand() % 4];
+
+		size_t expected = 0;
+		for (size_t i = 0; i < SCAN_TEXT_LEN; i++) {
+			for (size_t len = 1; len <= KEY_MAX_LEN; len++) {
+				if (i + len > SCAN_TEXT_LEN)
+					break;
+				memcpy(key, text + i, len);
+				key[len] = '\0';
+				expected += ctrie_contains(&t, key);
+			}
+		}
+
+		struct scan_ctx ctx = { .t = &t, .text = text };
+		assert(!ctrie_ac_init(&t, &ac));
+		ctrie_scan(&ac, text, SCAN_TEXT_LEN, scan_cb, &ctx);
+		assert(ctx.nmatches == expected);
+
+		/* the same when scanning in chunks */
+		ctx.nmatches = 0;
+		ctrie_ac_reset(&ac);
+		for (size_t i = 0; i < SCAN_TEXT_LEN; i += 7) {
+			size_t len = SCAN_TEXT_LEN - i < 7 ? SCAN_TEXT_LEN - i : 7;
+			ctrie_scan(&ac, text + i, len, scan_cb, &ctx);
+		}
+		assert(ctx.nmatches == expected);
+
+		ctrie_ac_free(&ac);
+		ctrie_free(&t);
+	}
+}
+
+struct merge_ctx
+{
+	struct ctrie *a, *b;
+	bool in_a, in_b; /* must the keys be in `a` and `b`? */
+	bool not_in_b;   /* must the keys not be in `b`? */
+	char last[KEY_MAX_LEN + 1];
+	size_t nkeys;
+};
+
+static void merge_cb(const char *key, void *data_a, void *data_b, void *arg)
+{
+	struct merge_ctx *ctx = arg;
+	assert(data_a == ctrie_find(ctx->a, (char *)key));
+	assert(data_b == ctrie_find(ctx->b, (char *)key));
+	assert(data_a || data_b);
+	assert(!ctx->in_a || data_a);
+	assert(!ctx->in_b || data_b);
+	assert(!ctx->not_in_b || !data_b);
+	assert(ctx->nkeys == 0 || strcmp(ctx->last, key) < 0);
+	strcpy(ctx->last, key);
+	ctx->nkeys++;
+}
+
+/*
+ * Test set operations by checking that the keys reported are sorted and
+ * belong to the result, and that their number is right.
+ */
+static void test_set_ops(void)
+{
+	struct ctrie a, b;
+	char key[KEY_MAX_LEN + 1];
+	size_t nunion = 0, nintersect = 0, ndiff = 0;
+
+	ctrie_init(&a, sizeof(int));
+	ctrie_init(&b, sizeof(int));
+	rst(key);
+	do {
+		size_t len = 1 + rand() % KEY_MAX_LEN;
+		char c = key[len];
+		key[len] = '\0';
+		bool in_a = rand() % 3 == 0, in_b = rand() % 3 == 0;
+		if (in_a)
+			ctrie_insert(&a, key, false);
+		if (in_b)
+			ctrie_insert(&b, key, false);
+		key[len] = c;
+	} while (inc(key));
+
+	struct ctrie_iter it;
+	char *key2 = NULL;
+	size_t key2_size = 0;
+	ctrie_iter_init(&a, &it);
+	while (ctrie_iter_next(&it, &key2, &key2_size)) {
+		nunion++;
+		if (ctrie_contains(&b, key2))
+			nintersect++;
+		else
+			ndiff++;
+	}
+	ctrie_iter_free(&it);
+	ctrie_iter_init(&b, &it);
+	while (ctrie_iter_next(&it, &key2, &key2_size))
+		nunion += !ctrie_contains(&a, key2);
+	ctrie_iter_free(&it);
+	free(key2);
+
+	struct merge_ctx ctx = { .a = &a, .b = &b };
+	ctrie_union(&a, &b, merge_cb, &ctx);
+	assert(ctx.nkeys == nunion);
+
+	ctx = (struct merge_ctx) { .a = &a, .b = &b, .in_a = true, .in_b = true };
+	ctrie_intersect(&a, &b, merge_cb, &ctx);
+	assert(ctx.nkeys == nintersect);
+
+	ctx = (struct merge_ctx) { .a = &a, .b = &b, .in_a = true, .not_in_b = true };
+	ctrie_diff(&a, &b, merge_cb, &ctx);
+	assert(ctx.nkeys == ndiff);
+
+	ctrie_free(&a);
+	ctrie_free(&b);
+}
+
+/*
+ * Test that lookups and insertions through a cursor give the same results as
+ * the plain ones, both for sorted and random keys, with direct modifications
+ * of the trie interleaved.
+ */
+static void test_cursor(void)
+{
+	struct ctrie a, b;
+	struct ctrie_cursor ca, cb;
+	char key[KEY_MAX_LEN + 1];
+	char prefix[KEY_MAX_LEN + 1];
+	int *d;
+
+	ctrie_init(&a, sizeof(*d));
+	ctrie_init(&b, sizeof(*d));
+	ctrie_cursor_init(&a, &ca);
+	ctrie_cursor_init(&b, &cb);
+
+	rst(key);
+	do {
+		strcpy(prefix, key);
+		prefix[rand() % (KEY_MAX_LEN + 1)] = '\0';
+		bool wildcard = rand() % 16 == 0;
+		if (rand() % 2) {
+			d = ctrie_cursor_insert(&ca, prefix, wildcard);
+			assert(d == ctrie_cursor_find(&ca, prefix));
+			*d = 1;
+			*(int *)ctrie_insert(&b, prefix, wildcard) = 1;
+		}
+		if (rand() % 8 == 0) {
+			ctrie_remove(&a, prefix);
+			ctrie_remove(&b, prefix);
+		}
+	} while (inc(key));
+
+	for (size_t n = 0; n < 4096; n++) {
+		size_t len = rand() % (KEY_MAX_LEN + 1);
+		for (size_t i = 0; i < len; i++)
+			key[i] = 'a' + rand() % 3;
+		key[len] = '\0';
+		d = ctrie_cursor_find(&ca, key);
+		assert(d == ctrie_find(&a, key));
+		assert(!d == !ctrie_cursor_find(&cb, key));
+		if (rand() % 4 == 0) {
+			*(int *)ctrie_cursor_insert(&cb, key, false) = 1;
+			*(int *)ctrie_insert(&a, key, false) = 1;
+		}
+	}
+
+	ctrie_cursor_free(&ca);
+	ctrie_cursor_free(&cb);
+	ctrie_free(&a);
+	ctrie_free(&b);
+}
+
+static void count_cb(const char *key, void *data, size_t dist, void *arg)
+{
+	++*(size_t *)arg;
+}
+
+/*
+ * Test a trie without data, whose short leaves are stored inline, against
+ * a trie with data, which has none.
+ */
+static void test_inline_leaves(void)
+{
+	struct ctrie a, b;
+	struct ctrie_cursor ca;
+	struct ctrie_iter ia, ib;
+	char key[KEY_MAX_LEN + 3];
+	char prefix[KEY_MAX_LEN + 1];
+	char *ka = NULL, *kb = NULL;
+	size_t ka_size = 0, kb_size = 0;
+	size_t na = 0, nb = 0;
+
+	ctrie_init(&a, 0);
+	ctrie_init(&b, 1);
+	ctrie_cursor_init(&a, &ca);
+
+	rst(key);
+	do {
+		strcpy(prefix, key);
+		prefix[rand() % (KEY_MAX_LEN + 1)] = '\0';
+		bool wildcard = rand() % 16 == 0;
+		if (rand() % 2) {
+			if (rand() % 2)
+				ctrie_cursor_insert(&ca, prefix, wildcard);
+			else
+				ctrie_insert(&a, prefix, wildcard);
+			ctrie_insert(&b, prefix, wildcard);
+		}
+		if (rand() % 4 == 0) {
+			ctrie_remove(&a, prefix);
+			ctrie_remove(&b, prefix);
+		}
+	} while (inc(key));
+
+	for (size_t n = 0; n < 4096; n++) {
+		size_t len = rand() % (KEY_MAX_LEN + 3);
+		for (size_t i = 0; i < len; i++)
+			key[i] = 'a' + rand() % 3;
+		key[len] = '\0';
+		assert(ctrie_contains(&a, key) == ctrie_contains(&b, key));
+	}
+
+	ctrie_iter_init(&a, &ia);
+	ctrie_iter_init(&b, &ib);
+	while (ctrie_iter_next(&ia, &ka, &ka_size)) {
+		assert(ctrie_iter_next(&ib, &kb, &kb_size));
+		assert(!strcmp(ka, kb));
+	}
+	assert(!ctrie_iter_next(&ib, &kb, &kb_size));
+	ctrie_iter_free(&ia);
+	ctrie_iter_free(&ib);
+	free(ka);
+	free(kb);
+
+	ctrie_fuzzy(&a, "abcab", 2, count_cb, &na);
+	ctrie_fuzzy(&b, "abcab", 2, count_cb, &nb);
+	assert(na && na == nb);
+
+	ctrie_cursor_free(&ca);
+	ctrie_free(&a);
+	ctrie_free(&b);
+}
+
+static void init_cb(void *data, void *arg)
+{
+	*(int *)data = 100;
+	++*(size_t *)arg;
+}
+
+/*
+ * Test the `_n` variants on keys which are slices of a read-only buffer.
+ */
+static void test_key_len(void)
+{
+	static const char buf[] = "abcabcbcaacbbcacab";
+	struct ctrie a, b;
+	char key[sizeof(buf)];
+
+	ctrie_init(&a, sizeof(int));
+	ctrie_init(&b, sizeof(int));
+	for (size_t n = 0; n < 4096; n++) {
+		size_t off = rand() % (sizeof(buf) - 1);
+		size_t len = 1 + rand() % (sizeof(buf) - 1 - off);
+		memcpy(key, buf + off, len);
+		key[len] = '\0';
+		switch (rand() % 4) {
+		case 0:
+		case 1:
+			*(int *)ctrie_insert_n(&a, buf + off, len, false) = off;
+			*(int *)ctrie_insert(&b, key, false) = off;
+			break;
+		case 2:
+			ctrie_remove_n(&a, buf + off, len);
+			ctrie_remove(&b, key);
+			break;
+		}
+		int *da = ctrie_find_n(&a, buf + off, len);
+		int *db = ctrie_find(&b, key);
+		assert(!da == !db);
+		assert(!da || *da == *db);
+		assert(ctrie_contains_n(&a, buf + off, len) == !!db);
+	}
+
+	/*
+	 * Slices holding NUL bytes are neither found nor inserted, also where a
+	 * label, here one too long to be embedded in its node, ends.
+	 */
+	static const char nul[] = "abcabcbcaacbbcacab\0bc\0";
+	ctrie_insert_n(&a, nul, 18, false);
+	ctrie_insert_n(&b, nul, 18, false);
+	for (size_t off = 0; off < sizeof(nul) - 1; off++) {
+		for (size_t len = 1; off + len <= sizeof(nul) - 1; len++) {
+			if (!memchr(nul + off, '\0', len))
+				continue;
+			bool inserted;
+			assert(!ctrie_find_n(&a, nul + off, len));
+			assert(!ctrie_contains_n(&a, nul + off, len));
+			errno = 0;
+			assert(!ctrie_insert_n(&a, nul + off, len, false));
+			assert(errno == EINVAL);
+			assert(!ctrie_upsert_n(&a, nul + off, len, &inserted));
+			assert(!ctrie_emplace_n(&a, nul + off, len, init_cb, NULL));
+			ctrie_remove_n(&a, nul + off, len);
+			assert(!ctrie_remove_prefix_n(&a, nul + off, len));
+		}
+	}
+	for (size_t off = 0; off < sizeof(buf) - 1; off++) {
+		for (size_t len = 1; off + len <= sizeof(buf) - 1; len++) {
+			int *da = ctrie_find_n(&a, buf + off, len);
+			int *db = ctrie_find_n(&b, buf + off, len);
+			assert(!da == !db);
+			assert(!da || *da == *db);
+		}
+	}
+	ctrie_free(&a);
+	ctrie_free(&b);
+}
+
+/*
+ * Count keys with `ctrie_upsert` and `ctrie_emplace` and check the counts
+ * against a trie maintained by `ctrie_find` and `ctrie_insert`.
+ */
+static void test_upsert(void)
+{
+	struct ctrie a, b, c;
+	char key[KEY_MAX_LEN + 1];
+	char prefix[KEY_MAX_LEN + 1];
+	size_t ninit = 0, nnew = 0;
+	bool inserted;
+	int *d;
+
+	ctrie_init(&a, sizeof(int));
+	ctrie_init(&b, sizeof(int));
+	ctrie_init(&c, sizeof(int));
+	for (size_t n = 0; n < 3; n++) {
+		rst(key);
+		do {
+			strcpy(prefix, key);
+			prefix[1 + rand() % KEY_MAX_LEN] = '\0';
+			d = ctrie_upsert(&a, prefix, &inserted);
+			assert(inserted == !ctrie_contains(&b, prefix));
+			assert(!inserted || *d == 0);
+			++*d;
+			d = ctrie_find(&b, prefix);
+			if (!d)
+				d = ctrie_insert(&b, prefix, false);
+			++*d;
+			++*(int *)ctrie_emplace(&c, prefix, init_cb, &ninit);
+			nnew += inserted;
+			if (rand() % 8 == 0) {
+				ctrie_remove(&a, prefix);
+				ctrie_remove(&b, prefix);
+				ctrie_remove(&c, prefix);
+			}
+		} while (inc(key));
+	}
+	assert(ninit == nnew);
+
+	rst(key);
+	do {
+		for (size_t len = 1; len <= KEY_MAX_LEN; len++) {
+			strcpy(prefix, key);
+			prefix[len] = '\0';
+			d = ctrie_find(&a, prefix);
+			int *db = ctrie_find(&b, prefix);
+			int *dc = ctrie_find(&c, prefix);
+			assert(!d == !db && !d == !dc);
+			assert(!d || (*d == *db && *dc == 100 + *d));
+		}
+	} while (inc(key));
+
+	/* data left behind in a branching node by a removed key */
+	*(int *)ctrie_insert(&a, "zz", false) = 1;
+	ctrie_insert(&a, "zza", false);
+	ctrie_insert(&a, "zzb", false);
+	ctrie_remove(&a, "zz");
+	d = ctrie_upsert(&a, "zz", &inserted);
+	assert(inserted && *d == 0);
+	d = ctrie_upsert(&a, "zz", &inserted);
+	assert(!inserted);
+
+	ctrie_free(&a);
+	ctrie_free(&b);
+	ctrie_free(&c);
+}
+
+static bool is_odd(void *data, void *arg)
+{
+	++*(size_t *)arg;
+	return *(int *)data % 2;
+}
+
+/*
+ * Test `ctrie_take` and `ctrie_remove_if` against `ctrie_find` followed by
+ * `ctrie_remove`.
+ */
+static void test_take(void)
+{
+	struct ctrie a, b;
+	char key[KEY_MAX_LEN + 1];
+	char prefix[KEY_MAX_LEN + 1];
+	size_t ncalls = 0;
+	int v, *d;
+
+	ctrie_init(&a, sizeof(int));
+	ctrie_init(&b, sizeof(int));
+	rst(key);
+	do {
+		strcpy(prefix, key);
+		prefix[1 + rand() % KEY_MAX_LEN] = '\0';
+		v = rand();
+		*(int *)ctrie_insert(&a, prefix, false) = v;
+		*(int *)ctrie_insert(&b, prefix, false) = v;
+	} while (inc(key));
+
+	rst(key);
+	do {
+		strcpy(prefix, key);
+		prefix[1 + rand() % KEY_MAX_LEN] = '\0';
+		d = ctrie_find(&b, prefix);
+		if (rand() % 2) {
+			v = -1;
+			assert(ctrie_take(&a, prefix, &v) == !!d);
+			assert(!d || v == *d);
+			ctrie_remove(&b, prefix);
+		} else {
+			size_t before = ncalls;
+			bool odd = d && *d % 2;
+			assert(ctrie_remove_if(&a, prefix, is_odd, &ncalls) == odd);
+			assert(ncalls == before + !!d);
+			if (odd)
+				ctrie_remove(&b, prefix);
+		}
+		assert(ctrie_contains(&a, prefix) == ctrie_contains(&b, prefix));
+	} while (inc(key));
+
+	ctrie_free(&a);
+	ctrie_free(&b);
+}
+
+/*
+ * Test `ctrie_remove_prefix` against removal of the matching keys one by one.
+ */
+static void test_remove_prefix(void)
+{
+	struct ctrie a, b;
+	struct ctrie_iter ia, ib;
+	char key[KEY_MAX_LEN + 1];
+	char prefix[KEY_MAX_LEN + 1];
+	char *ka = NULL, *kb = NULL;
+	size_t ka_size = 0, kb_size = 0;
+
+	for (size_t data_size = 0; data_size <= sizeof(int); data_size += sizeof(int)) {
+		ctrie_init(&a, data_size);
+		ctrie_init(&b, data_size);
+		rst(key);
+		do {
+			if (rand() % 4)
+				continue;
+			strcpy(prefix, key);
+			prefix[1 + rand() % KEY_MAX_LEN] = '\0';
+			ctrie_insert(&a, prefix, false);
+			ctrie_insert(&b, prefix, false);
+		} while (inc(key));
+
+		for (size_t n = 0; n < 64; n++) {
+			size_t len = rand() % (KEY_MAX_LEN + 1);
+			for (size_t i = 0; i < len; i++)
+				prefix[i] = 'a' + rand() % 3;
+			prefix[len] = '\0';
+
+			char **keys = NULL;
+			size_t count = 0;
+			ctrie_iter_init(&b, &ib);
+			while (ctrie_iter_next(&ib, &kb, &kb_size)) {
+				if (strncmp(kb, prefix, len))
+					continue;
+				keys = realloc(keys, (count + 1) * sizeof(*keys));
+				assert(keys);
+				keys[count++] = strdup(kb);
+			}
+			ctrie_iter_free(&ib);
+			for (size_t i = 0; i < count; i++) {
+				ctrie_remove(&b, keys[i]);
+				free(keys[i]);
+			}
+			free(keys);
+			assert(ctrie_remove_prefix(&a, prefix) == count);
+
+			ctrie_iter_init(&a, &ia);
+			ctrie_iter_init(&b, &ib);
+			while (ctrie_iter_next(&ia, &ka, &ka_size)) {
+				assert(ctrie_iter_next(&ib, &kb, &kb_size));
+				assert(!strcmp(ka, kb));
+			}
+			assert(!ctrie_iter_next(&ib, &kb, &kb_size));
+			ctrie_iter_free(&ia);
+			ctrie_iter_free(&ib);
+
+			if (len) {
+				ctrie_insert(&a, prefix, false);
+				ctrie_insert(&b, prefix, false);
+			}
+		}
+
+		ctrie_insert(&a, "abc", false);
+		assert(ctrie_remove_prefix(&a, "") > 0);
+		assert(!ctrie_remove_prefix(&a, ""));
+		ctrie_iter_init(&a, &ia);
+		assert(!ctrie_iter_next(&ia, &ka, &ka_size));
+		ctrie_iter_free(&ia);
+		ctrie_insert(&a, "abc", false);
+		assert(ctrie_contains(&a, "abc"));
+
+		ctrie_free(&a);
+		ctrie_free(&b);
+	}
+	free(ka);
+	free(kb);
+}
+
+/*
+ * Build a trie which is as deep as it has keys and tear it down.
+ */
+static void test_deep(void)
+{
+	const size_t depth = 1 << 12;
+	char *key = malloc(depth + 2);
+	struct ctrie t;
+	assert(key);
+
+	for (size_t data_size = 0; data_size <= sizeof(int); data_size += sizeof(int)) {
+		ctrie_init(&t, data_size);
+		for (size_t i = 0; i < depth; i++) {
+			key[i] = 'a';
+			key[i + 1] = 'b';
+			ctrie_insert_n(&t, key, i + 2, false);
+		}
+		assert(ctrie_contains_n(&t, key, depth + 1));
+		assert(ctrie_remove_prefix_n(&t, key, depth / 2) == depth - depth / 2 + 1);
+		key[depth / 2 - 1] = 'b';
+		assert(ctrie_contains_n(&t, key, depth / 2));
+		assert(ctrie_remove_prefix(&t, "") == depth / 2 - 1);
+		ctrie_free(&t);
+	}
+	free(key);
+}
+
+/*
+ * Was `key` of `t` inserted as a prefix wild-card? Only the key itself can
+ * match its extension by a character which no key holds then.
+ */
+static bool is_wildcard(struct ctrie *t, const char *key)
+{
+	size_t len = strlen(key);
+	char *ext = malloc(len + 2);
+	assert(ext);
+	memcpy(ext, key, len);
+	ext[len] = '\x01';
+	ext[len + 1] = '\0';
+	bool wild = ctrie_find(t, ext) == ctrie_find(t, key);
+	free(ext);
+	return wild;
+}
+
+/*
+ * Assert that `a` and `b` hold the same keys with the same data and flags.
+ */
+static void assert_same(struct ctrie *a, struct ctrie *b)
+{
+	struct ctrie_iter ia, ib;
+	struct ctnode *na, *nb;
+	char *ka = NULL, *kb = NULL;
+	size_t ka_size = 0, kb_size = 0;
+
+	ctrie_iter_init(a, &ia);
+	ctrie_iter_init(b, &ib);
+	while ((na = ctrie_iter_next(&ia, &ka, &ka_size))) {
+		assert((nb = ctrie_iter_next(&ib, &kb, &kb_size)));
+		assert(!strcmp(ka, kb));
+		assert(!memcmp(ctrie_node_data(a, na), ctrie_node_data(b, nb),
+			a->data_size));
+		assert(is_wildcard(a, ka) == is_wildcard(b, kb));
+	}
+	assert(!ctrie_iter_next(&ib, &kb, &kb_size));
+	ctrie_iter_free(&ia);
+	ctrie_iter_free(&ib);
+	free(ka);
+	free(kb);
+}
+
+/*
+ * Make a random key of up to 8 * 16 + 7 characters from a few 16-character
+ * pieces followed by a short random tail, so that keys share long prefixes.
+ */
+static size_t make_index_key(char *key)
+{
+	static const char *pieces[] = {
+		"https://example.",
+		"org/some/path/to",
+		"/a/b/c/d/e/f/g/h",
+	};
+	size_t len = 0;
+	for (size_t i = rand() % 9; i > 0; i--) {
+		memcpy(key + len, pieces[rand() % 3], 16);
+		len += 16;
+	}
+	for (size_t i = rand() % 8; i > 0; i--)
+		key[len++] = 'a' + rand() % 3;
+	if (!len)
+		key[len++] = 'a';
+	key[len] = '\0';
+	return len;
+}
+
+/*
+ * Test that lookups through the prefix index agree with lookups without it
+ * while the trie changes.
+ */
+static void test_index(void)
+{
+	char key[8 * 16 + 8];
+	struct ctrie a, b;
+
+	for (size_t data_size = 0; data_size <= sizeof(int); data_size += sizeof(int)) {
+		ctrie_init(&a, data_size);
+		ctrie_init(&b, data_size);
+		for (int i = 0; i < 1 << 14; i++) {
+			size_t len = make_index_key(key);
+			if (i == 1 << 10)
+				ctrie_index_init(&a); /* index a populated trie */
+			switch (rand() % 8) {
+			case 0:
+				ctrie_remove_n(&a, key, len);
+				ctrie_remove_n(&b, key, len);
+				break;
+			case 1:
+				len = rand() % (len + 1);
+				assert(ctrie_remove_prefix_n(&a, key, len)
+				       == ctrie_remove_prefix_n(&b, key, len));
+				break;
+			case 2: {
+				struct ctrie_cursor c;
+				ctrie_cursor_init(&a, &c);
+				ctrie_cursor_insert(&c, key, false);
+				ctrie_cursor_free(&c);
+				ctrie_insert_n(&b, key, len, false);
+				break;
+			}
+			default: {
+				int *da = ctrie_insert_n(&a, key, len, false);
+				int *db = ctrie_insert_n(&b, key, len, false);
+				if (data_size)
+					*da = *db = i;
+			}
+			}
+			len = make_index_key(key);
+			int *da = ctrie_find_n(&a, key, len);
+			int *db = ctrie_find_n(&b, key, len);
+			assert(!da == !db);
+			assert(!data_size || !da || *da == *db);
+		}
+		assert_same(&a, &b);
+		ctrie_index_free(&a);
+		ctrie_index_init(&a);
+		ctrie_insert(&a, "https://example.org/", true);
+		ctrie_insert(&b, "https://example.org/", true);
+		assert(ctrie_contains(&a, "https://example.org/some/path/to"));
+		assert_same(&a, &b);
+		ctrie_free(&a);
+		ctrie_free(&b);
+	}
+}
+
+/*
+ * Test that lookups through the cache agree with lookups without it while the
+ * trie changes, also through paths which don't insert or remove single keys.
+ */
+static void test_cache(void)
+{
+	char key[8];
+	struct ctrie a, b;
+	size_t hits, misses;
+
+	ctrie_init(&a, sizeof(int));
+	ctrie_init(&b, sizeof(int));
+	ctrie_cache_init(&a, 16);
+	for (int i = 0; i < 1 << 16; i++) {
+		size_t len = 1 + rand() % (sizeof(key) - 1);
+		for (size_t j = 0; j < len; j++)
+			key[j] = 'a' + rand() % 3;
+		switch (rand() % 16) {
+		case 0:
+			ctrie_remove_n(&a, key, len);
+			ctrie_remove_n(&b, key, len);
+			break;
+		case 1:
+			len = rand() % len;
+			assert(ctrie_remove_prefix_n(&a, key, len)
+			       == ctrie_remove_prefix_n(&b, key, len));
+			break;
+		case 2:
+			*(int *)ctrie_insert_n(&a, key, len, true) = i;
+			*(int *)ctrie_insert_n(&b, key, len, true) = i;
+			break;
+		case 3:
+			*(int *)ctrie_insert_n(&a, key, len, false) = i;
+			*(int *)ctrie_insert_n(&b, key, len, false) = i;
+			break;
+		}
+		int *da = ctrie_find_n(&a, key, len);
+		int *db = ctrie_find_n(&b, key, len);
+		assert(!da == !db);
+		assert(!da || *da == *db);
+	}
+	ctrie_cache_stats(&a, &hits, &misses);
+	assert(hits && misses && hits + misses >= 1 << 16);
+	assert_same(&a, &b);
+	ctrie_free(&a);
+	ctrie_free(&b);
+}
+
+#ifdef CTRIE_STATS
+static void count_event(struct ctrie *t, enum ctrie_event ev, size_t arg, void *hook_arg)
+{
+	((size_t *)hook_arg)[ev]++;
+}
+
+/*
+ * Test that the counters count and that the hook sees every event.
+ */
+static void test_stats(void)
+{
+	size_t events[CTRIE_EVENT_ALLOC + 1] = { 0 };
+	struct ctrie t;
+
+	ctrie_init(&t, sizeof(int));
+	assert(t.stats->allocs);
+	memset(t.stats, 0, sizeof(*t.stats));
+	t.stats->hook = count_event;
+	t.stats->hook_arg = events;
+
+	ctrie_insert(&t, "abcdef", false);
+	ctrie_insert(&t, "abcxyz", false);
+	ctrie_insert(&t, "some label which does not fit in the node", false);
+	assert(t.stats->resizes && t.stats->resize_bytes);
+	assert(t.stats->labels_embedded && t.stats->labels_heap);
+	assert(ctrie_contains(&t, "abcdef") && !ctrie_contains(&t, "abc"));
+	assert(t.stats->finds == 2 && t.stats->nodes_visited == 5);
+	assert(t.stats->label_bytes == 6);
+	ctrie_remove(&t, "abcxyz");
+	assert(t.stats->cuts == 1);
+
+	assert(events[CTRIE_EVENT_FIND] == t.stats->finds);
+	assert(events[CTRIE_EVENT_RESIZE] == t.stats->resizes);
+	assert(events[CTRIE_EVENT_CUT] == t.stats->cuts);
+	assert(events[CTRIE_EVENT_LABEL_EMBEDDED] == t.stats->labels_embedded);
+	assert(events[CTRIE_EVENT_LABEL_HEAP] == t.stats->labels_heap);
+	assert(events[CTRIE_EVENT_ALLOC] == t.stats->allocs);
+	ctrie_free(&t);
+}
+#endif
+
+#ifdef CTRIE_HIST
+static void *hist_thread(void *arg)
+{
+	struct ctrie *t = arg;
+	for (int i = 0; i < 1000; i++)
+		ctrie_contains(t, "abc");
+	return NULL;
+}
+
+/*
+ * Test that the operations of all threads are recorded and merged.
+ */
+static void test_hist(void)
+{
+	struct ctrie_hist h;
+	struct ctrie_iter it;
+	struct ctrie_cursor c;
+	struct ctrie t;
+	char *key = NULL;
+	size_t key_size = 0;
+	pthread_t thread;
+
+	ctrie_hist_reset();
+	ctrie_init(&t, 0);
+	ctrie_insert(&t, "abc", false);
+	ctrie_insert(&t, "abd", false);
+	assert(ctrie_find(&t, "abc") && !ctrie_contains(&t, "ab"));
+	for (int i = 0; i < 4; i++) { /* exited threads' blocks are reused */
+		assert(!pthread_create(&thread, NULL, hist_thread, &t));
+		assert(!pthread_join(thread, NULL));
+	}
+	ctrie_iter_init(&t, &it);
+	while (ctrie_iter_next(&it, &key, &key_size));
+	ctrie_iter_free(&it);
+	ctrie_remove(&t, "abd");
+	assert(ctrie_emplace(&t, "abc", init_cb, NULL)); /* present, no `init` */
+	ctrie_cursor_init(&t, &c);
+	ctrie_cursor_insert(&c, "xyz", false);
+	ctrie_cursor_free(&c);
+	assert(ctrie_take(&t, "xyz", NULL));
+	assert(ctrie_remove_prefix(&t, "a") == 1);
+	ctrie_free(&t);
+	free(key);
+
+	static const uint64_t counts[CTRIE_OP_COUNT] = {
+		[CTRIE_OP_FIND] = 4002,
+		[CTRIE_OP_INSERT] = 4,
+		[CTRIE_OP_REMOVE] = 3,
+		[CTRIE_OP_ITER_NEXT] = 3,
+	};
+	ctrie_hist_merge(&h);
+	for (size_t op = 0; op < CTRIE_OP_COUNT; op++) {
+		uint64_t total = 0;
+		for (size_t b = 0; b < CTRIE_HIST_BUCKETS; b++)
+			total += h.count[op][b];
+		assert(total == counts[op]);
+		uint64_t p50 = ctrie_hist_percentile(&h, op, 50);
+		assert(p50 <= ctrie_hist_percentile(&h, op, 99));
+		assert(ctrie_hist_percentile(&h, op, 99) <= ctrie_hist_percentile(&h, op, 100));
+	}
+
+	char *buf;
+	size_t len;
+	FILE *f = open_memstream(&buf, &len);
+	assert(f);
+	ctrie_hist_dump(&h, f);
+	fclose(f);
+	assert(strstr(buf, "iter_next"));
+	free(buf);
+
+	ctrie_hist_reset();
+	ctrie_hist_merge(&h);
+	assert(!ctrie_hist_percentile(&h, CTRIE_OP_FIND, 100));
+}
+#endif
+
+static int cmp_builder_keys(const void *a, const void *b)
+{
+	return strcmp(*(char **)a, *(char **)b);
+}
+
+/*
+ * Build tries out of sorted keys, also holding bytes with the high bit set,
+ * and check that they match tries of the same keys inserted one by one.
+ */
+static void test_builder(void)
+{
+	static const char chars[] = "ab\xe9\x80";
+	char *keys[1 << 12];
+	struct ctrie a, b;
+	struct ctrie_builder bld;
+
+	for (size_t i = 0; i < sizeof(keys) / sizeof(*keys); i++) {
+		size_t len = 1 + rand() % KEY_MAX_LEN;
+		assert((keys[i] = malloc(len + 1)));
+		for (size_t j = 0; j < len; j++)
+			keys[i][j] = chars[rand() % 4];
+		keys[i][len] = '\0';
+	}
+	qsort(keys, sizeof(keys) / sizeof(*keys), sizeof(*keys), cmp_builder_keys);
+	for (size_t data_size = 0; data_size <= sizeof(int); data_size += sizeof(int)) {
+		ctrie_init(&a, data_size);
+		ctrie_init(&b, data_size);
+		assert(!ctrie_builder_init(&a, &bld));
+		for (int i = 0; i < (int)(sizeof(keys) / sizeof(*keys)); i++) {
+			bool wildcard = rand() % 16 == 0;
+			assert(!ctrie_builder_add(&bld, keys[i], strlen(keys[i]),
+			                          wildcard, &i));
+			void *d = ctrie_insert(&b, keys[i], wildcard);
+			if (data_size)
+				*(int *)d = i;
+		}
+		assert(ctrie_builder_add(&bld, "a", 1, false, NULL) && errno == EINVAL);
+		assert(ctrie_builder_add(&bld, "", 0, false, NULL) && errno == EINVAL);
+		ctrie_builder_finish(&bld);
+		assert_same(&a, &b);
+		assert(ctrie_builder_init(&a, &bld) && errno == EINVAL);
+		ctrie_free(&a);
+
+		ctrie_init(&a, data_size);
+		assert(!ctrie_builder_init(&a, &bld));
+		ctrie_builder_finish(&bld);
+		struct ctrie_iter it;
+		char *k = NULL;
+		size_t k_size = 0;
+		ctrie_iter_init(&a, &it);
+		assert(!ctrie_iter_next(&it, &k, &k_size));
+		ctrie_iter_free(&it);
+		free(k);
+		ctrie_free(&a);
+		ctrie_free(&b);
+	}
+	for (size_t i = 0; i < sizeof(keys) / sizeof(*keys); i++)
+		free(keys[i]);
+}
+
+/*
+ * Build tries of `n` `keys` in parallel and check that they match tries of the
+ * same keys inserted one by one, also once both are modified.
+ */
+static void check_build_parallel(const char **keys, size_t n, int threads)
+{
+	struct ctrie a, b;
+
+	for (size_t data_size = 0; data_size <= sizeof(int); data_size += sizeof(int)) {
+		ctrie_init(&a, data_size);
+		ctrie_init(&b, data_size);
+		if (rand() % 2)
+			ctrie_index_init(&a);
+		assert(!ctrie_build_parallel(&a, keys, n, threads));
+		for (size_t i = 0; i < n; i++)
+			ctrie_insert(&b, keys[i], false);
+		assert_same(&a, &b);
+		for (size_t i = 0; i < n; i++) {
+			const char *k = keys[rand() % n];
+			if (rand() % 2) {
+				ctrie_remove(&a, k);
+				ctrie_remove(&b, k);
+			} else {
+				ctrie_insert_n(&a, k, 1 + rand() % strlen(k), true);
+				ctrie_insert_n(&b, k, 1 + rand() % strlen(k), true);
+			}
+		}
+		ctrie_free(&a);
+		ctrie_free(&b);
+	}
+}
+
+static void test_build_parallel(void)
+{
+	static const char chars[] = "ab\xe9\x80";
+	static const char *same[] = { "abc", "abc", "abc" };
+	static const char *prefix[] = { "abd", "ab", "abc\x80", "ab", "abc" };
+	const char *empty[] = { "a", "" };
+	char *keys[1 << 12];
+	size_t nkeys = sizeof(keys) / sizeof(*keys);
+	struct ctrie t;
+
+	for (int shared = 0; shared < 2; shared++) {
+		for (size_t i = 0; i < nkeys; i++) {
+			size_t len = (shared ? 3 : 0) + 1 + rand() % KEY_MAX_LEN;
+			assert((keys[i] = malloc(len + 1)));
+			for (size_t j = 0; j < len; j++)
+				keys[i][j] = j < 3 && shared ? 'x' : chars[rand() % 4];
+			keys[i][len] = '\0';
+		}
+		check_build_parallel((const char **)keys, nkeys, 1);
+		check_build_parallel((const char **)keys, nkeys, 4);
+		check_build_parallel((const char **)keys, nkeys, 0);
+		for (size_t i = 0; i < nkeys; i++)
+			free(keys[i]);
+	}
+	for (size_t i = 0; i < nkeys; i++) { /* long keys sharing long runs */
+		assert((keys[i] = malloc(8 * 16 + 8)));
+		make_index_key(keys[i]);
+	}
+	check_build_parallel((const char **)keys, nkeys, 3);
+	for (size_t i = 0; i < nkeys; i++)
+		free(keys[i]);
+	check_build_parallel(same, 3, 2);
+	check_build_parallel(prefix, 5, 2);
+
+	ctrie_init(&t, 0);
+	assert(!ctrie_build_parallel(&t, NULL, 0, 2));
+	assert(ctrie_build_parallel(&t, empty, 2, 2) && errno == EINVAL);
+	ctrie_insert(&t, "a", false);
+	assert(ctrie_build_parallel(&t, same, 3, 2) && errno == EINVAL);
+	ctrie_free(&t);
+}
+
+static void match_count_cb(const char *key, void *data, void *arg)
+{
+	++*(size_t *)arg;
+}
+
+/*
+ * Check that the minimized trie `a` holds the same keys as `b` and that it's
+ * searched the same.
+ */
+static void check_minimized(struct ctrie *a, struct ctrie *b, const char *query)
+{
+	size_t na = 0, nb = 0;
+	assert(a->frozen);
+	assert_same(a, b);
+	ctrie_fuzzy(a, query, 2, count_cb, &na);
+	ctrie_fuzzy(b, query, 2, count_cb, &nb);
+	assert(na == nb);
+	na = nb = 0;
+	ctrie_match(a, "*ing", match_count_cb, &na);
+	ctrie_match(b, "*ing", match_count_cb, &nb);
+	assert(na == nb);
+}
+
+/*
+ * Minimize tries of random keys, also wild-cards, and of English words.
+ */
+static void test_minimize(void)
+{
+	struct ctrie a, b;
+	char key[KEY_MAX_LEN + 1];
+	char *word = NULL;
+	size_t word_size = 0;
+	ssize_t len;
+	char *buf;
+	size_t buf_len;
+	FILE *f;
+
+	ctrie_init(&a, 0);
+	ctrie_init(&b, 0);
+	assert(!ctrie_minimize(&a));
+	assert(a.frozen);
+	ctrie_free(&a);
+
+	/* a minimized trie is read-only */
+	ctrie_init(&a, 0);
+	ctrie_insert(&a, "abc", false);
+	ctrie_insert(&a, "abd", false);
+	ctrie_insert(&a, "xbd", true);
+	assert(!ctrie_minimize(&a));
+	errno = 0;
+	assert(ctrie_insert(&a, "abc", false) && !errno);
+	assert(ctrie_insert(&a, "xbd", true) && !errno);
+	assert(!ctrie_insert(&a, "ab", false) && errno == EPERM);
+	errno = 0;
+	assert(!ctrie_insert(&a, "abc", true) && errno == EPERM);
+	errno = 0;
+	assert(!ctrie_remove_if(&a, "abc", NULL, NULL) && errno == EPERM);
+	errno = 0;
+	assert(!ctrie_take(&a, "abd", NULL) && errno == EPERM);
+	errno = 0;
+	assert(!ctrie_remove_prefix(&a, "a") && errno == EPERM);
+	ctrie_remove(&a, "xbd");
+	ctrie_remove(&a, "zz");
+	struct ctrie_cursor c;
+	ctrie_cursor_init(&a, &c);
+	errno = 0;
+	assert(ctrie_cursor_insert(&c, "abd", false) && !errno);
+	assert(!ctrie_cursor_insert(&c, "abe", false) && errno == EPERM);
+	ctrie_cursor_free(&c);
+	assert(ctrie_contains(&a, "abc") && ctrie_contains(&a, "abd"));
+	assert(ctrie_contains(&a, "xbd") && !ctrie_contains(&a, "ab"));
+	ctrie_free(&a);
+
+	ctrie_init(&a, 0);
+	ctrie_index_init(&a);
+	rst(key);
+	do {
+		if (rand() % 3)
+			continue;
+		char *k = key + rand() % KEY_MAX_LEN;
+		bool wildcard = rand() % 8 == 0;
+		ctrie_insert(&a, k, wildcard);
+		ctrie_insert(&b, k, wildcard);
+	} while (inc(key));
+	assert(!ctrie_minimize(&a));
+	assert(!a.index);
+	ctrie_index_init(&a);
+	assert(!a.index);
+	assert(!ctrie_minimize(&a)); /* again */
+	check_minimized(&a, &b, "abcab");
+	rst(key);
+	do {
+		char *k = key + rand() % KEY_MAX_LEN;
+		assert(ctrie_contains(&a, k) == ctrie_contains(&b, k));
+	} while (inc(key));
+
+	assert((f = open_memstream(&buf, &buf_len)));
+	assert(!ctrie_save(&a, f));
+	fclose(f);
+	ctrie_free(&a);
+	assert((f = fmemopen(buf, buf_len, "r")));
+	assert(!ctrie_load(&a, f));
+	fclose(f);
+	free(buf);
+	assert(!a.frozen);
+	assert_same(&a, &b);
+	ctrie_free(&a);
+	ctrie_free(&b);
+
+	ctrie_init(&a, 0);
+	ctrie_init(&b, 0);
+	assert((f = fopen(WORDS_FILE, "r")));
+	while ((len = getline(&word, &word_size, f)) > 0) {
+		word[len - 1] = '\0';
+		ctrie_insert(&a, word, false);
+		ctrie_insert(&b, word, false);
+	}
+	assert(!ctrie_minimize(&a));
+	check_minimized(&a, &b, "minimize");
+	rewind(f);
+	while ((len = getline(&word, &word_size, f)) > 0) {
+		word[len - 1] = '\0';
+		assert(ctrie_contains(&a, word));
+		word[len - 1] = 'q';
+		assert(ctrie_contains(&a, word) == ctrie_contains(&b, word));
+	}
+	fclose(f);
+	free(word);
+	ctrie_free(&a);
+	ctrie_free(&b);
+
+	ctrie_init(&a, sizeof(int));
+	assert(ctrie_minimize(&a) && errno == EINVAL);
+	assert(!a.frozen);
+	ctrie_free(&a);
+}
+
+/*
+ * Check that the words of the numbered trie `a` are numbered in the order in
+ * which `b`, which holds the same keys, iterates them.
+ */
+static void check_numbered(struct ctrie *a, struct ctrie *b, size_t nwords)
+{
+	struct ctrie_iter it;
+	char *key = NULL, *k = NULL;
+	size_t key_size = 0, k_size = 0, id, n = 0;
+
+	ctrie_iter_init(b, &it);
+	for (; ctrie_iter_next(&it, &key, &key_size); n++) {
+		assert(ctrie_word_id(a, key, &id) && id == n);
+		assert(ctrie_id_to_key(a, n, &k, &k_size) && !strcmp(k, key));
+	}
+	ctrie_iter_free(&it);
+	assert(n == nwords);
+	assert(!ctrie_id_to_key(a, n, &k, &k_size));
+	free(key);
+	free(k);
+}
+
+/*
+ * Number the words of tries of random keys, also wild-cards, and of English
+ * words.
+ */
+static void test_number(void)
+{
+	struct ctrie a, b;
+	char key[KEY_MAX_LEN + 1];
+	char *word = NULL, *k = NULL;
+	size_t word_size = 0, k_size = 0, n, id;
+	ssize_t len;
+	FILE *f;
+
+	ctrie_init(&a, 0);
+	assert(!ctrie_number(&a, &n) && !n);
+	assert(a.frozen && a.numbered);
+	assert(!ctrie_word_id(&a, "a", &id));
+	assert(!ctrie_id_to_key(&a, 0, &k, &k_size));
+	ctrie_free(&a);
+
+	ctrie_init(&a, 0);
+	ctrie_init(&b, 0);
+	rst(key);
+	do {
+		if (rand() % 3)
+			continue;
+		char *p = key + rand() % KEY_MAX_LEN;
+		bool wildcard = rand() % 8 == 0;
+		ctrie_insert(&a, p, wildcard);
+		ctrie_insert(&b, p, wildcard);
+	} while (inc(key));
+	assert(!ctrie_number(&a, &n));
+	assert(!ctrie_number(&a, &id) && id == n); /* again */
+	check_minimized(&a, &b, "abcab");
+	check_numbered(&a, &b, n);
+	rst(key);
+	do {
+		/* a wild-card prefix of `key` has the ID of the node found */
+		bool found = ctrie_word_id(&a, key, &id);
+		assert(found == ctrie_contains(&b, key));
+		if (found) {
+			assert(ctrie_id_to_key(&a, id, &k, &k_size));
+			assert(!strncmp(k, key, strlen(k)));
+			assert(ctrie_find(&b, k) == ctrie_find(&b, key));
+		}
+	} while (inc(key));
+	ctrie_free(&a);
+	ctrie_free(&b);
+
+	ctrie_init(&a, 0);
+	ctrie_init(&b, 0);
+	assert((f = fopen(WORDS_FILE, "r")));
+	while ((len = getline(&word, &word_size, f)) > 0) {
+		word[len - 1] = '\0';
+		ctrie_insert(&a, word, false);
+		ctrie_insert(&b, word, false);
+	}
+	fclose(f);
+	free(word);
+	assert(!ctrie_number(&a, &n));
+	check_numbered(&a, &b, n);
+	ctrie_free(&a);
+	ctrie_free(&b);
+
+	ctrie_init(&a, 0);
+	assert(!ctrie_minimize(&a));
+	assert(ctrie_number(&a, &n) && errno == EINVAL);
+	ctrie_free(&a);
+	ctrie_init(&a, sizeof(int));
+	assert(ctrie_number(&a, &n) && errno == EINVAL);
+	assert(!a.frozen);
+	ctrie_free(&a);
+	free(k);
+}
+
+/*
+ * Modify a trie through a log, checkpointing now and then, and check that
+ * it's recovered intact, also when the log ends with a torn batch.
+ */
+static void test_wal(void)
+{
+	struct ctrie a, b;
+	struct ctrie_wal w;
+	char dir[] = "/tmp/ctrie-test-XXXXXX";
+	char path[sizeof(dir) + 32];
+	char key[KEY_MAX_LEN + 1];
+
+	assert(mkdtemp(dir));
+	ctrie_init(&a, sizeof(int));
+	ctrie_init(&b, sizeof(int));
+	assert(!ctrie_wal_open(&w, &a, dir));
+	w.batch_size = 256;
+	rst(key);
+	do {
+		char *k = key + rand() % KEY_MAX_LEN;
+		int v = rand();
+		switch (rand() % 4) {
+		case 0:
+			ctrie_wal_remove(&w, k);
+			ctrie_remove(&b, k);
+			break;
+		case 1:
+			ctrie_wal_insert(&w, k, true, NULL);
+			ctrie_insert(&b, k, true);
+			break;
+		default:
+			*(int *)ctrie_insert(&b, k, false) = v;
+			assert(*(int *)ctrie_wal_insert(&w, k, false, &v) == v);
+		}
+		if (rand() % 64 == 0)
+			assert(!ctrie_wal_commit(&w));
+		if (rand() % 256 == 0)
+			assert(!ctrie_wal_checkpoint(&w));
+	} while (inc(key));
+	assert(!ctrie_wal_close(&w));
+	assert_same(&a, &b);
+	ctrie_free(&a);
+
+	ctrie_init(&a, sizeof(int));
+	ctrie_index_init(&a);
+	ctrie_cache_init(&a, 64);
+	assert(!ctrie_wal_open(&w, &a, dir));
+	assert(a.index && a.cache); /* kept across the checkpoint load */
+	assert_same(&a, &b);
+	uint64_t log_size = w.log_size;
+	assert(ctrie_wal_insert(&w, "abcabc", false, NULL));
+	assert(!ctrie_wal_close(&w));
+	ctrie_free(&a);
+
+	snprintf(path, sizeof(path), "%s/log", dir);
+	assert(!truncate(path, log_size + 9));
+	ctrie_init(&a, sizeof(int));
+	assert(!ctrie_wal_open(&w, &a, dir));
+	assert(w.log_size == log_size);
+	assert_same(&a, &b);
+	assert(!ctrie_wal_close(&w));
+	ctrie_free(&a);
+
+	ctrie_init(&a, sizeof(long));
+	assert(ctrie_wal_open(&w, &a, dir) && errno == EINVAL);
+	ctrie_free(&a);
+
+	/* the trie to recover into must be empty */
+	ctrie_init(&a, sizeof(int));
+	ctrie_insert(&a, "x", false);
+	assert(ctrie_wal_open(&w, &a, dir) && errno == EINVAL);
+	assert(ctrie_contains(&a, "x") && !ctrie_contains(&a, "abcabc"));
+	ctrie_free(&a);
+
+	ctrie_free(&b);
+	snprintf(path, sizeof(path), "%s/log", dir);
+	unlink(path);
+	snprintf(path, sizeof(path), "%s/checkpoint", dir);
+	unlink(path);
+	rmdir(dir);
+}
+
+/*
+ * Save tries into memory and load them back, also from truncated streams.
+ */
+static void test_save(void)
+{
+	struct ctrie a, b;
+	char key[KEY_MAX_LEN + 1];
+	char *long_key = malloc(LONG_KEY_TEST_SIZE + 1);
+	char *buf, *buf2;
+	size_t len, len2;
+	FILE *f;
+
+	assert(long_key);
+	memset(long_key, 'b', LONG_KEY_TEST_SIZE);
+	long_key[LONG_KEY_TEST_SIZE] = '\0';
+	for (size_t data_size = 0; data_size <= sizeof(int); data_size += sizeof(int)) {
+		ctrie_init(&a, data_size);
+		rst(key);
+		do {
+			if (rand() % 3)
+				continue;
+			char *k = key + rand() % KEY_MAX_LEN;
+			void *d = ctrie_insert(&a, k, rand() % 8 == 0);
+			if (data_size)
+				*(int *)d = rand();
+		} while (inc(key));
+		ctrie_insert(&a, long_key, false);
+
+		assert((f = open_memstream(&buf, &len)));
+		assert(!ctrie_save(&a, f));
+		fclose(f);
+		assert((f = fmemopen(buf, len, "r")));
+		assert(!ctrie_load(&b, f));
+		fclose(f);
+		assert(b.data_size == data_size);
+		assert_same(&a, &b);
+
+		assert((f = open_memstream(&buf2, &len2)));
+		assert(!ctrie_save(&b, f));
+		fclose(f);
+		assert(len2 == len && !memcmp(buf, buf2, len));
+		free(buf2);
+		ctrie_free(&b);
+
+		for (size_t n = 0; n < 64; n++) {
+			size_t cut = rand() % len;
+			assert((f = fmemopen(buf, cut, "r")));
+			assert(ctrie_load(&b, f) && errno == EINVAL);
+			fclose(f);
+		}
+		free(buf);
+		ctrie_free(&a);
+	}
+	free(long_key);
+}
+
+/*
+ * Write `len` bytes at `buf` to a new temporary file, whose path is stored
+ * into `path`.
+ */
+static void write_temp(char path[], const char *buf, size_t len)
+{
+	int fd = mkstemp(path);
+	assert(fd >= 0);
+	assert(write(fd, buf, len) == (ssize_t)len);
+	close(fd);
+}
+
+static size_t put_varint(char *p, size_t v)
+{
+	size_t n = 0;
+	for (; v >= 0x80; v >>= 7)
+		p[n++] = v | 0x80;
+	p[n++] = v;
+	return n;
+}
+
+/*
+ * Load a stream of `data_size` and either an empty root or, if `leaf`, a root
+ * with a single child `a` whose label is `len` long but truncated, from a file
+ * and, if `mem`, from memory, whose size `ctrie_load` can't tell.
+ */
+static int load_corrupt(size_t data_size, size_t len, bool leaf, bool mem)
+{
+	char path[sizeof("/tmp/ctrie-test-XXXXXX")] = "/tmp/ctrie-test-XXXXXX";
+	char buf[64] = "ctrie\0v1";
+	size_t n = 8;
+	struct ctrie t;
+	int ret;
+	FILE *f;
+
+	n += put_varint(buf + n, data_size);
+	if (leaf) {
+		memcpy(buf + n, "\1\0\0a", 4);
+		n += 4;
+		buf[n++] = 0;
+		n += put_varint(buf + n, len);
+		memcpy(buf + n, "xyz", 3);
+		n += 3;
+	} else {
+		memcpy(buf + n, "\0\0\0", 3);
+		n += 3;
+	}
+	write_temp(path, buf, n);
+	assert((f = fopen(path, "r")));
+	ret = ctrie_load(&t, f);
+	fclose(f);
+	unlink(path);
+	if (!ret)
+		ctrie_free(&t);
+	if (!mem)
+		return ret;
+	assert((f = fmemopen(buf, n, "r")));
+	assert(ctrie_load(&t, f) == ret);
+	fclose(f);
+	if (!ret)
+		ctrie_free(&t);
+	return ret;
+}
+
+/*
+ * Corrupt label lengths and data sizes fail the load instead of being
+ * allocated.
+ */
+static void test_load_corrupt(void)
+{
+	assert(load_corrupt(0, SIZE_MAX, true, true) == -1 && errno == EINVAL);
+	assert(load_corrupt(0, SIZE_MAX - 1, true, true) == -1 && errno == EINVAL);
+	assert(load_corrupt(0, (size_t)1 << 39, true, true) == -1
+	       && errno == EINVAL);
+	assert(load_corrupt(sizeof(int), (size_t)1 << 39, true, true) == -1
+	       && errno == EINVAL);
+	assert(load_corrupt(SIZE_MAX, 0, false, true) == -1 && errno == EINVAL);
+	assert(load_corrupt((size_t)1 << 40, 0, false, false) == -1
+	       && errno == EINVAL);
+	assert(load_corrupt(1 << 20, 0, true, false) == -1 && errno == EINVAL);
+	/* an empty trie holds no data, so its data size may exceed the stream */
+	assert(!load_corrupt(sizeof(int), 0, false, true));
+}
+
+/*
+ * Load keys from files of lines, sorted or not, into empty and populated
+ * tries, and check that the tries match tries of the same keys inserted one
+ * by one.
+ */
+static void test_load_lines(void)
+{
+	char path[sizeof("/tmp/ctrie-test-XXXXXX")];
+	char key[KEY_MAX_LEN + 1];
+	struct ctrie a, b;
+	char *buf;
+	size_t len;
+	FILE *f;
+
+	for (int sorted = 0; sorted < 2; sorted++) {
+		assert((f = open_memstream(&buf, &len)));
+		ctrie_init(&b, 0);
+		rst(key);
+		do {
+			char *k = sorted ? key : key + rand() % KEY_MAX_LEN;
+			if (rand() % 2)
+				continue;
+			fprintf(f, "%s%s\n", k, rand() % 2 ? "\r" : "");
+			if (rand() % 16 == 0)
+				fputs("\r\n\n", f); /* empty lines */
+			ctrie_insert(&b, k, true);
+		} while (inc(key));
+		fputs("cc", f); /* no newline at the end */
+		ctrie_insert(&b, "cc", true);
+		fclose(f);
+		strcpy(path, "/tmp/ctrie-test-XXXXXX");
+		write_temp(path, buf, len);
+
+		ctrie_init(&a, 0);
+		assert(!ctrie_load_lines(&a, path,
+		                         CTRIE_LINES_WILDCARD | CTRIE_LINES_CRLF));
+		assert_same(&a, &b);
+		ctrie_free(&a);
+
+		ctrie_init(&a, 0);
+		ctrie_insert(&a, "abc", false);
+		ctrie_insert(&b, "abc", false);
+		assert(!ctrie_load_lines(&a, path,
+		                         CTRIE_LINES_WILDCARD | CTRIE_LINES_CRLF));
+		assert_same(&a, &b);
+		ctrie_free(&a);
+		ctrie_free(&b);
+		unlink(path);
+		free(buf);
+	}
+
+	strcpy(path, "/tmp/ctrie-test-XXXXXX");
+	write_temp(path, "a\r\nb\n", 5);
+	ctrie_init(&a, 0);
+	assert(!ctrie_load_lines(&a, path, 0));
+	assert(ctrie_contains(&a, "a\r") && ctrie_contains(&a, "b"));
+	ctrie_free(&a);
+	unlink(path);
+
+	strcpy(path, "/tmp/ctrie-test-XXXXXX");
+	write_temp(path, "a\nb\0c\n", 6);
+	ctrie_init(&a, 0);
+	assert(ctrie_load_lines(&a, path, 0) && errno == EINVAL);
+	assert(!ctrie_contains(&a, "a"));
+	ctrie_free(&a);
+	unlink(path);
+
+	strcpy(path, "/tmp/ctrie-test-XXXXXX");
+	write_temp(path, "", 0);
+	ctrie_init(&a, 0);
+	assert(!ctrie_load_lines(&a, path, 0));
+	unlink(path);
+	assert(ctrie_load_lines(&a, path, 0) && errno == ENOENT);
+	ctrie_free(&a);
+}
+
 int main(void)
 {
 	time_t t = time(NULL);
@@ -235,9 +2027,39 @@ int main(void)
 	test_not_contains_empty();
 	test_insert_english();
 	test_insert_long_keys();
+	test_split_big_label();
+	test_big_data();
 	test_insert_seq();
 	test_iter_seq();
 	test_remove_seq();
+	test_remove_flags();
+	test_fuzzy();
+	test_match();
+	test_scan();
+	test_set_ops();
+	test_cursor();
+	test_inline_leaves();
+	test_key_len();
+	test_upsert();
+	test_take();
+	test_remove_prefix();
+	test_deep();
+	test_index();
+	test_cache();
+	test_builder();
+	test_build_parallel();
+	test_minimize();
+	test_number();
+#ifdef CTRIE_STATS
+	test_stats();
+#endif
+#ifdef CTRIE_HIST
+	test_hist();
+#endif
+	test_wal();
+	test_save();
+	test_load_corrupt();
+	test_load_lines();
 
 	return EXIT_SUCCESS;
 }